@@ -0,0 +1,109 @@
+// bitmap.h: Bit-packed allocation bitmap
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+// One bit per item (block or inode), set while the item is taken, packed 64
+// to a word.  A summary level keeps one bit per word, set while that word is
+// full, so a search passes over 4096 taken items by looking at a single
+// summary word; runs of full summary words are skipped four at a time with
+// AVX2 on CPUs that have it.  Within a word the free bit is found with ctz.
+//
+// allocate() is next-fit: it starts where the previous allocation left off
+// and wraps around at the end, so a filling disk is not rescanned from its
+// (long since taken) front on every allocation.
+//
+// The bits past the last item are kept set, so the last word is full when
+// all its items are and no search ever returns them.
+class Bitmap {
+private:
+    std::vector<uint64_t>   Words;  // One bit per item
+    std::vector<uint64_t>   Full;   // One bit per word, set if the word is full
+    size_t		    Size;   // Number of items
+    size_t		    Used;   // Number of items taken
+    size_t		    Cursor; // Item the next allocation starts from
+
+    // Refresh the summary bit of a word
+    // @param	word	    Word that changed
+    void update(size_t word);
+
+    // Return first word at or after a word that is not full, or NONE
+    // @param	word	    Word to start from
+    size_t open_word(size_t word) const;
+
+public:
+    // Returned when there is no free item
+    const static size_t NONE = SIZE_MAX;
+
+    // Constructor
+    // @param	nitems	    Number of items, all free
+    Bitmap(size_t nitems = 0);
+
+    // Resize and free every item
+    // @param	nitems	    Number of items
+    void reset(size_t nitems);
+
+    // Return number of items
+    size_t size() const { return Size; }
+
+    // Return number of items taken
+    size_t used() const { return Used; }
+
+    // Return number of words the items are packed into
+    size_t words() const { return Words.size(); }
+
+    // Return whether or not an item is taken
+    // @param	item	    Item to check
+    bool test(size_t item) const { return item < Size && (Words[item / 64] >> (item % 64) & 1); }
+
+    // Take an item
+    // @param	item	    Item to take
+    void set(size_t item);
+
+    // Free an item
+    // @param	item	    Item to free
+    void clear(size_t item);
+
+    // Take a run of items, counting the ones that were free with popcount
+    // @param	item	    First item of run
+    // @param	nitems	    Number of items in run
+    void set_range(size_t item, size_t nitems);
+
+    // Free a run of items
+    // @param	item	    First item of run
+    // @param	nitems	    Number of items in run
+    void clear_range(size_t item, size_t nitems);
+
+    // Return number of items taken in a run, counted with popcount
+    // @param	item	    First item of run
+    // @param	nitems	    Number of items in run
+    size_t count(size_t item, size_t nitems) const;
+
+    // Return first free item at or after an item, or NONE
+    // @param	item	    Item to start from
+    size_t find_free(size_t item = 0) const;
+
+    // Return first taken item at or after an item, or NONE
+    // @param	item	    Item to start from
+    size_t find_taken(size_t item = 0) const;
+
+    // Take the first free item at or after the cursor, wrapping around
+    // @return		    Item taken, or NONE if every item is taken
+    size_t allocate();
+
+    // Take exactly the items set in packed words, as written by store()
+    // @param	words	    Words to read, words() of them
+    void load(const uint64_t *words);
+
+    // Copy the items out as packed words, with the bits past the last item
+    // clear
+    // @param	words	    Words to write, words() of them
+    void store(uint64_t *words) const;
+
+    // Return whether or not the full-word skip runs on AVX2
+    static bool vectorized();
+};
@@ -0,0 +1,158 @@
+// block_device.h: Block device interface
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+
+class IOProfile;
+
+// Interface between FileSystem and whatever stores its blocks.  Backends
+// implement read and write; the multi-block calls default to looping over
+// them and are overridden where a backend can do better.
+//
+// Block numbers are 64-bit throughout, so byte offsets never overflow on
+// images past 2 GiB.
+//
+// Implementations are expected to be safe for concurrent callers.
+class BlockDevice {
+protected:
+    // Counter bumped concurrently by I/O paths; relaxed ordering is enough
+    // because nothing is ever synchronized through it
+    class Counter {
+    private:
+    	std::atomic<size_t> Value;
+
+    public:
+    	Counter() : Value(0) {}
+    	Counter &operator++(int) { Value.fetch_add(1, std::memory_order_relaxed); return *this; }
+    	Counter &operator+=(size_t n) { Value.fetch_add(n, std::memory_order_relaxed); return *this; }
+    	Counter &operator=(size_t n) { Value.store(n, std::memory_order_relaxed); return *this; }
+    	operator size_t() const { return Value.load(std::memory_order_relaxed); }
+    };
+
+    size_t  Blocks;	    // Number of blocks on device
+    Counter Reads;	    // Number of reads performed
+    Counter Writes;	    // Number of writes performed
+    std::atomic<size_t> Mounts;	// Number of mounts
+
+    // Check parameters
+    // @param	blocknum    Block to operate on
+    // @param	data	    Buffer to operate on
+    // Throws invalid_argument exception on error.
+    void sanity_check(uint64_t blocknum, char *data);
+
+    // Check that a run of blocks lies within the device
+    // @param	blocknum    First block of run
+    // @param	nblocks	    Number of blocks in run
+    // Throws invalid_argument exception on error.
+    void range_check(uint64_t blocknum, size_t nblocks);
+
+    // Return whether or not a block holds nothing but zeros
+    // @param	data	    Block to check
+    static bool zero_block(const char *data);
+
+public:
+    // Number of bytes per block
+    const static size_t BLOCK_SIZE = 4096;
+
+    // One block of a scatter-gather request
+    struct BlockRequest {
+    	uint64_t blocknum;  // Block to operate on
+    	char	*data;	    // Buffer to operate on
+    };
+
+    // Default constructor
+    BlockDevice() : Blocks(0), Mounts(0) {}
+
+    // Destructor
+    virtual ~BlockDevice() {}
+
+    // Return size of device (in terms of blocks)
+    size_t size() const { return Blocks; }
+
+    // Return whether or not device is mounted
+    bool mounted() const { return Mounts > 0; }
+
+    // Increment mounts
+    void mount() { Mounts++; }
+
+    // Decrement mounts
+    void unmount() {
+    	size_t mounts = Mounts;
+    	while (mounts > 0 && !Mounts.compare_exchange_weak(mounts, mounts - 1)) {}
+    }
+
+    // Return number of blocks read so far
+    size_t reads() const { return Reads; }
+
+    // Return number of blocks written so far
+    size_t writes() const { return Writes; }
+
+    // Return number of images the block space is striped across
+    virtual size_t stripe_members() const { return 1; }
+
+    // Return number of blocks per stripe unit (0 if not striped)
+    virtual size_t stripe_unit() const { return 0; }
+
+    // Return profile recording the I/O done on this device (nullptr if the
+    // device is not being profiled)
+    virtual IOProfile *profile() { return nullptr; }
+
+    // Tell the device whether a run of blocks holds file system metadata;
+    // devices that decide where blocks live keep metadata on fast storage
+    // @param	blocknum    First block of run
+    // @param	nblocks	    Number of blocks in run
+    // @param	metadata    Whether the run is metadata
+    virtual void metadata(uint64_t blocknum, size_t nblocks, bool metadata) {}
+
+    // Write out anything the device has accepted but not yet written;
+    // devices that write through have nothing to do
+    virtual void flush() {}
+
+    // Flush, then wait until everything written so far is on stable
+    // storage; devices with nothing behind them only flush
+    virtual void sync() { flush(); }
+
+    // Read block from device
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    virtual void read(uint64_t blocknum, char *data) = 0;
+
+    // Write block to device
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    virtual void write(uint64_t blocknum, char *data) = 0;
+
+    // Drop the contents of a run of blocks; afterwards they read back as
+    // zeros.  The default writes zeros, backends that can release the space
+    // instead override it.
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    virtual void discard(uint64_t blocknum, size_t nblocks);
+
+    // Read a contiguous run of blocks
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    virtual void read_blocks(uint64_t blocknum, size_t nblocks, char *data);
+
+    // Write a contiguous run of blocks
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    virtual void write_blocks(uint64_t blocknum, size_t nblocks, char *data);
+
+    // Read a list of blocks
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    virtual void readv(const BlockRequest *requests, size_t count);
+
+    // Write a list of blocks; when a block appears more than once the last
+    // request wins
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    virtual void writev(const BlockRequest *requests, size_t count);
+};
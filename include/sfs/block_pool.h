@@ -0,0 +1,119 @@
+// block_pool.h: Pool of block-aligned buffers
+
+#pragma once
+
+#include <stdlib.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+// Hands out Disk::BLOCK_SIZE buffers aligned to Disk::BLOCK_SIZE, as
+// O_DIRECT I/O requires.  Buffers are carved from one aligned allocation;
+// once that is used up further buffers are allocated one at a time and
+// kept for reuse.  The pool may be shared between threads.
+//
+// Freed buffers go to one of several free lists picked by the calling
+// thread, so threads that acquire and release their own buffers rarely
+// meet on a lock; a thread whose list runs dry carves a new buffer from
+// the slab or takes one from another thread's list.  Buffers are never
+// cleared: they hold whatever they last held.
+//
+// The slab can be backed by huge pages, which lets a large cache be mapped
+// with a few TLB entries instead of one per block.  Explicit huge pages
+// (MAP_HUGETLB) are tried first and transparent huge pages requested when
+// none are reserved.
+class BlockPool {
+public:
+    // Memory the slab is taken from
+    enum class Backing {
+    	HEAP,	    // Aligned heap allocation
+    	HUGE_PAGES, // Anonymous mapping on huge pages where available
+    };
+
+private:
+    // Free list used by some of the threads
+    struct Shard {
+    	std::mutex	    Lock;   // Guards Free
+    	std::vector<char *> Free;   // Buffers ready to be handed out
+    };
+
+    const static size_t SHARDS = 8;
+
+    Shard		Shards[SHARDS];	// Free lists by thread
+    std::mutex		Lock;	    // Guards everything below
+    char		*Slab;	    // Preallocated buffers
+    size_t		SlabBlocks; // Number of buffers in slab
+    size_t		SlabUsed;   // Buffers carved from slab so far
+    size_t		SlabBytes;  // Bytes mapped for slab, if mapped
+    bool		Huge;	    // Whether slab is on MAP_HUGETLB pages
+    std::vector<char *>	Extra;	    // Buffers allocated beyond the slab
+    std::multimap<size_t, char *> Runs; // Free runs by number of blocks
+    std::vector<char *>	RunMemory;  // Every run ever allocated
+
+    // Return free list of the calling thread
+    Shard &shard();
+
+public:
+    // Constructor
+    // @param	nblocks	    Number of buffers to preallocate
+    // @param	backing	    Memory to take them from
+    // Throws bad_alloc exception on error.
+    BlockPool(size_t nblocks, Backing backing = Backing::HEAP);
+
+    // Destructor
+    ~BlockPool();
+
+    // Take a buffer from the pool
+    // Throws bad_alloc exception on error.
+    char *acquire();
+
+    // Return a buffer to the pool
+    // @param	buffer	    Buffer obtained from acquire
+    void release(char *buffer);
+
+    // Take a run of contiguous buffers, for multi-block I/O
+    // @param	nblocks	    Number of blocks in run
+    // Throws bad_alloc exception on error.
+    char *acquire_run(size_t nblocks);
+
+    // Return a run of buffers to the pool
+    // @param	run	    Run obtained from acquire_run
+    // @param	nblocks	    Number of blocks in run
+    void release_run(char *run, size_t nblocks);
+
+    // Return whether or not the slab is on explicit huge pages
+    bool huge() const { return Huge; }
+
+    // Return whether or not a buffer can be used for O_DIRECT I/O as is
+    // @param	data	    Buffer to check
+    static bool aligned(const void *data);
+};
+
+// Run of buffers taken from a pool for the life of a scope
+class PooledBuffer {
+private:
+    BlockPool	&Pool;	    // Pool the run came from
+    char	*Data;	    // First buffer of run
+    size_t	Blocks;	    // Number of buffers in run
+
+public:
+    // Constructor
+    // @param	pool	    Pool to take the run from
+    // @param	nblocks	    Number of blocks in run
+    PooledBuffer(BlockPool &pool, size_t nblocks = 1)
+    	: Pool(pool), Data(pool.acquire_run(nblocks)), Blocks(nblocks) {}
+
+    // Destructor; gives the run back
+    ~PooledBuffer() { Pool.release_run(Data, Blocks); }
+
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    // Return the run
+    char *data() const { return Data; }
+
+    // Return the run as an array of T
+    template <typename T>
+    T *as() const { return reinterpret_cast<T *>(Data); }
+};
@@ -0,0 +1,260 @@
+// buffer_cache.h: Write-back block cache with 2Q replacement
+
+#pragma once
+
+#include "sfs/block_device.h"
+#include "sfs/block_pool.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// Keeps recently used blocks in memory between FileSystem and a block
+// device.  Writes only touch the cached copy and mark it dirty; dirty blocks
+// reach the device when they are evicted and, all together in ascending
+// block order, on flush().
+//
+// Replacement follows 2Q: a block read for the first time enters a small
+// FIFO (In) and leaves it again unless it is referenced once more after
+// being evicted, which a ghost list of recently evicted block numbers (Out)
+// remembers.  Only such blocks enter the main LRU queue (Main).  A long
+// sequential read therefore cycles through In without displacing the inode
+// and directory blocks that live in Main.  Runs read with read_blocks are
+// served from the cache where possible but never enter it, as they are
+// scans by definition.
+//
+// Blocks can be pinned, which hands out the cached buffer itself and keeps
+// it from being evicted until it is unpinned.  A cache whose every buffer is
+// pinned grows past its capacity rather than fail.
+//
+// Callers that know how blocks will be used can say so: prefetch() reads
+// blocks in ahead of use, and a priority places them where they will be
+// evicted last (HIGH, straight into Main) or first (LOW, at the head of In
+// and without leaving a ghost behind).  drop() forgets blocks altogether.
+//
+// expire() is meant for a background writer: it writes back blocks that
+// have been dirty for too long, or too many dirty blocks, from copies and
+// without holding the cache while the device works, so readers and writers
+// carry on meanwhile.  flush(), sync() and everything that writes past the
+// cache wait for such a write back to finish first.
+//
+// The device is not owned, and nothing is written back on destruction.
+class BufferCache : public BlockDevice {
+public:
+    // Where blocks go in the replacement order
+    enum class Priority {
+    	LOW,	    // Evicted before anything else, never promoted
+    	NORMAL,	    // Promoted once they prove to be reused
+    	HIGH,	    // Kept as if already reused
+    };
+
+private:
+    enum class Queue { IN, MAIN };
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Buffer {
+    	uint64_t		    Blocknum;	// Block held
+    	char			    *Data;	// Block contents
+    	bool			    Dirty;	// Changed since last write back
+    	Clock::time_point	    Dirtied;	// When it last became dirty
+    	size_t			    Pins;	// Outstanding pin() calls
+    	bool			    Reuse;	// Whether to remember it once evicted
+    	Queue			    Where;	// Queue the buffer is on
+    	std::list<Buffer *>::iterator Position; // Place in that queue
+    };
+
+    typedef std::list<uint64_t> GhostList;
+
+    BlockDevice		    *Device;	    // Device being cached
+    BlockPool		    Buffers;	    // Block buffers
+    size_t		    Capacity;	    // Blocks cached before evicting
+    size_t		    InCapacity;	    // Share of Capacity for In
+    size_t		    OutCapacity;    // Block numbers remembered in Out
+    std::mutex		    Lock;	    // Guards everything below
+    std::unordered_map<uint64_t, Buffer *> Index; // Cached blocks
+    std::list<Buffer *>	    In;		    // Blocks seen once, oldest first
+    std::list<Buffer *>	    Main;	    // Blocks seen again, least recent first
+    GhostList		    Out;	    // Blocks evicted from In, oldest first
+    std::unordered_map<uint64_t, GhostList::iterator> OutIndex; // Blocks in Out
+    size_t		    Hits;	    // Blocks read from the cache
+    size_t		    Misses;	    // Blocks read from the device
+    size_t		    Evictions;	    // Blocks dropped to make room
+    size_t		    Writebacks;	    // Dirty blocks written to the device
+    size_t		    Prefetches;	    // Blocks read ahead of use
+    size_t		    Expiring;	    // expire() calls with writes in flight
+    std::condition_variable Expired;	    // Signalled when Expiring drops
+
+    // Return cached buffer of a block, or nullptr; caller holds Lock
+    // @param	blocknum    Block to look up
+    Buffer *lookup(uint64_t blocknum);
+
+    // Record a reference to a cached buffer; caller holds Lock
+    // @param	buffer	    Buffer referenced
+    void touch(Buffer *buffer);
+
+    // Add a buffer for a block that is not cached, making room first;
+    // caller holds Lock and fills in the contents
+    // @param	blocknum    Block to add
+    Buffer *insert(uint64_t blocknum);
+
+    // Drop a buffer without writing it back; caller holds Lock
+    // @param	buffer	    Buffer to drop
+    void remove(Buffer *buffer);
+
+    // Evict unpinned buffers, writing back dirty ones, until there is room
+    // for one more block; caller holds Lock
+    void reclaim();
+
+    // Mark a buffer dirty, noting when it became so; caller holds Lock
+    // @param	buffer	    Buffer changed
+    void mark_dirty(Buffer *buffer);
+
+    // Wait until no expire() has writes in flight
+    // @param	guard	    Lock held by caller
+    void wait_expired(std::unique_lock<std::mutex> &guard);
+
+    // Move a cached buffer to where a priority puts it; caller holds Lock
+    // @param	buffer	    Buffer to move
+    // @param	priority    Where to put it
+    void place(Buffer *buffer, Priority priority);
+
+    // Write back all dirty buffers; caller holds Lock
+    void write_back();
+
+public:
+    // Default number of blocks cached
+    const static size_t CACHE_BLOCKS = 1024;
+
+    // Constructor
+    // @param	device	    Device to cache (not owned)
+    // @param	capacity    Number of blocks to cache
+    // @param	backing	    Memory to take the buffers from
+    BufferCache(BlockDevice *device, size_t capacity = CACHE_BLOCKS,
+    	    	BlockPool::Backing backing = BlockPool::Backing::HEAP);
+
+    // Destructor; dirty blocks not flushed are lost
+    ~BufferCache();
+
+    // Return cached buffer of a block, reading it in on a miss, and keep it
+    // cached until unpin() is called as many times as pin() was
+    // @param	blocknum    Block to pin
+    // Throws runtime_error exception on error.
+    char *pin(uint64_t blocknum);
+
+    // Release a pinned block
+    // @param	blocknum    Block to release
+    // @param	dirty	    Whether the buffer was changed while pinned
+    void unpin(uint64_t blocknum, bool dirty = false);
+
+    // Write back all dirty blocks in ascending order, then flush device
+    // Throws runtime_error exception on error.
+    void flush() override;
+
+    // Write back all dirty blocks in ascending order, then sync device
+    // Throws runtime_error exception on error.
+    void sync() override;
+
+    // Write back the blocks dirty for longer than an age, and the oldest
+    // others while more than a limit are dirty; pinned blocks are skipped
+    // @param	age	    Time a block may stay dirty
+    // @param	limit	    Dirty blocks allowed to stay
+    // @return		    Number of blocks written back
+    // Throws runtime_error exception on error.
+    size_t expire(std::chrono::milliseconds age, size_t limit);
+
+    // Read blocks into the cache ahead of use, fetching all misses with one
+    // device readv, and place every one of them by priority
+    // @param	blocknums   Blocks to read
+    // @param	count	    Number of blocks
+    // @param	priority    Where to put them
+    // Throws runtime_error exception on error.
+    void prefetch(const uint64_t *blocknums, size_t count, Priority priority = Priority::NORMAL);
+
+    // Place cached blocks by priority; blocks not cached are left alone
+    // @param	blocknums   Blocks to place
+    // @param	count	    Number of blocks
+    // @param	priority    Where to put them
+    void prioritize(const uint64_t *blocknums, size_t count, Priority priority);
+
+    // Write back and forget cached blocks; pinned ones are only put first
+    // in line for eviction
+    // @param	blocknums   Blocks to drop
+    // @param	count	    Number of blocks
+    // Throws runtime_error exception on error.
+    void drop(const uint64_t *blocknums, size_t count);
+
+    // Return number of blocks cached
+    size_t cached();
+
+    // Return number of dirty blocks cached
+    size_t dirty();
+
+    // Return number of blocks read from the cache
+    size_t hits();
+
+    // Return number of blocks that had to be read from the device
+    size_t misses();
+
+    // Return number of blocks dropped to make room
+    size_t evictions();
+
+    // Return number of dirty blocks written to the device
+    size_t writebacks();
+
+    // Return number of blocks read by prefetch()
+    size_t prefetches();
+
+    // Return profile of cached device
+    IOProfile *profile() override { return Device->profile(); }
+
+    // Pass metadata placement hint to cached device
+    void metadata(uint64_t blocknum, size_t nblocks, bool metadata) override { Device->metadata(blocknum, nblocks, metadata); }
+
+    // Return number of images the cached device is striped across
+    size_t stripe_members() const override { return Device->stripe_members(); }
+
+    // Return number of blocks per stripe unit of the cached device
+    size_t stripe_unit() const override { return Device->stripe_unit(); }
+
+    // Read block from cache or device
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to cache
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Drop a run of blocks from cache and discard it on device
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks from device without caching it, with
+    // cached blocks taking precedence
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks through to device, updating cached
+    // copies
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks, fetching all misses with one device readv
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks to cache
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
@@ -0,0 +1,244 @@
+// checksum_disk.h: Block device wrapper that keeps a CRC32C per block
+
+#pragma once
+
+#include "sfs/block_device.h"
+#include "sfs/block_pool.h"
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// Keeps a CRC32C checksum of every block in a table stored on the device
+// itself, in a run of blocks set aside by the file system.  Every write
+// updates the block's entry once the device has taken it; reads of blocks
+// marked as metadata are checked against it and fail with a runtime_error
+// when the block is torn or corrupt.  Data blocks are checksummed but not
+// verified on read.
+//
+// After an unclean unmount the table may lag behind the blocks, and the
+// caller switches to report_mismatches(): a metadata block that fails the
+// check is then read all the same, its entry left alone, and recorded for
+// the caller to report, until it is written again.  Entries of the data
+// blocks the caller knows to be in use are recomputed with refresh().
+//
+// Entries hold the checksum XORed with the checksum of a zero block, so a
+// zeroed table describes a zeroed device and discarded blocks leave holes
+// in the table too.  Table blocks are paged in as entries are needed and
+// at most TABLE_PAGES of them stay in memory, least recently used ones
+// going first; changed ones are written back when they go and by flush().
+// The blocks to verify are kept as runs, which stay few since metadata
+// sits mostly in one run at the front of the device.
+//
+// The checksum of the whole table, which the file system records at a
+// clean unmount, is kept up to date as table blocks are written, so it
+// costs nothing to produce: each table block adds in a CRC32C seeded with
+// its index, and a zeroed block adds nothing.  Only when there is no
+// checksum to trust_table_checksum(), after an unclean unmount, is it
+// worked out by reading the table back.
+//
+// The wrapped device is not owned.  Neither the superblock nor the table
+// blocks themselves are covered.
+class ChecksumDisk : public BlockDevice {
+private:
+    // Table block held in memory
+    struct Page {
+    	uint32_t		    *Entries;	// ENTRIES_PER_BLOCK entries
+    	bool			    Dirty;	// Changed since last written
+    	uint32_t		    Part;	// Its part of TableChecksum, as on device
+    	std::list<size_t>::iterator Position;	// Place in LRU
+    };
+
+    BlockDevice		    *Device;	// Device being checksummed
+    uint64_t		    Table;	// First block of checksum table
+    size_t		    TableBlocks;// Number of checksum table blocks
+    std::mutex		    Lock;	// Guards everything below
+    BlockPool		    Pool;	// Buffers the pages live in
+    std::unordered_map<size_t, Page> Pages; // Table blocks in memory by index
+    std::list<size_t>	    LRU;	// Their indexes, least recently used first
+    std::map<uint64_t, uint64_t> Verify;    // Runs of blocks checked on read, first to end
+    bool		    Reporting;	// Whether mismatches are recorded, not thrown
+    std::set<uint64_t>	    Mismatched;	// Blocks that failed the check and were not written since
+    std::vector<uint64_t>   Unreported; // Of those, ones take_mismatches has not returned yet
+    uint32_t		    ZeroChecksum;   // Checksum of a zero block
+    uint32_t		    TableChecksum;  // Checksum of the table on device
+    bool		    TableKnown;	// Whether TableChecksum has been worked out
+
+    // Return table entry for a block's contents
+    // @param	data	    Block contents
+    uint32_t entry(const char *data) const;
+
+    // Return the part a table block takes in the table checksum
+    // @param	index	    Index of the table block
+    // @param	data	    Its contents
+    uint32_t part(size_t index, const char *data) const;
+
+    // Account in the table checksum for a table block just written and
+    // mark it clean; caller holds Lock
+    // @param	index	    Index of the table block
+    // @param	page	    Its page
+    void written(size_t index, Page &page);
+
+    // Take the parts of table blocks about to be discarded out of the table
+    // checksum; caller holds Lock
+    // @param	index	    Index of the first table block
+    // @param	count	    Number of table blocks
+    void forget_parts(size_t index, size_t count);
+
+    // Return a table block, reading it in if it is not in memory; caller
+    // holds Lock
+    // @param	index	    Index of the table block
+    Page &page(size_t index);
+
+    // Write back the least recently used page if it changed and drop it;
+    // caller holds Lock
+    void evict();
+
+    // Drop a page without writing it back; caller holds Lock
+    // @param	index	    Index of the table block
+    void drop(size_t index);
+
+    // Set a block's entry; caller holds Lock
+    // @param	blocknum    Block
+    // @param	value	    Its new entry
+    void set_entry(uint64_t blocknum, uint32_t value);
+
+    // Return whether or not a block is checked on read; caller holds Lock
+    // @param	blocknum    Block
+    bool verified(uint64_t blocknum) const;
+
+    // Add a run of blocks to the ones checked on read, or take it out;
+    // caller holds Lock
+    // @param	first	    First block of run
+    // @param	end	    Block after run
+    // @param	verify	    Whether to check them
+    void mark(uint64_t first, uint64_t end, bool verify);
+
+    // Check a block read from the device against its entry
+    // @param	blocknum    Block that was read
+    // @param	data	    Block contents
+    // Throws runtime_error exception on mismatch.
+    void check(uint64_t blocknum, const char *data);
+
+    // Record a block the device has written
+    // @param	blocknum    Block written
+    // @param	value	    Table entry for its contents
+    void update(uint64_t blocknum, uint32_t value);
+
+    // Write changed table blocks to wrapped device; caller holds Lock
+    void write_table();
+
+public:
+    // Number of checksums per table block
+    const static size_t ENTRIES_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+
+    // Blocks read per I/O while refreshing entries or checksumming the table
+    const static size_t SCAN_BLOCKS = 64;
+
+    // Table blocks kept in memory
+    const static size_t TABLE_PAGES = 256;
+
+    // Return number of table blocks needed for a device
+    // @param	nblocks	    Number of blocks on device
+    static size_t table_blocks(size_t nblocks) {
+    	return (nblocks + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+    }
+
+    // Constructor; the table starts out describing a zeroed device
+    // @param	device	    Device to checksum (not owned)
+    // @param	table	    First block of checksum table on device
+    ChecksumDisk(BlockDevice *device, uint64_t table);
+
+    // Record metadata blocks that fail the check instead of failing the read
+    // @param	report	    Whether to record them
+    void report_mismatches(bool report);
+
+    // Return the blocks that failed the check since the last call
+    std::vector<uint64_t> take_mismatches();
+
+    // Return number of blocks that failed the check and were not written
+    // since
+    size_t mismatched();
+
+    // Recompute the entries of blocks by reading them; blocks checked on
+    // read keep theirs
+    // @param	blocks	    Blocks known to be in use
+    // @param	count	    Number of blocks
+    void refresh(const uint64_t *blocks, size_t count);
+
+    // Take the checksum recorded for the table on the device at a clean
+    // unmount, or 0 for a zeroed table, rather than reading the table
+    // @param	checksum    Checksum of the table
+    void trust_table_checksum(uint32_t checksum);
+
+    // Write changed table blocks and return the checksum of the table, read
+    // back from the device only if it was not trusted
+    // @return		    Checksum of the table, to record at unmount
+    uint32_t table_checksum();
+
+    // Write changed table blocks, then flush wrapped device
+    // Throws runtime_error exception on error.
+    void flush() override;
+
+    // Write changed table blocks, then sync wrapped device
+    // Throws runtime_error exception on error.
+    void sync() override;
+
+    // Record whether a run of blocks is verified on read, and pass the hint
+    // on to wrapped device
+    // @param	blocknum    First block of run
+    // @param	nblocks	    Number of blocks in run
+    // @param	metadata    Whether the run is metadata
+    void metadata(uint64_t blocknum, size_t nblocks, bool metadata) override;
+
+    // Return profile of wrapped device
+    IOProfile *profile() override { return Device->profile(); }
+
+    // Return number of images the wrapped device is striped across
+    size_t stripe_members() const override { return Device->stripe_members(); }
+
+    // Return number of blocks per stripe unit of the wrapped device
+    size_t stripe_unit() const override { return Device->stripe_unit(); }
+
+    // Read block and verify it if it is metadata
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block and record its checksum
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Discard a run of blocks; their entries go back to zero
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks and verify the metadata among them
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks and record their checksums
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks and verify the metadata among them
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks and record their checksums
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
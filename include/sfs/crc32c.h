@@ -0,0 +1,21 @@
+// crc32c.h: CRC32C (Castagnoli) checksums
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Extend a CRC32C checksum over a buffer.  Start with a crc of 0; passing
+// the result back in continues the checksum over further data.
+//
+// On CPUs with SSE4.2 and PCLMUL the buffer is hashed with the crc32
+// instruction in three independent streams whose results are merged with
+// a carry-less multiply, which keeps the instruction's pipeline full; a
+// table-driven version is used everywhere else.
+// @param	crc	    Checksum of the data preceding the buffer
+// @param	data	    Buffer to checksum
+// @param	length	    Number of bytes in buffer
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+// Return whether or not crc32c uses the SSE4.2/PCLMUL implementation
+bool crc32c_hardware();
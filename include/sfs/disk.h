@@ -2,57 +2,114 @@
 
 #pragma once
 
+#include "sfs/block_device.h"
+
 #include <stdlib.h>
+#include <sys/uio.h>
+
+class BlockPool;
 
-class Disk {
-private:
+// File-backed block device.  Disk is safe to use from several threads at
+// once: all I/O is positional (pread/pwrite/preadv/pwritev) and the counters
+// are atomic.
+//
+// The image is kept sparse: discarded blocks and blocks written as all
+// zeros become holes punched with fallocate.  On file systems that cannot
+// punch holes Disk falls back to writing zeros.
+class Disk : public BlockDevice {
+protected:
     int	    FileDescriptor; // File descriptor of disk image
-    size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
-    size_t  Mounts;	    // Number of mounts
+    bool    Direct;	    // Whether image was opened with O_DIRECT
+    BlockPool *Bounce;	    // Aligned buffers for unaligned O_DIRECT requests
+    std::atomic<bool> Sparse;	// Whether holes can be punched in the image
 
-    // Check parameters
-    // @param	blocknum    Block to operate on
-    // @param	data	    Buffer to operate on
-    // Throws invalid_argument exception on error.
-    void sanity_check(int blocknum, char *data);
+    // Transfer a run of consecutive blocks with preadv/pwritev; in direct
+    // mode unaligned buffers are staged through the bounce pool
+    // @param	blocknum    First block of run
+    // @param	iov	    One iovec per block, in block order
+    // @param	iovcnt	    Number of blocks in run
+    // @param	writing	    Write the run instead of reading it
+    // Throws runtime_error exception on error.
+    void transfer(uint64_t blocknum, iovec *iov, size_t iovcnt, bool writing);
+
+    // Write a run of consecutive blocks, punching holes for the ones that
+    // are all zeros
+    // @param	blocknum    First block of run
+    // @param	iov	    One iovec per block, in block order
+    // @param	iovcnt	    Number of blocks in run
+    // Throws runtime_error exception on error.
+    void store(uint64_t blocknum, iovec *iov, size_t iovcnt);
 
 public:
-    // Number of bytes per block
-    const static size_t BLOCK_SIZE = 4096;
-    
+    // Number of bounce buffers preallocated for direct mode
+    const static size_t BOUNCE_BLOCKS = 64;
+
+    // How the image is accessed
+    enum class Mode {
+    	BUFFERED,   // Through the host page cache
+    	DIRECT	    // With O_DIRECT, bypassing the host page cache
+    };
+
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : BlockDevice(), FileDescriptor(0), Direct(false), Bounce(nullptr), Sparse(false) {}
     
     // Destructor
-    ~Disk();
+    virtual ~Disk();
 
     // Open disk image
     // @param	path	    Path to disk image
     // @param	nblocks	    Number of blocks in disk image
+    // @param	mode	    Whether to go through the host page cache
     // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
-
-    // Return size of disk (in terms of blocks)
-    size_t size() const { return Blocks; }
-
-    // Return whether or not disk is mounted
-    bool mounted() const { return Mounts > 0; }
+    virtual void open(const char *path, size_t nblocks, Mode mode = Mode::BUFFERED);
 
-    // Increment mounts
-    void mount() { Mounts++; }
+    // Return whether or not the image bypasses the host page cache
+    bool direct() const { return Direct; }
 
-    // Decrement mounts
-    void unmount() { if (Mounts > 0) Mounts--; }
+    // Return whether or not discarded and zero blocks become holes
+    bool sparse() const { return Sparse; }
 
     // Read block from disk
     // @param	blocknum    Block to read from
     // @param	data	    Buffer to read into
-    void read(int blocknum, char *data);
-    
+    void read(uint64_t blocknum, char *data) override;
+
     // Write block to disk
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
-    void write(int blocknum, char *data);
+    void write(uint64_t blocknum, char *data) override;
+
+    // Wait for written blocks to reach stable storage (fdatasync)
+    // Throws runtime_error exception on error.
+    void sync() override;
+
+    // Punch a hole over a run of blocks
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    // Throws runtime_error exception on error.
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks, coalescing adjacent block numbers into
+    // single vectored reads
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks, coalescing adjacent block numbers into
+    // single vectored writes
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
 };
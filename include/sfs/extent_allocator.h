@@ -0,0 +1,123 @@
+// extent_allocator.h: Block allocation bitmap with an index of free extents
+
+#pragma once
+
+#include "sfs/bitmap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <map>
+#include <set>
+#include <utility>
+
+// One bit per block, kept in a Bitmap, plus every run of free blocks (an
+// extent) indexed twice: by where it starts, to find the extent at or after
+// a goal, and by how long it is, to find the shortest one that fits.  Both
+// indexes follow every set() and clear(), so they always describe the bits.
+//
+// allocate_run() hands out runs for writes that need several blocks.  It
+// continues the extent holding the goal when there is one (a file growing
+// in place), else takes the first long enough extent among the next
+// NEAR_EXTENTS past the goal, else the shortest long enough extent
+// anywhere, and when no extent is long enough the longest there is, so a
+// caller may get fewer blocks than it asked for and has to ask again.
+// allocate() takes single blocks the same way with no goal, which is
+// next-fit from the previous allocation until the cursor passes the last
+// extent, and then the smallest hole rather than a wrap to the front.
+class ExtentAllocator {
+private:
+    typedef std::map<size_t, size_t>		  StartIndex;  // Start to length
+    typedef std::set<std::pair<size_t, size_t>>   LengthIndex; // Length and start
+
+    Bitmap	    Bits;	// One bit per block
+    StartIndex	    Starts;	// Free extents by start
+    LengthIndex	    Lengths;	// Free extents by length
+    size_t	    Cursor;	// Block the next allocation without a goal starts from
+
+    // Index a free extent
+    // @param	start	    First block of extent
+    // @param	length	    Number of blocks in extent
+    void insert(size_t start, size_t length);
+
+    // Forget a free extent
+    // @param	extent	    Extent to forget
+    void erase(StartIndex::iterator extent);
+
+    // Remove a run of blocks lying in one free extent from the indexes
+    // @param	start	    First block of run
+    // @param	length	    Number of blocks in run
+    void take(size_t start, size_t length);
+
+    // Add a run of blocks to the indexes, merging it with its neighbours
+    // @param	start	    First block of run
+    // @param	length	    Number of blocks in run
+    void give(size_t start, size_t length);
+
+    // Rebuild both indexes from the bits
+    void reindex();
+
+public:
+    // Returned when there is no free block
+    const static size_t NONE = Bitmap::NONE;
+
+    // Extents past the goal looked at before settling for the best fit
+    const static size_t NEAR_EXTENTS = 16;
+
+    // Constructor
+    // @param	nitems	    Number of blocks, all free
+    ExtentAllocator(size_t nitems = 0);
+
+    // Resize and free every block
+    // @param	nitems	    Number of blocks
+    void reset(size_t nitems);
+
+    // Return number of blocks
+    size_t size() const { return Bits.size(); }
+
+    // Return number of blocks taken
+    size_t used() const { return Bits.used(); }
+
+    // Return number of free extents
+    size_t extents() const { return Starts.size(); }
+
+    // Return number of words the bits are packed into
+    size_t words() const { return Bits.words(); }
+
+    // Return whether or not a block is taken
+    // @param	item	    Block to check
+    bool test(size_t item) const { return Bits.test(item); }
+
+    // Take a block
+    // @param	item	    Block to take
+    void set(size_t item);
+
+    // Free a block
+    // @param	item	    Block to free
+    void clear(size_t item);
+
+    // Free the taken blocks of a run
+    // @param	item	    First block of run
+    // @param	nitems	    Number of blocks in run
+    void clear_range(size_t item, size_t nitems);
+
+    // Take a single block from where the previous allocation ended on
+    // @return		    Block taken, or NONE if every block is taken
+    size_t allocate();
+
+    // Take a run of contiguous blocks, as near a goal as there is room
+    // @param	goal	    Block the run should start at, or NONE for
+    //			    wherever the previous allocation ended
+    // @param	want	    Number of blocks wanted
+    // @param	got	    Number of blocks taken, between 1 and want
+    // @return		    First block of run, or NONE if every block is taken
+    size_t allocate_run(size_t goal, size_t want, size_t *got);
+
+    // Take exactly the blocks set in packed words, as written by store()
+    // @param	words	    Words to read, words() of them
+    void load(const uint64_t *words);
+
+    // Copy the bits out as packed words
+    // @param	words	    Words to write, words() of them
+    void store(uint64_t *words) const { Bits.store(words); }
+};
@@ -2,34 +2,118 @@
 
 #pragma once
 
-#include "sfs/disk.h"
+#include "sfs/bitmap.h"
+#include "sfs/block_device.h"
+#include "sfs/block_pool.h"
+#include "sfs/buffer_cache.h"
+#include "sfs/checksum_disk.h"
+#include "sfs/extent_allocator.h"
+#include "sfs/inode_table.h"
 
 #include <stdint.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <vector>
+
 class FileSystem {
 public:
-    const static uint32_t MAGIC_NUMBER	     = 0xf0f03410;
-    const static uint32_t INODES_PER_BLOCK   = 128;
+    const static uint32_t MAGIC_NUMBER	     = 0xf0f06410;
+    const static uint32_t MAGIC_NUMBER_32    = 0xf0f03410; // images with 32-bit block numbers
+    const static uint32_t FORMAT_VERSION     = 2;   // 64-bit block numbers
+    const static uint32_t FORMAT_VERSION_32  = 1;   // 32-bit block numbers
+    const static uint32_t INODES_PER_BLOCK   = 64;
+    const static uint32_t INODES_PER_BLOCK_32 = 128;
     const static uint32_t POINTERS_PER_INODE = 5;
-    const static uint32_t POINTERS_PER_BLOCK = 1024;
+    const static uint32_t POINTERS_PER_BLOCK = 512;
+    const static uint32_t POINTERS_PER_BLOCK_32 = 1024;
     const static uint32_t INDIRECT_OFFSET    = 6;
     const static uint32_t DIRENT_NAME_SIZE   = 26;
     const static uint32_t INODE_BLOCKS_OFFSET = 1; // number of the block right after direct blocks
-    const static uint32_t DIRENTS_PER_BLOCK  = 256; // Disk::BLOCK_SIZE/sizeof(Dirent)
+    const static uint32_t DIRENTS_PER_BLOCK  = 128; // BlockDevice::BLOCK_SIZE/sizeof(Dirent)
+    const static uint32_t MOUNT_BATCH_BLOCKS = 32;  // inode blocks read per I/O during mount
+    const static uint32_t ARENA_BLOCKS       = 16;  // scratch blocks preallocated for file operations
+    const static uint32_t FLAG_CHECKSUMS     = 1 << 0; // blocks are checksummed
+    const static uint32_t FLAG_CLEAN         = 1 << 1; // unmounted cleanly
+    const static uint32_t FLAG_BITMAPS       = 1 << 2; // allocation bitmaps are stored
+    const static uint32_t INODE_CACHE_INODES = 4096; // decoded inodes kept in memory
+    const static uint32_t DENTRY_CACHE_NAMES = 4096; // name lookups kept in memory
+    const static uint32_t FLUSH_INTERVAL_MS  = 1000; // time between background write backs
+    const static uint32_t DIRTY_EXPIRE_MS    = 5000; // time a block may stay dirty in the cache
+    const static uint32_t DIRTY_RATIO        = 20;   // percentage of the cache that may be dirty
+    const static uint32_t READAHEAD_BLOCKS   = 8;    // blocks read past the end of a read
+    const static uint32_t DELAYED_BLOCKS     = 1024; // written blocks that may wait for a place on disk
+
+    // what, besides sync(), gets written data onto stable storage
+    enum class Durability {
+        NONE,       // nothing; the host writes the image back when it likes
+        PERIODIC,   // the flusher syncs the disk after every pass
+        ON_CLOSE,   // unmount syncs the disk
+    };
+
+    // how a file is going to be accessed, as with posix_fadvise
+    enum class Advice {
+        NORMAL,     // no idea: modest read-ahead, blocks kept if reused
+        SEQUENTIAL, // read front to back: four times the read-ahead
+        RANDOM,     // read here and there: no read-ahead, blocks kept first
+        WILLNEED,   // read it all into the cache now
+        DONTNEED,   // drop it from the cache now
+        NOREUSE,    // read once: blocks are evicted first
+    };
+
+    // inode numbers stay 32-bit (they are stored in dirents), so very large
+    // disks get fewer than one inode block per ten blocks
+    const static uint64_t MAX_INODES         = UINT32_MAX;
 
 private:
     struct SuperBlock {		// Superblock structure
     	uint32_t MagicNumber;	// File system magic number
-    	uint32_t Blocks;	// Number of blocks in file system
-    	uint32_t InodeBlocks;	// Number of blocks reserved for inodes
-    	uint32_t Inodes; 	// Number of inodes in file system
+    	uint32_t Version;	// On-disk format version
+    	uint64_t Blocks;	// Number of blocks in file system
+    	uint64_t InodeBlocks;	// Number of blocks reserved for inodes
+    	uint64_t Inodes; 	// Number of inodes in file system
+    	uint32_t StripeMembers;	// Number of striped images (0 if not striped)
+    	uint32_t StripeUnit;	// Blocks per stripe unit (0 if not striped)
+    	uint32_t Flags;		// FLAG_CHECKSUMS and FLAG_CLEAN bits
+    	uint32_t TableChecksum;	// CRC32C of checksum table at last unmount
+    	uint64_t ChecksumBlocks;// Blocks in checksum table (0 if none)
+    	uint32_t SuperChecksum;	// CRC32C of superblock with this field zeroed
+    	uint32_t BitmapBlocks;	// Blocks in allocation bitmaps (0 if none)
+    };
+
+    struct SuperBlock32 {	// Superblock of FORMAT_VERSION_32 images
+    	uint32_t MagicNumber;	// MAGIC_NUMBER_32
+    	uint32_t Blocks;
+    	uint32_t InodeBlocks;
+    	uint32_t Inodes;
+    	uint32_t StripeMembers;
+    	uint32_t StripeUnit;
+    	uint32_t Flags;
+    	uint32_t ChecksumBlocks;
+    	uint32_t TableChecksum;
+    	uint32_t SuperChecksum;
     };
 
     struct Inode {
     	uint32_t Valid;		// Whether or not inode is valid
-    	uint32_t Size;		// Size of file
-    	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
-    	uint32_t Indirect; 	// Indirect pointer
+    	uint32_t Reserved;	// Zero
+    	uint64_t Size;		// Size of file
+    	uint64_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    	uint64_t Indirect; 	// Indirect pointer
+    };
+
+    struct Inode32 {		// Inode of FORMAT_VERSION_32 images
+    	uint32_t Valid;
+    	uint32_t Size;
+    	uint32_t Direct[POINTERS_PER_INODE];
+    	uint32_t Indirect;
     };
 
     /* it's pointer to a inode which determines the type of the inode */
@@ -42,36 +126,338 @@ private:
     };
     #pragma pack()
 
-    union Block {
+    // Aligned so that blocks on the stack can go straight to an O_DIRECT disk
+    union alignas(BlockDevice::BLOCK_SIZE) Block {
     	SuperBlock  Super;			    // Superblock
+    	SuperBlock32 Super32;			    // Superblock (32-bit format)
     	Inode	    Inodes[INODES_PER_BLOCK];	    // Inode block
+    	Inode32	    Inodes32[INODES_PER_BLOCK_32];  // Inode block (32-bit format)
         Dirent      Dirents[DIRENTS_PER_BLOCK];
-    	uint32_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block
-    	char	    Data[Disk::BLOCK_SIZE];	    // Data block
+    	uint64_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block
+    	uint32_t    Pointers32[POINTERS_PER_BLOCK_32]; // Pointer block (32-bit format)
+    	char	    Data[BlockDevice::BLOCK_SIZE];	    // Data block
     };
 
+    // arrays of blocks are read and written as runs of whole blocks
+    static_assert(sizeof(Dirent)*DIRENTS_PER_BLOCK == BlockDevice::BLOCK_SIZE, "dirents must fill a block");
+    static_assert(sizeof(Inode)*INODES_PER_BLOCK == BlockDevice::BLOCK_SIZE, "inodes must fill a block");
+    static_assert(sizeof(Inode32)*INODES_PER_BLOCK_32 == BlockDevice::BLOCK_SIZE, "inodes must fill a block");
+    static_assert(sizeof(Block) == BlockDevice::BLOCK_SIZE, "Block must be one disk block");
+
     enum class DirentType {
         FILE_T = 0xaf,
         DIR_T  = 0xb1
     };
 
+    /**
+     * @Brief decode the superblock of either format
+     *
+     * @Param block block 0 of the disk
+     * @Param super superblock in the current format's layout
+     * @Param version format of the image
+     * @Return false if block holds no superblock
+     */
+    static bool     load_super          (const Block &block, SuperBlock *super, uint32_t *version);
+
+    /**
+     * @Brief encode a superblock in the layout of a format, checksum included
+     *
+     * @Param block block 0 of the disk
+     * @Param super superblock to store
+     * @Param version format of the image
+     */
+    static void     store_super         (Block &block, const SuperBlock &super, uint32_t version);
+
+    /**
+     * @Brief compute the checksum of a superblock, which is stored in its
+     *  SuperChecksum field
+     *
+     * @Param block block 0 of the disk
+     * @Param version format of the image
+     * @Return CRC32C of the superblock with SuperChecksum taken as zero
+     */
+    static uint32_t super_checksum      (const Block &block, uint32_t version);
+
+    /**
+     * @Brief return the number of inode blocks a format reserves on a disk
+     *
+     * @Param blocks number of blocks on the disk
+     * @Param version format of the image
+     */
+    static uint64_t inode_blocks        (uint64_t blocks, uint32_t version);
+
+    /**
+     * @Brief return the number of blocks the allocation bitmaps take: the
+     *  inode bitmap, then the block bitmap from the next word on, with
+     *  room for a bit per block of the disk
+     *
+     * @Param blocks number of blocks on the disk
+     * @Param inodes number of inodes
+     */
+    static uint64_t bitmap_blocks       (uint64_t blocks, uint64_t inodes);
+
+    static uint32_t inodes_per_block    (uint32_t version) {
+        return version == FORMAT_VERSION_32 ? INODES_PER_BLOCK_32 : INODES_PER_BLOCK;
+    }
+    static uint32_t pointers_per_block  (uint32_t version) {
+        return version == FORMAT_VERSION_32 ? POINTERS_PER_BLOCK_32 : POINTERS_PER_BLOCK;
+    }
+
+    /**
+     * @Brief copy an inode out of or into an inode block of either format
+     *
+     * @Param block inode block
+     * @Param j index of the inode within the block
+     * @Param version format of the image
+     * @Param node inode in the current format's layout
+     */
+    static void     get_inode           (const Block &block, uint32_t j, uint32_t version, Inode *node);
+    static void     put_inode           (Block &block, uint32_t j, uint32_t version, const Inode *node);
+
+    /**
+     * @Brief read or write the kth entry of a pointer block of either format
+     */
+    static uint64_t get_pointer         (const Block &block, uint32_t k, uint32_t version);
+    static void     put_pointer         (Block &block, uint32_t k, uint32_t version, uint64_t b);
+
+    /**
+     * @Brief free everything mount set up and forget the disk
+     */
+    void    release             ();
+
     bool    load_inode          (size_t inumber, Inode *node);
     bool    save_inode          (size_t inumber, Inode *node);
 
+    /**
+     * @Brief write every dirty cached inode into its inode block, each block
+     *  once however many of its inodes changed
+     */
+    void    write_inodes        ();
+
+    /**
+     * @Brief drop the least recently used inode from the inode cache,
+     *  writing it back first if it is dirty
+     */
+    void    evict_inode         ();
+
+    /**
+     * @Brief body of the flusher thread: run write_back every flush interval
+     *  until stop_flusher is called
+     */
+    void    run_flusher         ();
+
+    /**
+     * @Brief stop the flusher thread, if it runs, and wait for it
+     */
+    void    stop_flusher        ();
+
+    /**
+     * @Brief one pass of the flusher: hand dirty inodes to the cache, write
+     *  back the blocks dirty for too long or beyond the dirty ratio, and sync
+     *  the disk under Durability::PERIODIC
+     */
+    void    write_back          ();
+
     /* read nth data block of a inode */
     bool    read_nth_block      (size_t inumber, size_t nthblock, Block *block);
 
     /**
-     * @Brief find a free block from the free blocks bitmap
+     * @Brief take a run of contiguous free blocks, as near a goal block as
+     *  there is room
+     *
+     * @Param goal block the run should start at, or 0 for wherever the
+     *  previous allocation ended
+     * @Param count number of blocks wanted
+     * @Param got number of blocks taken, at least one and maybe fewer
+     *  than count
+     * @Return first block of the run, or -1 if there is no free block
+     */
+    ssize_t allocate_blocks     (uint64_t goal, size_t count, size_t *got);
+
+    // blocks taken by allocate_blocks for a write and not used yet
+    struct BlockRun {
+        uint64_t    Next;   // next block to hand out
+        size_t      Left;   // blocks left from Next on
+    };
+
+    /**
+     * @Brief hand out the next block of a run, taking a new run first when
+     *  it is used up
      *
-     * @Return free block number from beginning
+     * @Param run run to take from
+     * @Param goal block a new run should start at, or 0
+     * @Param count number of blocks a new run should have
+     * @Return block number, or -1 if there is no free block
+     */
+    ssize_t allocate_from_run   (BlockRun &run, uint64_t goal, size_t count);
+
+    // blocks of a file written but not placed on disk yet
+    struct DelayedFile {
+        std::map<uint32_t, char *> Blocks;  // buffers by block of the file
+        bool        Indirect = false;       // whether an indirect block is reserved for them
+    };
+
+    /**
+     * @Brief return the buffer of a block of a file that is not placed on
+     *  disk yet
+     *
+     * @Param inumber inode of the file
+     * @Param nthblock block of the file
+     * @Return buffer, or nullptr if the block is not waiting
+     */
+    char   *delayed_block       (size_t inumber, size_t nthblock);
+
+    /**
+     * @Brief return the buffer a block of a file is written into until it
+     *  is placed on disk, reserving room for it (and for the indirect block
+     *  it will need) the first time
+     *
+     * @Param inumber inode of the file
+     * @Param node inode of the file
+     * @Param nthblock block of the file, which has no block on disk
+     * @Return buffer, zeroed when new, or nullptr if the disk has no room
+     */
+    char   *delay_block         (size_t inumber, const Inode &node, size_t nthblock);
+
+    /**
+     * @Brief place the waiting blocks of a file on disk, in as few runs as
+     *  there is room for, and write them out with one writev
+     *
+     * @Param inumber inode of the file
+     * @Return false if some of them found no block, in which case those
+     *  keep waiting and only the placed ones are forgotten
+     */
+    bool    place_delayed       (size_t inumber);
+
+    /**
+     * @Brief place the waiting blocks of every file
      */
-    ssize_t allocate_free_block ();
+    void    place_all_delayed   ();
+
+    /**
+     * @Brief forget the waiting blocks of a file and give back their room
+     *
+     * @Param inumber inode of the file
+     */
+    void    drop_delayed        (size_t inumber);
+
+    // what a scanner found in a range of inode blocks
+    struct ScanResult {
+        std::vector<uint64_t> Inodes;       // valid inodes
+        std::vector<uint64_t> Blocks;       // blocks they use
+        std::vector<uint64_t> Indirects;    // indirect blocks among those
+    };
+
+    /**
+     * @Brief read a batch of indirect blocks with one vectored read and
+     *  note the data blocks they point to as used
+     *
+     * @Param requests indirect blocks and their buffers, cleared on return
+     * @Param found where the data blocks go
+     */
+    void    mark_indirect_blocks(std::vector<BlockDevice::BlockRequest> &requests, ScanResult &found);
+
+    /**
+     * @Brief read every inode block and the indirect blocks they point to,
+     *  filling in the inode table and the free block bitmap; the blocks
+     *  are split into ranges of MOUNT_BATCH_BLOCKS shared out among the
+     *  scanner threads, and under a lazy mount this returns before they
+     *  are done
+     *
+     * @Param inode_blocks number of inode blocks
+     */
+    void    scan_inodes         (uint64_t inode_blocks);
+
+    /**
+     * @Brief body of a scanner thread: scan ranges of inode blocks until
+     *  none are left, adding what each holds to the bitmaps
+     */
+    void    run_scanner         ();
+
+    /**
+     * @Brief read one range of inode blocks and the indirect blocks they
+     *  point to
+     *
+     * @Param range index of the range
+     * @Param iblocks MOUNT_BATCH_BLOCKS blocks to read inode blocks into
+     * @Param indi_blocks MOUNT_BATCH_BLOCKS blocks to read indirect blocks into
+     * @Param found what the range holds
+     */
+    void    scan_range          (size_t range, Block *iblocks, Block *indi_blocks, ScanResult &found);
+
+    /**
+     * @Brief recompute the checksums of the data blocks a range of inodes
+     *  uses, after an unclean unmount left the table behind them
+     *
+     * @Param found what the range holds
+     */
+    void    refresh_checksums   (const ScanResult &found);
+
+    /**
+     * @Brief print the metadata blocks that failed their checksum since
+     *  the last report, which happens only after an unclean unmount
+     */
+    void    report_mismatches   ();
+
+    /**
+     * @Brief abandon the scan, if one runs, and wait for its threads
+     */
+    void    stop_scanners       ();
+
+    /**
+     * @Brief wait until every range is scanned, which the free block
+     *  bitmap needs before anything is allocated or freed in it
+     *
+     * @Return false if the scan failed
+     */
+    bool    wait_scan           ();
+
+    /**
+     * @Brief return whether the range holding an inode is scanned; caller
+     *  holds m_scan_lock
+     */
+    bool    range_scanned       (size_t inumber);
+
+    /**
+     * @Brief return whether an inode may be in use: inodes out of range
+     *  never are, and ones not scanned yet have to be loaded to tell
+     */
+    bool    inode_in_use        (size_t inumber);
+
+    /**
+     * @Brief take a free inode, from an inode block that is dirty or cached
+     *  if one has room and otherwise the lowest, waiting for the ranges
+     *  that only look free because they are not scanned yet
+     *
+     * @Return inode number, or -1 if there is none
+     */
+    ssize_t take_free_inode     ();
     bool    save_nth_block      (size_t inumber, size_t nthblock, Block *block);
 
+    /**
+     * @Brief fill in the inode table and the free block bitmap from the
+     *  allocation bitmaps stored at the last clean unmount
+     */
+    void    load_bitmaps        ();
+
+    /**
+     * @Brief write the inode table and the free block bitmap to the
+     *  allocation bitmaps on disk
+     */
+    void    save_bitmaps        ();
+
+    /**
+     * @Brief tell the disk whether a block holds indirect pointers, so a
+     *  tiered disk keeps it on fast storage and a profile counts it as such
+     *
+     * @Param b block number
+     * @Param indirect whether b is an indirect block
+     */
+    void    note_indirect       (uint64_t b, bool indirect);
+
     // set b block in free block map to occupied
-    inline void set_free_bitmap  (uint32_t b) {m_free_bitmap[b-m_offset] = 1;}
-    inline void unset_free_bitmap(uint32_t b) {m_free_bitmap[b-m_offset] = 0;}
+    inline void set_free_bitmap  (uint64_t b) {m_free_bitmap.set(b-m_offset);}
+    inline void unset_free_bitmap(uint64_t b) {m_free_bitmap.clear(b-m_offset);}
 
     /**
      * @Brief takes a dirent and addes it to current dirent
@@ -104,35 +490,243 @@ private:
      */
     ssize_t find_inumber(char *name, size_t directory_inumber);
 
+    /**
+     * @Brief look a name up in a directory, through the dentry cache
+     *
+     * @Param directory_inumber inumber of the directory
+     * @Param name name to look up
+     * @Param dirent set to the dirent of name if found
+     * @Return true if name is in the directory
+     */
+    bool    lookup_dirent       (size_t directory_inumber, const char *name, Dirent *dirent);
+
+    /**
+     * @Brief key of a name in the dentry cache
+     */
+    static std::string dentry_key(size_t directory_inumber, const char *name, size_t length);
+
+    /**
+     * @Brief drop what the dentry cache knows about a name, after it was
+     *  added to a directory
+     */
+    void    forget_dentry       (size_t directory_inumber, const char *name, size_t length);
+
+    /**
+     * @Brief look up the block numbers of a run of a file's blocks
+     *
+     * @Param node inode of the file
+     * @Param first first block of the run
+     * @Param end block after the run
+     * @Param blocks block numbers, 0 for holes
+     */
+    void    map_blocks          (const Inode &node, size_t first, size_t end, std::vector<uint64_t> &blocks);
+
+    /**
+     * @Brief number of blocks to prefetch with one readv
+     */
+    size_t  prefetch_batch      ();
+
+    /**
+     * @Brief read a run of a file's blocks into the cache, skipping holes
+     *
+     * @Param pointers block numbers, 0 for holes
+     * @Param count number of blocks
+     * @Param priority where the cache puts them
+     */
+    void    prefetch_blocks     (const uint64_t *pointers, size_t count, BufferCache::Priority priority);
+
+    /**
+     * @Brief where the cache puts the blocks of a file read under an advice
+     */
+    static BufferCache::Priority advice_priority(Advice advice);
+
     Dirent m_current_dir;
 
+    // format of the mounted image
+    uint32_t        m_version = FORMAT_VERSION;
+
     // offset is the number of the non data blocks
-    uint32_t        m_offset;
+    uint64_t        m_offset;
 
-    // free block map size
-    uint32_t        m_free_bitmap_size;
+    // first block of the allocation bitmaps, and how many there are (0 on
+    // images formatted without them)
+    uint64_t        m_bitmap_start = 0;
+    uint64_t        m_bitmap_blocks = 0;
 
-    // free block map
-    unsigned char   *m_free_bitmap;
+    // free block map, one bit per data block with its free extents indexed
+    ExtentAllocator m_free_bitmap;
 
-    // itable size;
-    uint32_t        m_itable_size;
+    // inode table, one bit per inode with free counts per inode block
+    InodeTable      m_itable;
 
-    // inode table
-    unsigned char   *m_itable; 
+    // inode block last allocated from or freed into, which is dirty
+    size_t          m_inode_hint = InodeTable::NONE;
 
     bool            m_is_mounted = false;;
-    // disk pointer;
-    Disk *disk;
+    // disk pointer; the checksum wrapper when the image has checksums
+    BlockDevice *disk = nullptr;
+
+    // disk as handed to mount
+    BlockDevice     *m_device = nullptr;
+
+    // checksums of every block, or nullptr on images formatted without them
+    ChecksumDisk    *m_checksums = nullptr;
+
+    // cache every read and write goes through while mounted
+    BufferCache     *m_cache = nullptr;
+
+    // number of blocks the cache holds
+    size_t          m_cache_blocks = BufferCache::CACHE_BLOCKS;
+
+    // memory the cache's buffers come from
+    BlockPool::Backing m_cache_backing = BlockPool::Backing::HEAP;
+
+    // scratch blocks for the file operations, so they need neither 4 KiB
+    // of stack nor a memset per block
+    BlockPool       m_arena{ARENA_BLOCKS};
+
+    // decoded inode; dirty ones are written back by write_inodes
+    struct CachedInode {
+        Inode       Node;
+        bool        Dirty;
+        std::list<uint32_t>::iterator Position; // place in m_inode_lru
+    };
+
+    // inode cache, and its inode numbers from least to most recently used
+    std::unordered_map<uint32_t, CachedInode> m_inodes;
+    std::list<uint32_t> m_inode_lru;
+
+    // result of a name lookup; negative entries remember names that are
+    // not there, so looking for them again costs no directory scan
+    struct CachedDentry {
+        bool        Found;
+        Dirent      Entry;
+        std::list<std::string>::iterator Position; // place in m_dentry_lru
+    };
+
+    // dentry cache keyed by dentry_key, and its keys from least to most
+    // recently used
+    std::unordered_map<std::string, CachedDentry> m_dentries;
+    std::list<std::string> m_dentry_lru;
+
+    // access pattern of the files advised anything but Advice::NORMAL
+    std::unordered_map<uint32_t, Advice> m_advice;
+
+    // delayed allocation: written blocks stay here, with room on disk
+    // reserved for them, until write back, sync or DELAYED_BLOCKS of them
+    // place them all at once, so files get their blocks in runs as long as
+    // they turned out to be and files removed before then cost no I/O
+    std::unordered_map<uint32_t, DelayedFile> m_delayed;
+    size_t          m_delayed_blocks = 0;   // blocks reserved, indirect ones included
+    BlockPool       m_delayed_pool{0};
+
+    // guards everything above against the flusher; every public operation
+    // on a mounted file system holds it
+    std::mutex      m_lock;
+
+    Durability      m_durability = Durability::ON_CLOSE;
+
+    // background write back, every m_flush_interval ms (0 for none)
+    unsigned        m_flush_interval = FLUSH_INTERVAL_MS;
+    unsigned        m_dirty_expire   = DIRTY_EXPIRE_MS;
+    unsigned        m_dirty_ratio    = DIRTY_RATIO;
+    std::thread     m_flusher;
+    std::mutex      m_flusher_lock;     // guards m_flusher_stopping
+    std::condition_variable m_flusher_wakeup;
+    bool            m_flusher_stopping = false;
+
+    // mount scan, by m_scan_threads threads; a lazy mount leaves it running
+    size_t          m_scan_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool            m_lazy_mount = false;
+    std::vector<std::thread> m_scanners;
+    std::mutex      m_scan_lock;        // guards the bitmaps while scanning, and below
+    std::condition_variable m_scan_progress; // signalled as ranges are scanned
+    std::vector<bool> m_scanned;        // whether each range is scanned
+    size_t          m_scan_next = 0;    // first range not handed out yet
+    size_t          m_scan_left = 0;    // ranges not scanned yet
+    bool            m_scan_failed = false;
+    std::string     m_scan_error;
+    bool            m_refresh_checksums = false; // whether the scan recomputes data block checksums
 
 public:
-    static void debug   (Disk *disk);
+    ~FileSystem() {stop_flusher(); stop_scanners();}
+
+    static void debug   (BlockDevice *disk);
 
-    bool format  (Disk *disk);
+    bool format  (BlockDevice *disk);
 
-    bool        mount   (Disk *disk);
+    bool        mount   (BlockDevice *disk);
     bool        mounted() {return m_is_mounted;}
 
+    /**
+     * @Brief stop the flusher, write back the buffer cache and the checksum
+     *  table, mark the image as cleanly unmounted so the next mount can trust
+     *  the table, sync the disk unless durability is Durability::NONE, and
+     *  let go of the disk
+     */
+    void        unmount ();
+
+    /**
+     * @Brief write back every dirty inode and cached block and wait until
+     *  the disk has them on stable storage
+     */
+    void        sync    ();
+
+    /**
+     * @Brief set what gets written data onto stable storage
+     *
+     * @Param durability durability mode
+     */
+    void        set_durability(Durability durability) {m_durability = durability;}
+
+    /**
+     * @Brief set up background write back from the next mount on
+     *
+     * @Param interval_ms time between passes (0 for no flusher)
+     * @Param expire_ms time a block may stay dirty
+     * @Param ratio percentage of the cache that may be dirty
+     */
+    void        set_writeback(unsigned interval_ms, unsigned expire_ms = DIRTY_EXPIRE_MS,
+                              unsigned ratio = DIRTY_RATIO) {
+        m_flush_interval = interval_ms;
+        m_dirty_expire   = expire_ms;
+        m_dirty_ratio    = ratio;
+    }
+
+    /**
+     * @Brief set the number of blocks cached from the next mount on
+     *
+     * @Param blocks cache capacity
+     */
+    void        set_cache_blocks(size_t blocks) {m_cache_blocks = blocks;}
+
+    /**
+     * @Brief back the cache with huge pages from the next mount on
+     *
+     * @Param huge whether to use huge pages
+     */
+    void        set_cache_huge_pages(bool huge) {
+        m_cache_backing = huge ? BlockPool::Backing::HUGE_PAGES : BlockPool::Backing::HEAP;
+    }
+
+    /**
+     * @Brief set how mount rebuilds the bitmaps when it has to scan the
+     *  inodes, from the next mount on
+     *
+     * @Param threads number of scanner threads
+     * @Param lazy whether mount returns while they scan; allocations then
+     *  wait for the ranges they depend on
+     */
+    void        set_mount_scan(size_t threads, bool lazy) {
+        m_scan_threads = std::max<size_t>(threads, 1);
+        m_lazy_mount   = lazy;
+    }
+
+    /**
+     * @Brief return the buffer cache, or nullptr when not mounted
+     */
+    BufferCache *cache  () {return m_cache;}
+
     /**
      * @Brief create a file with the given name on the 
      *  current directory
@@ -162,9 +756,29 @@ public:
     bool        remove  (size_t inumber);
     ssize_t     stat    (size_t inumber);
 
+    /**
+     * @Brief read from a file, with read-ahead and caching as advised
+     *
+     * @Param inumber inode of the file
+     * @Param data buffer to read into
+     * @Param length bytes to read
+     * @Param offset byte of the file to start at
+     * @return bytes read, or -1 if the file does not exist
+     */
     ssize_t     read    (size_t inumber, 
                          char *data, 
-                         size_t length); 
+                         size_t length,
+                         size_t offset = 0); 
+
+    /**
+     * @Brief tell how a file is going to be accessed; WILLNEED and DONTNEED
+     *  act on the cache at once, the others apply to later reads
+     *
+     * @Param inumber inode of the file
+     * @Param advice access pattern
+     * @return true if successful false if fail
+     */
+    bool        advise  (size_t inumber, Advice advice);
 
     ssize_t     write   (size_t inumber, char *data, size_t length);
 };
@@ -0,0 +1,92 @@
+// inode_table.h: Inode allocation bitmap with free counts per inode block
+
+#pragma once
+
+#include "sfs/bitmap.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+// One bit per inode, kept in a Bitmap, plus a tree of free counts: the
+// number of free inodes in every inode block, a level up in every group of
+// 64 inode blocks, and so on until one count covers the whole table.
+// find_free_block() walks down from the top, looking at no more than 64
+// counts per level, so the first inode block with room is found in time
+// logarithmic in the size of the table however full it is.  Callers that
+// would rather fill a block they are about to write anyway ask
+// free_in_block() first.
+class InodeTable {
+private:
+    Bitmap			    Bits;	// One bit per inode
+    size_t			    PerBlock;	// Inodes per inode block
+    std::vector<std::vector<uint32_t>> Free; // Free counts, per block first
+
+    // Rebuild every count from the bits
+    void recount();
+
+    // Add to the counts covering an inode
+    // @param	item	    Inode that changed
+    // @param	delta	    Change in free inodes
+    void adjust(size_t item, int delta);
+
+public:
+    // Returned when there is no free inode
+    const static size_t NONE = Bitmap::NONE;
+
+    // Groups per count one level up
+    const static size_t FANOUT = 64;
+
+    // Constructor
+    // @param	ninodes	    Number of inodes, all free
+    // @param	per_block   Inodes per inode block
+    InodeTable(size_t ninodes = 0, size_t per_block = 1);
+
+    // Resize and free every inode
+    // @param	ninodes	    Number of inodes
+    // @param	per_block   Inodes per inode block
+    void reset(size_t ninodes, size_t per_block);
+
+    // Return number of inodes
+    size_t size() const { return Bits.size(); }
+
+    // Return number of inodes taken
+    size_t used() const { return Bits.used(); }
+
+    // Return number of words the bits are packed into
+    size_t words() const { return Bits.words(); }
+
+    // Return whether or not an inode is taken
+    // @param	item	    Inode to check
+    bool test(size_t item) const { return Bits.test(item); }
+
+    // Take an inode
+    // @param	item	    Inode to take
+    void set(size_t item);
+
+    // Free an inode
+    // @param	item	    Inode to free
+    void clear(size_t item);
+
+    // Return number of free inodes in an inode block
+    // @param	block	    Index of the inode block (not its block number)
+    size_t free_in_block(size_t block) const;
+
+    // Return first inode block with a free inode at or after a block, or
+    // NONE
+    // @param	block	    Index of the inode block to start from
+    size_t find_free_block(size_t block = 0) const;
+
+    // Return first free inode of an inode block, or NONE
+    // @param	block	    Index of the inode block
+    size_t find_free_in(size_t block) const;
+
+    // Take exactly the inodes set in packed words, as written by store()
+    // @param	words	    Words to read, words() of them
+    void load(const uint64_t *words);
+
+    // Copy the bits out as packed words
+    // @param	words	    Words to write, words() of them
+    void store(uint64_t *words) const { Bits.store(words); }
+};
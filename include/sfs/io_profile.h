@@ -0,0 +1,121 @@
+// io_profile.h: I/O profile of a block device
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mutex>
+#include <vector>
+
+// Statistics gathered by ProfiledDisk: a latency histogram per kind of
+// call, the distance the device had to seek between consecutive accesses,
+// and block counts split by what the file system keeps in each block.
+//
+// The device itself cannot tell an inode block from a data block, so the
+// file system describes its layout with layout() and set_indirect().  Until
+// it does every block past the superblock counts as data.  The checksum
+// table and allocation bitmaps between the inode blocks and the first data
+// block count as tables.
+class IOProfile {
+public:
+    // Number of log2 buckets per histogram
+    const static size_t HISTOGRAM_BUCKETS = 32;
+
+    // Kind of device call
+    enum class Op {
+    	READ,
+    	WRITE,
+    	READ_BLOCKS,
+    	WRITE_BLOCKS,
+    	READV,
+    	WRITEV,
+    	COUNT
+    };
+
+    // What a block holds
+    enum class BlockClass {
+    	SUPER,
+    	INODE,
+    	TABLE,
+    	INDIRECT,
+    	DATA,
+    	COUNT
+    };
+
+    const static size_t OPS	= static_cast<size_t>(Op::COUNT);
+    const static size_t CLASSES = static_cast<size_t>(BlockClass::COUNT);
+
+    // Log2 histogram: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i) and the
+    // last bucket also takes everything larger
+    struct Histogram {
+    	size_t	Buckets[HISTOGRAM_BUCKETS];
+    	size_t	Count;	    // Number of samples
+    	size_t	Total;	    // Sum of samples
+    	size_t	Max;	    // Largest sample
+    };
+
+    // Copy of everything recorded so far
+    struct Report {
+    	Histogram   Latency[OPS];	    // Nanoseconds per call
+    	Histogram   Seeks;		    // Blocks between accesses (0 is sequential)
+    	size_t	    Reads[CLASSES];	    // Blocks read per class
+    	size_t	    Writes[CLASSES];	    // Blocks written per class
+    	size_t	    Random[CLASSES];	    // Non-sequential accesses per class
+    };
+
+private:
+    mutable std::mutex	Lock;		    // Guards everything below
+    Report		Stats;		    // Statistics recorded so far
+    long		Head;		    // Block following the last access (-1 if none)
+    size_t		InodeBlocks;	    // Inode blocks following the superblock
+    size_t		DataStart;	    // First block past the tables
+    std::vector<bool>	Indirect;	    // Whether each block is an indirect block
+
+    // Classify a block according to the layout
+    // @param	blocknum    Block to classify
+    BlockClass classify(size_t blocknum) const;
+
+public:
+    // Constructor
+    IOProfile();
+
+    // Describe the file system layout; forgets all indirect blocks
+    // @param	blocks	    Number of blocks on device
+    // @param	inode_blocks	Number of inode blocks following the superblock
+    // @param	data_start  First block past the checksum table and bitmaps
+    void layout(size_t blocks, size_t inode_blocks, size_t data_start);
+
+    // Record whether a block holds indirect pointers
+    // @param	blocknum    Block to mark
+    // @param	indirect    Whether it is an indirect block
+    void set_indirect(size_t blocknum, bool indirect);
+
+    // Record the latency of one call
+    // @param	op	    Kind of call
+    // @param	nanoseconds Time the call took
+    void record_call(Op op, size_t nanoseconds);
+
+    // Record an access to a run of blocks
+    // @param	blocknum    First block of the run
+    // @param	nblocks	    Number of blocks in the run
+    // @param	writing	    Whether the run was written
+    void record_access(size_t blocknum, size_t nblocks, bool writing);
+
+    // Return a copy of the statistics recorded so far
+    Report report() const;
+
+    // Forget the statistics recorded so far (the layout is kept)
+    void reset();
+
+    // Print the statistics recorded so far
+    // @param	stream	    Stream to print to
+    void dump(FILE *stream) const;
+
+    // Return name of a kind of call
+    static const char *name(Op op);
+
+    // Return name of a block class
+    static const char *name(BlockClass type);
+};
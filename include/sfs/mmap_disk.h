@@ -0,0 +1,83 @@
+// mmap_disk.h: Memory-mapped disk emulator
+
+#pragma once
+
+#include "sfs/disk.h"
+
+// Disk that maps the whole image at open time and serves block reads and
+// writes as copies from the mapping instead of lseek+read/write syscalls.
+class MmapDisk : public Disk {
+private:
+    char    *Mapping;	    // Mapping of the whole disk image
+
+public:
+    // Access pattern hints passed on to madvise
+    enum class Advice {
+    	NORMAL,
+    	SEQUENTIAL,
+    	RANDOM,
+    	WILLNEED,
+    	DONTNEED
+    };
+
+    // Default constructor
+    MmapDisk() : Disk(), Mapping(nullptr) {}
+
+    // Destructor (flushes and unmaps the image)
+    ~MmapDisk();
+
+    // Open and map disk image; the mapping lives in the page cache, so
+    // the image is always opened in buffered mode
+    // @param	path	    Path to disk image
+    // @param	nblocks	    Number of blocks in disk image
+    // @param	mode	    Ignored
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks, Mode mode = Mode::BUFFERED) override;
+
+    // Read block from mapping
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to mapping
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Read a contiguous run of blocks from mapping
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks to mapping
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks from mapping
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks to mapping
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+
+    // Flush dirty pages of the mapping back to the image
+    // @param	async	    Only schedule the writeback (MS_ASYNC)
+    // Throws runtime_error exception on error.
+    void sync(bool async);
+
+    // Flush dirty pages of the mapping and wait for them (MS_SYNC)
+    // Throws runtime_error exception on error.
+    void sync() override { sync(false); }
+
+    // Give the kernel a hint about how a range of blocks will be accessed
+    // @param	advice	    Expected access pattern
+    // @param	blocknum    First block of the range
+    // @param	nblocks	    Number of blocks in range (0 means to the end)
+    void advise(Advice advice, uint64_t blocknum = 0, size_t nblocks = 0);
+};
@@ -0,0 +1,78 @@
+// profiled_disk.h: Block device wrapper that profiles the I/O passing through
+
+#pragma once
+
+#include "sfs/block_device.h"
+#include "sfs/io_profile.h"
+
+// Forwards every call to another block device and records its latency,
+// seek distance and block classes in an IOProfile.  Works on top of any
+// backend, so the same FileSystem workload can be compared across them.
+class ProfiledDisk : public BlockDevice {
+private:
+    BlockDevice	*Device;	// Device being profiled
+    IOProfile	Profile;	// Statistics recorded so far
+
+public:
+    // Constructor
+    // @param	device	    Device to profile; owned and deleted by the wrapper
+    ProfiledDisk(BlockDevice *device);
+
+    // Destructor
+    ~ProfiledDisk();
+
+    // Return profile recording the I/O done on this device
+    IOProfile *profile() override { return &Profile; }
+
+    // Flush wrapped device
+    void flush() override { Device->flush(); }
+
+    // Sync wrapped device
+    void sync() override { Device->sync(); }
+
+    // Pass metadata placement hint to wrapped device
+    void metadata(uint64_t blocknum, size_t nblocks, bool metadata) override { Device->metadata(blocknum, nblocks, metadata); }
+
+    // Return number of images the wrapped device is striped across
+    size_t stripe_members() const override { return Device->stripe_members(); }
+
+    // Return number of blocks per stripe unit of the wrapped device
+    size_t stripe_unit() const override { return Device->stripe_unit(); }
+
+    // Read block from wrapped device
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to wrapped device
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Discard a run of blocks on wrapped device
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override { Device->discard(blocknum, nblocks); }
+
+    // Read a contiguous run of blocks from wrapped device
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks to wrapped device
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks from wrapped device
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks to wrapped device
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
@@ -0,0 +1,54 @@
+// ram_disk.h: In-memory block device
+
+#pragma once
+
+#include "sfs/block_device.h"
+
+// Block device backed by a single contiguous anonymous mapping.  Nothing is
+// ever written to a file, which makes it useful for measuring FileSystem
+// CPU cost on its own and for running large tests quickly.
+class RamDisk : public BlockDevice {
+private:
+    char    *Memory;	    // Contents of the device
+
+public:
+    // Constructor
+    // @param	nblocks	    Number of blocks on device
+    // Throws runtime_error exception on error.
+    RamDisk(size_t nblocks);
+
+    // Destructor
+    ~RamDisk();
+
+    // Fill device from a disk image (short images leave the rest zeroed)
+    // @param	path	    Path to disk image
+    // Throws runtime_error exception on error.
+    void load(const char *path);
+
+    // Read block from memory
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to memory
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Release the memory behind a run of blocks
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks from memory
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks to memory
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+};
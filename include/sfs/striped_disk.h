@@ -0,0 +1,134 @@
+// striped_disk.h: Block device striped across several disk images (RAID-0)
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Spreads the logical block space over several member images in stripe
+// units of a fixed number of blocks: stripe s lives on member s % N.  Every
+// member has its own I/O thread, so a multi-block request is split per
+// member and the pieces run in parallel.  Single-block requests go straight
+// to the member from the calling thread.
+class StripedDisk : public BlockDevice {
+private:
+    // Requests of one multi-block call, shared by all members taking part
+    struct Batch {
+    	std::mutex		Lock;	    // Guards Remaining and Error
+    	std::condition_variable	Done;	    // Signalled when Remaining drops to 0
+    	size_t			Remaining;  // Members still working on the batch
+    	std::string		Error;	    // First failure reported by a member
+    };
+
+    // Piece of a batch handled by one member
+    struct Job {
+    	std::vector<BlockRequest> Requests; // Requests in member block numbers
+    	bool			Writing;    // Whether to write the requests
+    	Batch			*Owner;	    // Batch this job belongs to
+    };
+
+    // One member image and its I/O thread
+    struct Member {
+    	Disk			*Image;	    // Member image
+    	std::thread		Worker;	    // Thread running jobs for this member
+    	std::mutex		Lock;	    // Guards Jobs and Stopping
+    	std::condition_variable	Ready;	    // Signalled when a job is queued
+    	std::deque<Job *>	Jobs;	    // Jobs waiting to run
+    	bool			Stopping;   // Whether the worker should exit
+    };
+
+    std::vector<Member *>   Members;	    // Member images
+    size_t		    StripeUnit;	    // Blocks per stripe unit
+
+    // Body of a member's I/O thread
+    // @param	member	    Member to serve
+    void work(Member *member);
+
+    // Translate a logical block into a member and a block on that member
+    // @param	blocknum    Logical block
+    // @param	member	    Index of member holding the block
+    // @param	offset	    Block number on that member
+    void locate(uint64_t blocknum, size_t &member, uint64_t &offset) const;
+
+    // Split requests per member and run the pieces in parallel
+    // @param	requests    Requests in logical block numbers
+    // @param	count	    Number of requests
+    // @param	writing	    Whether to write the requests
+    // Throws runtime_error exception on error.
+    void dispatch(const BlockRequest *requests, size_t count, bool writing);
+
+    // Stop workers and release member images
+    void teardown();
+
+public:
+    // Default number of blocks per stripe unit
+    const static size_t STRIPE_UNIT = 16;
+
+    // Default constructor
+    StripedDisk() : BlockDevice(), StripeUnit(STRIPE_UNIT) {}
+
+    // Destructor
+    ~StripedDisk();
+
+    // Open member images
+    // @param	paths	    Paths to member images, in stripe order
+    // @param	nblocks	    Number of logical blocks
+    // @param	unit	    Blocks per stripe unit
+    // @param	mode	    Whether members go through the host page cache
+    // Throws runtime_error exception on error.
+    void open(const std::vector<std::string> &paths, size_t nblocks, size_t unit = STRIPE_UNIT,
+    	      Disk::Mode mode = Disk::Mode::BUFFERED);
+
+    // Return number of member images
+    size_t stripe_members() const override { return Members.size(); }
+
+    // Return number of blocks per stripe unit
+    size_t stripe_unit() const override { return StripeUnit; }
+
+    // Wait for every member's writes to reach stable storage
+    // Throws runtime_error exception on error.
+    void sync() override;
+
+    // Read block from its member
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to its member
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Punch out a run of blocks on every member it touches
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks, members in parallel
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks, members in parallel
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks, members in parallel
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks, members in parallel
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
@@ -0,0 +1,218 @@
+// tiered_disk.h: Block device split between a fast and a slow disk image
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Presents one logical block space backed by two images.  The slow
+// (capacity) image holds every block at its own block number; the fast
+// image holds a limited number of slots, each caching one logical block
+// that then lives only there.  A background thread moves blocks between the
+// two by access count: blocks read or written often are promoted, and when
+// the fast image is full the coldest blocks go back to the slow image.
+// Blocks FileSystem marks as metadata (superblock, inode table, indirect
+// blocks) are promoted first and never demoted.
+//
+// Nothing is kept per logical block, so memory and the work of a pass
+// follow the size of the fast image rather than the capacity: placement is
+// kept by slot, with a hash map from each resident block to its slot,
+// metadata as runs of blocks, and access counts only for the
+// HOT_PER_SLOT * slots blocks used most recently.
+//
+// The fast image starts with a header block and the placement map, which
+// records the logical block held by each slot.  The map is rewritten after
+// every move, once the block's data is synced to its new place, so the
+// placement survives reopening the images.  The slow copy of a promoted
+// block is kept until the next sync() has made the map durable.
+//
+// Reads and writes share Placement with each other; moving a block takes
+// it exclusively.
+class TieredDisk : public BlockDevice {
+private:
+    // Layout of the header block of the fast image
+    struct Header {
+    	uint32_t MagicNumber;	// Tiered image magic number
+    	uint32_t MapBlocks;	// Number of placement map blocks
+    	uint64_t Blocks;	// Number of logical blocks
+    	uint64_t Slots;		// Number of slots on fast image
+    };
+
+    const static uint32_t MAGIC_NUMBER = 0x71e4ed02;
+    const static uint32_t MAGIC_NUMBER_32 = 0x71e4ed01;	// 32-bit map, no longer read
+    const static size_t   SLOTS_PER_MAP_BLOCK = BLOCK_SIZE / sizeof(uint64_t);
+
+    Disk		*Fast;		// Image holding hot blocks
+    Disk		*Slow;		// Image holding every other block
+    size_t		Slots;		// Number of slots on fast image
+    size_t		MapBlocks;	// Number of placement map blocks
+    pthread_rwlock_t	Placement;	// Guards the maps below
+    std::unordered_map<uint64_t, size_t> Location;	// Slot holding each block on fast image
+    std::vector<int64_t> Owner;		// Block held by each slot (-1 if free)
+    std::map<uint64_t, uint64_t> Metadata;	// Runs of metadata blocks, first to end
+    std::set<uint64_t>	Stale;		// Promoted blocks whose slow copy awaits sync()
+
+    std::mutex		Counting;	// Guards Accesses
+    std::unordered_map<uint64_t, uint32_t> Accesses;	// Decaying access counts of hot blocks
+
+    std::thread		Migrator;	// Thread running migration passes
+    std::mutex		Lock;		// Guards Stopping
+    std::condition_variable Wakeup;	// Signalled to stop the migrator
+    bool		Stopping;	// Whether the migrator should exit
+    std::chrono::milliseconds Interval;	// Time between migration passes
+
+    Counter		Promotions;	// Blocks moved to fast image
+    Counter		Demotions;	// Blocks moved to slow image
+
+    // Body of the migration thread
+    void work();
+
+    // Translate a logical block into a block on one of the images
+    // @param	blocknum    Logical block
+    // @param	image	    Image holding the block
+    // @return		    Block number on that image
+    uint64_t locate(uint64_t blocknum, Disk *&image) const;
+
+    // Count an access to a block, if it is counted already or there is room
+    // for one more
+    // @param	blocknum    Logical block
+    void touch(uint64_t blocknum);
+
+    // Return the access count of a block; caller holds Counting
+    // @param	blocknum    Logical block
+    uint32_t accesses(uint64_t blocknum) const;
+
+    // Return whether a block is metadata; caller holds Placement
+    // @param	blocknum    Logical block
+    bool is_metadata(uint64_t blocknum) const;
+
+    // Split requests per image and run them; caller holds Placement shared
+    // @param	requests    Requests in logical block numbers
+    // @param	count	    Number of requests
+    // @param	writing	    Whether to write the requests
+    void dispatch(const BlockRequest *requests, size_t count, bool writing);
+
+    // Copy a block between images and record its new place; caller holds
+    // Placement exclusively
+    // @param	blocknum    Logical block to move
+    // @param	slot	    Slot to move it into (-1 to move it to slow image)
+    void move(uint64_t blocknum, int64_t slot);
+
+    // Write the placement map block holding a slot
+    // @param	slot	    Slot whose entry changed
+    void save_map(size_t slot);
+
+    // Read the header and placement map from the fast image, or start an
+    // empty map if the fast image holds none
+    void load_map();
+
+    // Stop migrator and release images
+    void teardown();
+
+public:
+    // Default time between migration passes
+    const static unsigned MIGRATE_INTERVAL_MS = 1000;
+
+    // Accesses (decaying) before a block is worth promoting
+    const static uint32_t PROMOTE_ACCESSES = 4;
+
+    // Most blocks moved by one migration pass
+    const static size_t MIGRATE_BATCH = 256;
+
+    // Blocks whose accesses are counted, per slot
+    const static size_t HOT_PER_SLOT = 4;
+
+    // Default constructor
+    TieredDisk();
+
+    // Destructor
+    ~TieredDisk();
+
+    // Open images
+    // @param	fast_path   Path to fast image
+    // @param	fast_blocks Number of blocks in fast image (header and map included)
+    // @param	slow_path   Path to slow image
+    // @param	nblocks	    Number of logical blocks (all of them fit on slow image)
+    // @param	mode	    Whether images go through the host page cache
+    // @param	interval_ms Time between background migration passes (0 for none)
+    // Throws runtime_error exception on error.
+    void open(const char *fast_path, size_t fast_blocks, const char *slow_path, size_t nblocks,
+    	      Disk::Mode mode = Disk::Mode::BUFFERED, unsigned interval_ms = MIGRATE_INTERVAL_MS);
+
+    // Run one migration pass now: promote hot and metadata blocks, demote
+    // cold ones to make room, then halve every access count and stop
+    // counting the blocks whose count reaches zero
+    // @return		    Number of blocks moved
+    size_t migrate();
+
+    // Return number of slots on fast image
+    size_t slots() const { return Slots; }
+
+    // Return number of blocks currently on fast image
+    size_t resident();
+
+    // Return number of blocks moved to fast image so far
+    size_t promotions() const { return Promotions; }
+
+    // Return number of blocks moved to slow image so far
+    size_t demotions() const { return Demotions; }
+
+    // Record whether a run of blocks holds file system metadata
+    // @param	blocknum    First block of run
+    // @param	nblocks	    Number of blocks in run
+    // @param	metadata    Whether the run is metadata
+    void metadata(uint64_t blocknum, size_t nblocks, bool metadata) override;
+
+    // Wait for the writes to both images to reach stable storage
+    // Throws runtime_error exception on error.
+    void sync() override;
+
+    // Read block from the image holding it
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to the image holding it
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Drop a run of blocks from both images; blocks on fast image give up
+    // their slots
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks, split between images
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Write a contiguous run of blocks, split between images
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks, split between images
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks, split between images
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
@@ -0,0 +1,142 @@
+// uring_disk.h: io_uring disk emulator
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <mutex>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Disk that issues block I/O through an io_uring instance.  Block requests
+// are queued with submit_read/submit_write, pushed to the kernel in batches
+// and reaped by wait(), so callers can keep up to QUEUE_DEPTH blocks in
+// flight.  The image is registered as a fixed file and a pool of fixed
+// buffers is registered with the ring; requests whose buffer lies in that
+// pool use the *_FIXED opcodes.  In direct mode a second set of fixed
+// buffers, one per in-flight request, stages unaligned caller buffers.
+// When the kernel refuses to set up a ring every request falls back to the
+// synchronous Disk path.
+//
+// The ring has a single submitter: read, write, readv and writev serialize
+// on a lock and may be called from any thread, while the submit_* / wait
+// interface must only be driven by one thread at a time.
+class UringDisk : public Disk {
+private:
+    // State of one in-flight request
+    struct Slot {
+    	uint64_t blocknum;  // Block to operate on
+    	char	*data;	    // Caller buffer
+    	bool	writing;    // Whether this is a write
+    	bool	staged;	    // Whether data goes through the slot's bounce buffer
+    };
+
+    int		    RingFd;	    // io_uring file descriptor (-1 if unavailable)
+    unsigned	    Depth;	    // Number of submission queue entries
+
+    void	    *SqRing;	    // Submission ring mapping
+    size_t	    SqRingSize;	    // Size of submission ring mapping
+    unsigned	    *SqHead;	    // Submission ring head
+    unsigned	    *SqTail;	    // Submission ring tail
+    unsigned	    *SqMask;	    // Submission ring mask
+    unsigned	    *SqArray;	    // Submission ring index array
+    io_uring_sqe    *Sqes;	    // Submission queue entries
+    size_t	    SqesSize;	    // Size of submission queue entries mapping
+
+    void	    *CqRing;	    // Completion ring mapping
+    size_t	    CqRingSize;	    // Size of completion ring mapping
+    unsigned	    *CqHead;	    // Completion ring head
+    unsigned	    *CqTail;	    // Completion ring tail
+    unsigned	    *CqMask;	    // Completion ring mask
+    io_uring_cqe    *Cqes;	    // Completion queue entries
+
+    char	    *FixedBuffers;  // Buffer pool (Depth caller + Depth bounce blocks)
+    bool	    Registered;	    // Whether FixedBuffers is registered with the ring
+    std::vector<Slot>	Slots;	    // In-flight requests, indexed by user_data
+    std::vector<unsigned> FreeSlots; // Slots not in use
+    size_t	    Pending;	    // Requests queued but not yet submitted
+    size_t	    Inflight;	    // Requests submitted but not yet reaped
+    uint64_t	    FailedBlock;    // First block whose request failed
+    int		    FailedErrno;    // Error of first failed request (0 if none)
+    std::mutex	    Lock;	    // Serializes the synchronous interface
+
+    // Queue one block request on the submission ring
+    // @param	blocknum    Block to operate on
+    // @param	data	    Buffer to operate on
+    // @param	writing	    Write the block instead of reading it
+    void queue(uint64_t blocknum, char *data, bool writing);
+
+    // Hand all queued requests to the kernel
+    void submit();
+
+    // Reap completions
+    // @param	min_complete	Number of completions to wait for
+    void reap(unsigned min_complete);
+
+    // Release the ring and its registrations
+    void teardown();
+
+public:
+    // Default number of requests kept in flight
+    const static unsigned QUEUE_DEPTH = 64;
+
+    // Default constructor
+    UringDisk() : Disk(), RingFd(-1), Depth(0), SqRing(nullptr), SqRingSize(0),
+    	SqHead(nullptr), SqTail(nullptr), SqMask(nullptr), SqArray(nullptr),
+    	Sqes(nullptr), SqesSize(0), CqRing(nullptr), CqRingSize(0),
+    	CqHead(nullptr), CqTail(nullptr), CqMask(nullptr), Cqes(nullptr),
+    	FixedBuffers(nullptr), Registered(false), Pending(0), Inflight(0), FailedBlock(0), FailedErrno(0) {}
+
+    // Destructor (waits for outstanding requests)
+    ~UringDisk();
+
+    // Open disk image and set up the ring
+    // @param	path	    Path to disk image
+    // @param	nblocks	    Number of blocks in disk image
+    // @param	mode	    Whether to go through the host page cache
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks, Mode mode = Mode::BUFFERED) override;
+
+    // Return whether requests actually go through io_uring
+    bool asynchronous() const { return RingFd >= 0; }
+
+    // Return one of the registered fixed buffers
+    // @param	index	    Buffer index (less than QUEUE_DEPTH)
+    char *fixed_buffer(size_t index) const;
+
+    // Queue an asynchronous block read; data must stay valid until wait()
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void submit_read(uint64_t blocknum, char *data);
+
+    // Queue an asynchronous block write; data must stay valid until wait()
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void submit_write(uint64_t blocknum, char *data);
+
+    // Submit everything queued and wait for all requests to complete
+    // Throws runtime_error exception if any request failed.
+    void wait();
+
+    // Read block from disk
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Write block to disk
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Read a list of blocks with all requests in flight at once
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Write a list of blocks with all requests in flight at once
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
@@ -0,0 +1,123 @@
+// write_scheduler.h: Block device wrapper that queues and sorts writes
+
+#pragma once
+
+#include "sfs/block_device.h"
+#include "sfs/block_pool.h"
+
+#include <map>
+#include <mutex>
+
+// Elevator between FileSystem and a block device.  Writes are copied into a
+// queue keyed by block number instead of going to the device, so a block
+// written again before the queue drains (an inode block saved once per
+// field, say) costs a single device write.  flush() hands the queue to the
+// device as one writev in ascending block order; backends turn each run of
+// adjacent blocks in it into a single I/O.
+//
+// Reads see queued writes.  The queue is flushed when it holds capacity
+// blocks, on flush(), and when the scheduler is destroyed.
+class WriteScheduler : public BlockDevice {
+private:
+    BlockDevice		    *Device;	// Device writes are scheduled for
+    BlockPool		    Buffers;	// Buffers holding queued blocks
+    size_t		    Capacity;	// Blocks queued before a forced flush
+    std::mutex		    Lock;	// Guards Queue and the counters below
+    std::map<uint64_t, char *> Queue;	// Queued blocks by block number
+    size_t		    Absorbed;	// Writes that replaced a queued block
+    size_t		    Flushes;	// Number of flushes that wrote something
+
+    // Queue one block, replacing any queued copy
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void enqueue(uint64_t blocknum, const char *data);
+
+    // Copy queued blocks within a run over freshly read data
+    // @param	blocknum    First block of run
+    // @param	nblocks	    Number of blocks in run
+    // @param	data	    Buffer holding the run
+    void overlay(uint64_t blocknum, size_t nblocks, char *data);
+
+    // Write out the queue; caller holds Lock
+    void drain();
+
+public:
+    // Default number of blocks queued before a forced flush
+    const static size_t QUEUE_BLOCKS = 256;
+
+    // Constructor
+    // @param	device	    Device to schedule writes for; owned and deleted
+    //			    by the scheduler
+    // @param	capacity    Blocks queued before a forced flush
+    WriteScheduler(BlockDevice *device, size_t capacity = QUEUE_BLOCKS);
+
+    // Destructor; flushes the queue
+    ~WriteScheduler();
+
+    // Write out all queued blocks in ascending order
+    // Throws runtime_error exception on error.
+    void flush() override;
+
+    // Write out all queued blocks, then sync device
+    // Throws runtime_error exception on error.
+    void sync() override;
+
+    // Return number of blocks waiting in the queue
+    size_t queued();
+
+    // Return number of writes that never reached the device because a
+    // later write to the same block replaced them
+    size_t absorbed();
+
+    // Return number of flushes that wrote something
+    size_t flushes();
+
+    // Return profile of the scheduled device
+    IOProfile *profile() override { return Device->profile(); }
+
+    // Pass metadata placement hint to scheduled device
+    void metadata(uint64_t blocknum, size_t nblocks, bool metadata) override { Device->metadata(blocknum, nblocks, metadata); }
+
+    // Return number of images the scheduled device is striped across
+    size_t stripe_members() const override { return Device->stripe_members(); }
+
+    // Return number of blocks per stripe unit of the scheduled device
+    size_t stripe_unit() const override { return Device->stripe_unit(); }
+
+    // Read block from queue or device
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(uint64_t blocknum, char *data) override;
+
+    // Queue block for writing
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void write(uint64_t blocknum, char *data) override;
+
+    // Drop queued writes to a run of blocks and discard it on device
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    void discard(uint64_t blocknum, size_t nblocks) override;
+
+    // Read a contiguous run of blocks from device and queue
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    void read_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Queue a contiguous run of blocks for writing
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    void write_blocks(uint64_t blocknum, size_t nblocks, char *data) override;
+
+    // Read a list of blocks from device and queue
+    // @param	requests    Blocks and the buffers to read them into
+    // @param	count	    Number of requests
+    void readv(const BlockRequest *requests, size_t count) override;
+
+    // Queue a list of blocks for writing
+    // @param	requests    Blocks and the buffers to write them from
+    // @param	count	    Number of requests
+    void writev(const BlockRequest *requests, size_t count) override;
+};
@@ -0,0 +1,266 @@
+// bitmap.cpp: bit-packed allocation bitmap
+
+#include "sfs/bitmap.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static const uint64_t ALL = ~0ULL;
+
+// Return mask of the bits of a word from a bit on
+static inline uint64_t from_bit(size_t bit) {
+    return ALL << (bit % 64);
+}
+
+// Return mask of the bits of a word below a bit; a multiple of 64 means
+// the whole word
+static inline uint64_t below_bit(size_t bit) {
+    return bit % 64 ? ~(ALL << (bit % 64)) : ALL;
+}
+
+// Full-word skip ---------------------------------------------------------------
+
+// Return first word in [from, to) that is not all ones, or to
+static size_t skip_full_scalar(const uint64_t *words, size_t from, size_t to) {
+    while (from < to && words[from] == ALL) {
+    	from++;
+    }
+    return from;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static size_t skip_full_avx2(const uint64_t *words, size_t from, size_t to) {
+    const __m256i ones = _mm256_set1_epi64x(-1);
+
+    while (from + 4 <= to) {
+    	__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + from));
+    	// testc is set when every bit of ones is also set in block
+    	if (!_mm256_testc_si256(block, ones)) {
+    	    break;
+    	}
+    	from += 4;
+    }
+    return skip_full_scalar(words, from, to);
+}
+
+#endif
+
+typedef size_t (*SkipFull)(const uint64_t *, size_t, size_t);
+
+static SkipFull choose() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+    	return skip_full_avx2;
+    }
+#endif
+
+    return skip_full_scalar;
+}
+
+static SkipFull Skip = choose();
+
+bool Bitmap::vectorized() {
+    return Skip != skip_full_scalar;
+}
+
+// Bitmap -----------------------------------------------------------------------
+
+Bitmap::Bitmap(size_t nitems) : Size(0), Used(0), Cursor(0) {
+    reset(nitems);
+}
+
+void Bitmap::reset(size_t nitems) {
+    Size   = nitems;
+    Used   = 0;
+    Cursor = 0;
+
+    Words.assign((nitems + 63) / 64, 0);
+    if (nitems % 64) {
+    	Words.back() = ~below_bit(nitems);
+    }
+
+    Full.assign((Words.size() + 63) / 64, 0);
+    if (Words.size() % 64) {
+    	Full.back() = ~below_bit(Words.size());
+    }
+    if (!Words.empty()) {
+    	update(Words.size() - 1);
+    }
+}
+
+void Bitmap::update(size_t word) {
+    uint64_t bit = 1ULL << (word % 64);
+    if (Words[word] == ALL) {
+    	Full[word / 64] |= bit;
+    } else {
+    	Full[word / 64] &= ~bit;
+    }
+}
+
+void Bitmap::set(size_t item) {
+    if (item >= Size) {
+    	return;
+    }
+
+    uint64_t bit = 1ULL << (item % 64);
+    uint64_t &word = Words[item / 64];
+    if (!(word & bit)) {
+    	word |= bit;
+    	Used++;
+    	update(item / 64);
+    }
+}
+
+void Bitmap::clear(size_t item) {
+    if (item >= Size) {
+    	return;
+    }
+
+    uint64_t bit = 1ULL << (item % 64);
+    uint64_t &word = Words[item / 64];
+    if (word & bit) {
+    	word &= ~bit;
+    	Used--;
+    	update(item / 64);
+    }
+}
+
+void Bitmap::set_range(size_t item, size_t nitems) {
+    size_t end = std::min(item + nitems, Size);
+    while (item < end) {
+    	size_t   w    = item / 64;
+    	uint64_t mask = from_bit(item) & (end / 64 == w ? below_bit(end) : ALL);
+    	Used     += __builtin_popcountll(mask & ~Words[w]);
+    	Words[w] |= mask;
+    	update(w);
+    	item = (w + 1) * 64;
+    }
+}
+
+void Bitmap::clear_range(size_t item, size_t nitems) {
+    size_t end = std::min(item + nitems, Size);
+    while (item < end) {
+    	size_t   w    = item / 64;
+    	uint64_t mask = from_bit(item) & (end / 64 == w ? below_bit(end) : ALL);
+    	Used     -= __builtin_popcountll(mask & Words[w]);
+    	Words[w] &= ~mask;
+    	update(w);
+    	item = (w + 1) * 64;
+    }
+}
+
+size_t Bitmap::count(size_t item, size_t nitems) const {
+    size_t end   = std::min(item + nitems, Size);
+    size_t taken = 0;
+    while (item < end) {
+    	size_t   w    = item / 64;
+    	uint64_t mask = from_bit(item) & (end / 64 == w ? below_bit(end) : ALL);
+    	taken += __builtin_popcountll(mask & Words[w]);
+    	item   = (w + 1) * 64;
+    }
+    return taken;
+}
+
+size_t Bitmap::open_word(size_t word) const {
+    if (word >= Words.size()) {
+    	return NONE;
+    }
+
+    // Rest of the summary word first, then whole summary words
+    size_t   s    = word / 64;
+    uint64_t open = ~Full[s] & from_bit(word);
+    if (open == 0) {
+    	s = Skip(Full.data(), s + 1, Full.size());
+    	if (s == Full.size()) {
+    	    return NONE;
+    	}
+    	open = ~Full[s];
+    }
+    return s*64 + __builtin_ctzll(open);
+}
+
+size_t Bitmap::find_free(size_t item) const {
+    if (item >= Size) {
+    	return NONE;
+    }
+
+    size_t   w    = item / 64;
+    uint64_t free = ~Words[w] & from_bit(item);
+    if (free == 0) {
+    	w = open_word(w + 1);
+    	if (w == NONE) {
+    	    return NONE;
+    	}
+    	free = ~Words[w];
+    }
+    return w*64 + __builtin_ctzll(free);
+}
+
+size_t Bitmap::find_taken(size_t item) const {
+    if (item >= Size) {
+    	return NONE;
+    }
+
+    size_t   w     = item / 64;
+    uint64_t taken = Words[w] & from_bit(item);
+    while (taken == 0) {
+    	if (++w == Words.size()) {
+    	    return NONE;
+    	}
+    	taken = Words[w];
+    }
+
+    // The padding past the last item counts as taken but is no item
+    size_t found = w*64 + __builtin_ctzll(taken);
+    return found < Size ? found : NONE;
+}
+
+size_t Bitmap::allocate() {
+    size_t item = find_free(Cursor);
+    if (item == NONE) {
+    	item = find_free(0);
+    }
+    if (item == NONE) {
+    	return NONE;
+    }
+
+    set(item);
+    Cursor = item + 1 < Size ? item + 1 : 0;
+    return item;
+}
+
+void Bitmap::load(const uint64_t *words) {
+    if (Words.empty()) {
+    	return;
+    }
+
+    memcpy(Words.data(), words, Words.size()*sizeof(uint64_t));
+    if (Size % 64) {
+    	Words.back() |= ~below_bit(Size);
+    }
+
+    Used = 0;
+    for (size_t w = 0; w < Words.size(); w++) {
+    	Used += __builtin_popcountll(Words[w]);
+    	update(w);
+    }
+    Used  -= Words.size()*64 - Size;
+    Cursor = 0;
+}
+
+void Bitmap::store(uint64_t *words) const {
+    if (Words.empty()) {
+    	return;
+    }
+
+    memcpy(words, Words.data(), Words.size()*sizeof(uint64_t));
+    words[Words.size() - 1] &= below_bit(Size);
+}
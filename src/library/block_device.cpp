@@ -0,0 +1,75 @@
+// block_device.cpp: block device interface
+
+#include "sfs/block_device.h"
+
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+
+// Block of zeros, aligned so that it can be written with O_DIRECT
+alignas(BlockDevice::BLOCK_SIZE) static char Zeros[BlockDevice::BLOCK_SIZE];
+
+void BlockDevice::sanity_check(uint64_t blocknum, char *data) {
+    char what[BUFSIZ];
+
+    if (blocknum >= Blocks) {
+    	snprintf(what, BUFSIZ, "blocknum (%lu) is too big!", blocknum);
+    	throw std::invalid_argument(what);
+    }
+
+    if (data == NULL) {
+    	snprintf(what, BUFSIZ, "null data pointer!");
+    	throw std::invalid_argument(what);
+    }
+}
+
+void BlockDevice::range_check(uint64_t blocknum, size_t nblocks) {
+    char what[BUFSIZ];
+
+    // written so that a huge blocknum cannot wrap the sum around
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	snprintf(what, BUFSIZ, "block run (%lu+%lu) is too big!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+}
+
+bool BlockDevice::zero_block(const char *data) {
+    return memcmp(data, Zeros, BLOCK_SIZE) == 0;
+}
+
+void BlockDevice::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	write(blocknum + i, Zeros);
+    }
+}
+
+void BlockDevice::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    range_check(blocknum, nblocks);
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	read(blocknum + i, data + i*BLOCK_SIZE);
+    }
+}
+
+void BlockDevice::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    range_check(blocknum, nblocks);
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	write(blocknum + i, data + i*BLOCK_SIZE);
+    }
+}
+
+void BlockDevice::readv(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	read(requests[i].blocknum, requests[i].data);
+    }
+}
+
+void BlockDevice::writev(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	write(requests[i].blocknum, requests[i].data);
+    }
+}
@@ -0,0 +1,143 @@
+// block_pool.cpp: pool of block-aligned buffers
+
+#include "sfs/block_pool.h"
+#include "sfs/disk.h"
+
+#include <functional>
+#include <new>
+#include <thread>
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Explicit huge pages are 2 MiB on the platforms we run on
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+BlockPool::BlockPool(size_t nblocks, Backing backing)
+    : Slab(nullptr), SlabBlocks(nblocks), SlabUsed(0), SlabBytes(0), Huge(false) {
+    if (backing == Backing::HUGE_PAGES && nblocks > 0) {
+    	size_t bytes = (nblocks*Disk::BLOCK_SIZE + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    	void *slab   = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+    	    	    	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    	Huge = slab != MAP_FAILED;
+    	if (!Huge) {
+    	    // No reserved huge pages: let the kernel back it with
+    	    // transparent ones as it can
+    	    slab = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    	    if (slab == MAP_FAILED) {
+    	    	throw std::bad_alloc();
+    	    }
+#ifdef MADV_HUGEPAGE
+    	    madvise(slab, bytes, MADV_HUGEPAGE);
+#endif
+    	}
+    	Slab      = static_cast<char *>(slab);
+    	SlabBytes = bytes;
+    	return;
+    }
+
+    void *slab;
+    if (posix_memalign(&slab, Disk::BLOCK_SIZE, nblocks*Disk::BLOCK_SIZE) != 0) {
+    	throw std::bad_alloc();
+    }
+    Slab = static_cast<char *>(slab);
+}
+
+BlockPool::~BlockPool() {
+    for (size_t i = 0; i < Extra.size(); i++) {
+    	free(Extra[i]);
+    }
+    for (size_t i = 0; i < RunMemory.size(); i++) {
+    	free(RunMemory[i]);
+    }
+    if (SlabBytes > 0) {
+    	munmap(Slab, SlabBytes);
+    } else {
+    	free(Slab);
+    }
+}
+
+BlockPool::Shard &BlockPool::shard() {
+    static thread_local size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % SHARDS;
+    return Shards[index];
+}
+
+char *BlockPool::acquire() {
+    Shard &own = shard();
+    {
+    	std::lock_guard<std::mutex> guard(own.Lock);
+    	if (!own.Free.empty()) {
+    	    char *buffer = own.Free.back();
+    	    own.Free.pop_back();
+    	    return buffer;
+    	}
+    }
+
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	if (SlabUsed < SlabBlocks) {
+    	    return Slab + (SlabUsed++)*Disk::BLOCK_SIZE;
+    	}
+    }
+
+    for (size_t s = 0; s < SHARDS; s++) {
+    	std::lock_guard<std::mutex> guard(Shards[s].Lock);
+    	if (!Shards[s].Free.empty()) {
+    	    char *buffer = Shards[s].Free.back();
+    	    Shards[s].Free.pop_back();
+    	    return buffer;
+    	}
+    }
+
+    void *buffer;
+    if (posix_memalign(&buffer, Disk::BLOCK_SIZE, Disk::BLOCK_SIZE) != 0) {
+    	throw std::bad_alloc();
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+    Extra.push_back(static_cast<char *>(buffer));
+    return static_cast<char *>(buffer);
+}
+
+void BlockPool::release(char *buffer) {
+    Shard &own = shard();
+
+    std::lock_guard<std::mutex> guard(own.Lock);
+    own.Free.push_back(buffer);
+}
+
+char *BlockPool::acquire_run(size_t nblocks) {
+    if (nblocks == 1) {
+    	return acquire();
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    auto run = Runs.find(nblocks);
+    if (run != Runs.end()) {
+    	char *buffer = run->second;
+    	Runs.erase(run);
+    	return buffer;
+    }
+
+    void *buffer;
+    if (posix_memalign(&buffer, Disk::BLOCK_SIZE, nblocks*Disk::BLOCK_SIZE) != 0) {
+    	throw std::bad_alloc();
+    }
+    RunMemory.push_back(static_cast<char *>(buffer));
+    return static_cast<char *>(buffer);
+}
+
+void BlockPool::release_run(char *run, size_t nblocks) {
+    if (nblocks == 1) {
+    	release(run);
+    	return;
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+    Runs.insert(std::make_pair(nblocks, run));
+}
+
+bool BlockPool::aligned(const void *data) {
+    return reinterpret_cast<uintptr_t>(data) % Disk::BLOCK_SIZE == 0;
+}
@@ -0,0 +1,651 @@
+// buffer_cache.cpp: write-back block cache with 2Q replacement
+
+#include "sfs/buffer_cache.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+
+#include <string.h>
+
+BufferCache::BufferCache(BlockDevice *device, size_t capacity, BlockPool::Backing backing)
+    : BlockDevice(), Device(device), Buffers(std::max<size_t>(capacity, 1), backing), Capacity(std::max<size_t>(capacity, 1)),
+      Hits(0), Misses(0), Evictions(0), Writebacks(0), Prefetches(0), Expiring(0) {
+    Blocks = Device->size();
+
+    // The sizes the 2Q paper recommends: a quarter of the cache for blocks
+    // seen once, and ghosts for half as many blocks as the cache holds
+    InCapacity  = std::max<size_t>(Capacity / 4, 1);
+    OutCapacity = std::max<size_t>(Capacity / 2, 1);
+}
+
+BufferCache::~BufferCache() {
+    for (auto &entry : Index) {
+    	Buffers.release(entry.second->Data);
+    	delete entry.second;
+    }
+}
+
+BufferCache::Buffer *BufferCache::lookup(uint64_t blocknum) {
+    auto entry = Index.find(blocknum);
+    return entry == Index.end() ? nullptr : entry->second;
+}
+
+void BufferCache::touch(Buffer *buffer) {
+    // Repeated references while still in In are taken to be correlated (a
+    // block read once per dirent, say) and do not promote it
+    if (buffer->Where == Queue::MAIN) {
+    	Main.splice(Main.end(), Main, buffer->Position);
+    }
+}
+
+BufferCache::Buffer *BufferCache::insert(uint64_t blocknum) {
+    reclaim();
+
+    Buffer *buffer   = new Buffer();
+    buffer->Blocknum = blocknum;
+    buffer->Data     = Buffers.acquire();
+    buffer->Dirty    = false;
+    buffer->Pins     = 0;
+    buffer->Reuse    = true;
+
+    // A block evicted from In not long ago has proven it is reused
+    auto ghost = OutIndex.find(blocknum);
+    if (ghost != OutIndex.end()) {
+    	Out.erase(ghost->second);
+    	OutIndex.erase(ghost);
+    	buffer->Where    = Queue::MAIN;
+    	buffer->Position = Main.insert(Main.end(), buffer);
+    } else {
+    	buffer->Where    = Queue::IN;
+    	buffer->Position = In.insert(In.end(), buffer);
+    }
+
+    Index[blocknum] = buffer;
+    return buffer;
+}
+
+void BufferCache::remove(Buffer *buffer) {
+    if (buffer->Where == Queue::MAIN) {
+    	Main.erase(buffer->Position);
+    } else {
+    	In.erase(buffer->Position);
+    }
+    Index.erase(buffer->Blocknum);
+
+    Buffers.release(buffer->Data);
+    delete buffer;
+}
+
+void BufferCache::reclaim() {
+    while (Index.size() >= Capacity) {
+    	// In gives up its oldest block while it holds more than its share,
+    	// or when that block was marked as not worth keeping
+    	std::list<Buffer *> *queues[2] = {&In, &Main};
+    	if (In.size() <= InCapacity && !Main.empty() && (In.empty() || In.front()->Reuse)) {
+    	    std::swap(queues[0], queues[1]);
+    	}
+
+    	Buffer *victim = nullptr;
+    	for (size_t q = 0; q < 2 && victim == nullptr; q++) {
+    	    for (Buffer *buffer : *queues[q]) {
+    	    	if (buffer->Pins == 0) {
+    	    	    victim = buffer;
+    	    	    break;
+    	    	}
+    	    }
+    	}
+    	if (victim == nullptr) {
+    	    return;
+    	}
+
+    	if (victim->Dirty) {
+    	    Device->write(victim->Blocknum, victim->Data);
+    	    Writebacks++;
+    	}
+
+    	if (victim->Where == Queue::IN && victim->Reuse) {
+    	    OutIndex[victim->Blocknum] = Out.insert(Out.end(), victim->Blocknum);
+    	    if (Out.size() > OutCapacity) {
+    	    	OutIndex.erase(Out.front());
+    	    	Out.pop_front();
+    	    }
+    	}
+
+    	remove(victim);
+    	Evictions++;
+    }
+}
+
+void BufferCache::mark_dirty(Buffer *buffer) {
+    if (!buffer->Dirty) {
+    	buffer->Dirty   = true;
+    	buffer->Dirtied = Clock::now();
+    }
+}
+
+void BufferCache::wait_expired(std::unique_lock<std::mutex> &guard) {
+    Expired.wait(guard, [this]() { return Expiring == 0; });
+}
+
+void BufferCache::place(Buffer *buffer, Priority priority) {
+    switch (priority) {
+    	case Priority::LOW:
+    	    if (buffer->Where == Queue::MAIN) {
+    	    	Main.erase(buffer->Position);
+    	    	buffer->Where    = Queue::IN;
+    	    	buffer->Position = In.insert(In.begin(), buffer);
+    	    } else {
+    	    	In.splice(In.begin(), In, buffer->Position);
+    	    }
+    	    buffer->Reuse = false;
+    	    break;
+    	case Priority::NORMAL:
+    	    touch(buffer);
+    	    break;
+    	case Priority::HIGH:
+    	    if (buffer->Where == Queue::IN) {
+    	    	In.erase(buffer->Position);
+    	    	buffer->Where    = Queue::MAIN;
+    	    	buffer->Position = Main.insert(Main.end(), buffer);
+    	    } else {
+    	    	touch(buffer);
+    	    }
+    	    buffer->Reuse = true;
+    	    break;
+    }
+}
+
+void BufferCache::write_back() {
+    std::vector<Buffer *> dirty;
+    for (auto &entry : Index) {
+    	if (entry.second->Dirty) {
+    	    dirty.push_back(entry.second);
+    	}
+    }
+    if (dirty.empty()) {
+    	return;
+    }
+
+    // Ascending order lets backends merge adjacent blocks into single I/Os
+    std::sort(dirty.begin(), dirty.end(), [](const Buffer *a, const Buffer *b) {
+    	return a->Blocknum < b->Blocknum;
+    });
+
+    std::vector<BlockRequest> requests(dirty.size());
+    for (size_t i = 0; i < dirty.size(); i++) {
+    	requests[i].blocknum = dirty[i]->Blocknum;
+    	requests[i].data     = dirty[i]->Data;
+    }
+    Device->writev(requests.data(), requests.size());
+
+    for (Buffer *buffer : dirty) {
+    	buffer->Dirty = false;
+    }
+    Writebacks += dirty.size();
+}
+
+char *BufferCache::pin(uint64_t blocknum) {
+    range_check(blocknum, 1);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Buffer *buffer = lookup(blocknum);
+    if (buffer != nullptr) {
+    	touch(buffer);
+    	Hits++;
+    } else {
+    	buffer = insert(blocknum);
+    	try {
+    	    Device->read(blocknum, buffer->Data);
+    	} catch (...) {
+    	    remove(buffer);
+    	    throw;
+    	}
+    	Misses++;
+    }
+
+    buffer->Pins++;
+    Reads++;
+    return buffer->Data;
+}
+
+void BufferCache::unpin(uint64_t blocknum, bool dirty) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Buffer *buffer = lookup(blocknum);
+    if (buffer == nullptr || buffer->Pins == 0) {
+    	return;
+    }
+
+    buffer->Pins--;
+    if (dirty) {
+    	mark_dirty(buffer);
+    	Writes++;
+    }
+
+    // Give back whatever was borrowed while every buffer was pinned
+    if (Index.size() > Capacity) {
+    	reclaim();
+    }
+}
+
+void BufferCache::flush() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    wait_expired(guard);
+    write_back();
+    Device->flush();
+}
+
+void BufferCache::sync() {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    wait_expired(guard);
+    write_back();
+    Device->sync();
+}
+
+size_t BufferCache::expire(std::chrono::milliseconds age, size_t limit) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    std::vector<Buffer *> dirty;
+    for (auto &entry : Index) {
+    	if (entry.second->Dirty && entry.second->Pins == 0) {
+    	    dirty.push_back(entry.second);
+    	}
+    }
+
+    // Oldest first: every expired block, then as many more as it takes to
+    // get under the limit
+    std::sort(dirty.begin(), dirty.end(), [](const Buffer *a, const Buffer *b) {
+    	return a->Dirtied < b->Dirtied;
+    });
+    Clock::time_point deadline = Clock::now() - age;
+    size_t count = 0;
+    while (count < dirty.size() && (dirty.size() - count > limit || dirty[count]->Dirtied <= deadline)) {
+    	count++;
+    }
+    dirty.resize(count);
+    if (dirty.empty()) {
+    	return 0;
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](const Buffer *a, const Buffer *b) {
+    	return a->Blocknum < b->Blocknum;
+    });
+
+    // Write copies, with the buffers pinned so that they stay cached (and
+    // nobody reads the old contents from the device) until the copies are
+    // down; a buffer changed in the meantime just becomes dirty again
+    std::vector<BlockRequest> requests(dirty.size());
+    for (size_t i = 0; i < dirty.size(); i++) {
+    	requests[i].blocknum = dirty[i]->Blocknum;
+    	requests[i].data     = Buffers.acquire();
+    	memcpy(requests[i].data, dirty[i]->Data, BLOCK_SIZE);
+    	dirty[i]->Dirty = false;
+    	dirty[i]->Pins++;
+    }
+    Expiring++;
+
+    guard.unlock();
+    std::exception_ptr error;
+    try {
+    	Device->writev(requests.data(), requests.size());
+    } catch (...) {
+    	error = std::current_exception();
+    }
+    guard.lock();
+
+    for (size_t i = 0; i < dirty.size(); i++) {
+    	Buffers.release(requests[i].data);
+    	dirty[i]->Pins--;
+    	if (error) {
+    	    mark_dirty(dirty[i]);
+    	}
+    }
+    Expiring--;
+    Expired.notify_all();
+
+    if (error) {
+    	std::rethrow_exception(error);
+    }
+
+    Writebacks += dirty.size();
+    if (Index.size() > Capacity) {
+    	reclaim();
+    }
+    return dirty.size();
+}
+
+void BufferCache::prefetch(const uint64_t *blocknums, size_t count, Priority priority) {
+    for (size_t i = 0; i < count; i++) {
+    	range_check(blocknums[i], 1);
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Pinned like readv's misses, so that later insertions cannot evict
+    // them before the device fills them in
+    std::vector<Buffer *> fresh;
+    std::vector<BlockRequest> misses;
+    for (size_t i = 0; i < count; i++) {
+    	Buffer *buffer = lookup(blocknums[i]);
+    	if (buffer == nullptr) {
+    	    buffer = insert(blocknums[i]);
+    	    buffer->Pins++;
+    	    fresh.push_back(buffer);
+
+    	    BlockRequest miss;
+    	    miss.blocknum = buffer->Blocknum;
+    	    miss.data     = buffer->Data;
+    	    misses.push_back(miss);
+    	}
+    	place(buffer, priority);
+    }
+
+    try {
+    	Device->readv(misses.data(), misses.size());
+    } catch (...) {
+    	for (Buffer *buffer : fresh) {
+    	    remove(buffer);
+    	}
+    	throw;
+    }
+    Prefetches += misses.size();
+
+    for (Buffer *buffer : fresh) {
+    	buffer->Pins--;
+    }
+    if (Index.size() > Capacity) {
+    	reclaim();
+    }
+}
+
+void BufferCache::prioritize(const uint64_t *blocknums, size_t count, Priority priority) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < count; i++) {
+    	if (Buffer *buffer = lookup(blocknums[i])) {
+    	    place(buffer, priority);
+    	}
+    }
+}
+
+void BufferCache::drop(const uint64_t *blocknums, size_t count) {
+    std::unique_lock<std::mutex> guard(Lock);
+
+    wait_expired(guard);
+
+    std::vector<Buffer *> dropped;
+    std::vector<BlockRequest> dirty;
+    for (size_t i = 0; i < count; i++) {
+    	Buffer *buffer = lookup(blocknums[i]);
+    	if (buffer == nullptr || std::find(dropped.begin(), dropped.end(), buffer) != dropped.end()) {
+    	    continue;
+    	}
+    	if (buffer->Pins > 0) {
+    	    place(buffer, Priority::LOW);
+    	    continue;
+    	}
+    	if (buffer->Dirty) {
+    	    BlockRequest request;
+    	    request.blocknum = buffer->Blocknum;
+    	    request.data     = buffer->Data;
+    	    dirty.push_back(request);
+    	}
+    	dropped.push_back(buffer);
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](const BlockRequest &a, const BlockRequest &b) {
+    	return a.blocknum < b.blocknum;
+    });
+    Device->writev(dirty.data(), dirty.size());
+    Writebacks += dirty.size();
+
+    for (Buffer *buffer : dropped) {
+    	remove(buffer);
+    }
+}
+
+size_t BufferCache::cached() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Index.size();
+}
+
+size_t BufferCache::dirty() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    size_t count = 0;
+    for (auto &entry : Index) {
+    	count += entry.second->Dirty;
+    }
+    return count;
+}
+
+size_t BufferCache::hits() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Hits;
+}
+
+size_t BufferCache::misses() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Misses;
+}
+
+size_t BufferCache::evictions() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Evictions;
+}
+
+size_t BufferCache::writebacks() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Writebacks;
+}
+
+size_t BufferCache::prefetches() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Prefetches;
+}
+
+void BufferCache::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Buffer *buffer = lookup(blocknum);
+    if (buffer != nullptr) {
+    	touch(buffer);
+    	Hits++;
+    } else {
+    	buffer = insert(blocknum);
+    	try {
+    	    Device->read(blocknum, buffer->Data);
+    	} catch (...) {
+    	    remove(buffer);
+    	    throw;
+    	}
+    	Misses++;
+    }
+    memcpy(data, buffer->Data, BLOCK_SIZE);
+
+    Reads++;
+}
+
+void BufferCache::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Whole blocks are written, so a miss needs no read first
+    Buffer *buffer = lookup(blocknum);
+    if (buffer != nullptr) {
+    	touch(buffer);
+    } else {
+    	buffer = insert(blocknum);
+    }
+    memcpy(buffer->Data, data, BLOCK_SIZE);
+    mark_dirty(buffer);
+
+    Writes++;
+}
+
+void BufferCache::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    std::unique_lock<std::mutex> guard(Lock);
+
+    // A write back still in flight must not land on the discarded run
+    wait_expired(guard);
+
+    // Walk whichever is shorter, the run or the cache
+    std::vector<Buffer *> dropped;
+    if (nblocks <= Index.size()) {
+    	for (size_t i = 0; i < nblocks; i++) {
+    	    if (Buffer *buffer = lookup(blocknum + i)) {
+    	    	dropped.push_back(buffer);
+    	    }
+    	}
+    } else {
+    	for (auto &entry : Index) {
+    	    if (entry.first >= blocknum && entry.first - blocknum < nblocks) {
+    	    	dropped.push_back(entry.second);
+    	    }
+    	}
+    }
+
+    for (Buffer *buffer : dropped) {
+    	if (buffer->Pins > 0) {
+    	    memset(buffer->Data, 0, BLOCK_SIZE);
+    	    buffer->Dirty = false;
+    	} else {
+    	    remove(buffer);
+    	}
+    }
+
+    Device->discard(blocknum, nblocks);
+}
+
+void BufferCache::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    std::vector<Buffer *> cached(nblocks, nullptr);
+    size_t found = 0;
+    for (size_t i = 0; i < nblocks; i++) {
+    	cached[i] = lookup(blocknum + i);
+    	found    += cached[i] != nullptr;
+    }
+
+    if (found < nblocks) {
+    	Device->read_blocks(blocknum, nblocks, data);
+    }
+    for (size_t i = 0; i < nblocks; i++) {
+    	if (cached[i] != nullptr) {
+    	    memcpy(data + i*BLOCK_SIZE, cached[i]->Data, BLOCK_SIZE);
+    	}
+    }
+
+    Hits   += found;
+    Misses += nblocks - found;
+    Reads  += nblocks;
+}
+
+void BufferCache::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    std::unique_lock<std::mutex> guard(Lock);
+
+    wait_expired(guard);
+    Device->write_blocks(blocknum, nblocks, data);
+    for (size_t i = 0; i < nblocks; i++) {
+    	if (Buffer *buffer = lookup(blocknum + i)) {
+    	    memcpy(buffer->Data, data + i*BLOCK_SIZE, BLOCK_SIZE);
+    	    buffer->Dirty = false;
+    	}
+    }
+
+    Writes += nblocks;
+}
+
+void BufferCache::readv(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Misses get buffers up front, pinned so that making room for later
+    // ones cannot evict them before the device fills them in
+    std::vector<Buffer *> fresh;
+    std::vector<BlockRequest> misses;
+    for (size_t i = 0; i < count; i++) {
+    	Buffer *buffer = lookup(requests[i].blocknum);
+    	if (buffer == nullptr) {
+    	    buffer = insert(requests[i].blocknum);
+    	    buffer->Pins++;
+    	    fresh.push_back(buffer);
+
+    	    BlockRequest miss;
+    	    miss.blocknum = buffer->Blocknum;
+    	    miss.data     = buffer->Data;
+    	    misses.push_back(miss);
+    	} else if (std::find(fresh.begin(), fresh.end(), buffer) == fresh.end()) {
+    	    touch(buffer);
+    	    Hits++;
+    	}
+    }
+
+    try {
+    	Device->readv(misses.data(), misses.size());
+    } catch (...) {
+    	for (Buffer *buffer : fresh) {
+    	    remove(buffer);
+    	}
+    	throw;
+    }
+    Misses += misses.size();
+
+    for (size_t i = 0; i < count; i++) {
+    	memcpy(requests[i].data, lookup(requests[i].blocknum)->Data, BLOCK_SIZE);
+    }
+    for (Buffer *buffer : fresh) {
+    	buffer->Pins--;
+    }
+    if (Index.size() > Capacity) {
+    	reclaim();
+    }
+
+    Reads += count;
+}
+
+void BufferCache::writev(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < count; i++) {
+    	Buffer *buffer = lookup(requests[i].blocknum);
+    	if (buffer != nullptr) {
+    	    touch(buffer);
+    	} else {
+    	    buffer = insert(requests[i].blocknum);
+    	}
+    	memcpy(buffer->Data, requests[i].data, BLOCK_SIZE);
+    	mark_dirty(buffer);
+    }
+
+    Writes += count;
+}
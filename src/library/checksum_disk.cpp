@@ -0,0 +1,430 @@
+// checksum_disk.cpp: block device wrapper that keeps a CRC32C per block
+
+#include "sfs/checksum_disk.h"
+#include "sfs/crc32c.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+
+ChecksumDisk::ChecksumDisk(BlockDevice *device, uint64_t table) : BlockDevice(), Device(device), Table(table), Pool(0), Reporting(false),
+    TableChecksum(0), TableKnown(false) {
+    Blocks      = Device->size();
+    TableBlocks = table_blocks(Blocks);
+
+    alignas(BLOCK_SIZE) static const char zeros[BLOCK_SIZE] = {0};
+    ZeroChecksum = crc32c(0, zeros, BLOCK_SIZE);
+}
+
+uint32_t ChecksumDisk::entry(const char *data) const {
+    return crc32c(0, data, BLOCK_SIZE) ^ ZeroChecksum;
+}
+
+uint32_t ChecksumDisk::part(size_t index, const char *data) const {
+    // Seeding with the index makes the part depend on where the block sits
+    alignas(BLOCK_SIZE) static const char zeros[BLOCK_SIZE] = {0};
+    uint64_t position = index;
+    uint32_t seed     = crc32c(0, &position, sizeof(position));
+    return crc32c(seed, data, BLOCK_SIZE) ^ crc32c(seed, zeros, BLOCK_SIZE);
+}
+
+void ChecksumDisk::written(size_t index, Page &page) {
+    uint32_t now = part(index, reinterpret_cast<char *>(page.Entries));
+    TableChecksum ^= page.Part ^ now;
+    page.Part  = now;
+    page.Dirty = false;
+}
+
+void ChecksumDisk::forget_parts(size_t index, size_t count) {
+    // Blocks not in memory are read back for their parts, a block of table
+    // for every ENTRIES_PER_BLOCK blocks discarded
+    BlockPool    arena(0);
+    PooledBuffer buffer(arena, SCAN_BLOCKS);
+    for (size_t t = index; t < index + count; ) {
+    	auto found = Pages.find(t);
+    	if (found != Pages.end()) {
+    	    TableChecksum ^= found->second.Part;
+    	    t++;
+    	    continue;
+    	}
+    	size_t run = 1;
+    	while (run < SCAN_BLOCKS && t + run < index + count && !Pages.count(t + run)) {
+    	    run++;
+    	}
+    	Device->read_blocks(Table + t, run, buffer.data());
+    	for (size_t i = 0; i < run; i++) {
+    	    TableChecksum ^= part(t + i, buffer.data() + i*BLOCK_SIZE);
+    	}
+    	t += run;
+    }
+}
+
+ChecksumDisk::Page &ChecksumDisk::page(size_t index) {
+    auto found = Pages.find(index);
+    if (found != Pages.end()) {
+    	LRU.splice(LRU.end(), LRU, found->second.Position);
+    	return found->second;
+    }
+
+    if (Pages.size() >= TABLE_PAGES) {
+    	evict();
+    }
+    char *buffer = Pool.acquire();
+    try {
+    	Device->read(Table + index, buffer);
+    } catch (...) {
+    	Pool.release(buffer);
+    	throw;
+    }
+
+    Page &page    = Pages[index];
+    page.Entries  = reinterpret_cast<uint32_t *>(buffer);
+    page.Dirty    = false;
+    page.Part     = part(index, buffer);
+    page.Position = LRU.insert(LRU.end(), index);
+    return page;
+}
+
+void ChecksumDisk::evict() {
+    size_t index = LRU.front();
+    Page &page   = Pages[index];
+    if (page.Dirty) {
+    	Device->write(Table + index, reinterpret_cast<char *>(page.Entries));
+    	written(index, page);
+    }
+    drop(index);
+}
+
+void ChecksumDisk::drop(size_t index) {
+    auto found = Pages.find(index);
+    if (found == Pages.end()) {
+    	return;
+    }
+    Pool.release(reinterpret_cast<char *>(found->second.Entries));
+    LRU.erase(found->second.Position);
+    Pages.erase(found);
+}
+
+void ChecksumDisk::set_entry(uint64_t blocknum, uint32_t value) {
+    Page &entries = page(blocknum / ENTRIES_PER_BLOCK);
+    entries.Entries[blocknum % ENTRIES_PER_BLOCK] = value;
+    entries.Dirty = true;
+}
+
+bool ChecksumDisk::verified(uint64_t blocknum) const {
+    auto run = Verify.upper_bound(blocknum);
+    return run != Verify.begin() && std::prev(run)->second > blocknum;
+}
+
+void ChecksumDisk::mark(uint64_t first, uint64_t end, bool verify) {
+    if (first >= end) {
+    	return;
+    }
+
+    // Cut the run out of the ones there are, keeping what sticks out
+    auto run = Verify.upper_bound(first);
+    if (run != Verify.begin() && std::prev(run)->second > first) {
+    	--run;
+    }
+    while (run != Verify.end() && run->first < end) {
+    	uint64_t start = run->first;
+    	uint64_t stop  = run->second;
+    	run = Verify.erase(run);
+    	if (start < first) {
+    	    Verify[start] = first;
+    	}
+    	if (stop > end) {
+    	    Verify[end] = stop;
+    	}
+    }
+    if (!verify) {
+    	return;
+    }
+
+    // Then add it, merged with the runs it touches
+    auto next = Verify.find(end);
+    if (next != Verify.end()) {
+    	end = next->second;
+    	Verify.erase(next);
+    }
+    auto prev = Verify.lower_bound(first);
+    if (prev != Verify.begin() && std::prev(prev)->second == first) {
+    	--prev;
+    	first = prev->first;
+    	Verify.erase(prev);
+    }
+    Verify[first] = end;
+}
+
+void ChecksumDisk::check(uint64_t blocknum, const char *data) {
+    bool verify;
+    uint32_t expected = 0;
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	verify = verified(blocknum);
+    	if (verify) {
+    	    expected = page(blocknum / ENTRIES_PER_BLOCK).Entries[blocknum % ENTRIES_PER_BLOCK];
+    	}
+    }
+
+    if (verify && entry(data) != expected) {
+    	if (Reporting) {
+    	    std::lock_guard<std::mutex> guard(Lock);
+    	    if (Mismatched.insert(blocknum).second) {
+    	    	Unreported.push_back(blocknum);
+    	    }
+    	    return;
+    	}
+
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Checksum mismatch on block %lu", blocknum);
+    	throw std::runtime_error(what);
+    }
+}
+
+void ChecksumDisk::update(uint64_t blocknum, uint32_t value) {
+    std::lock_guard<std::mutex> guard(Lock);
+    set_entry(blocknum, value);
+    Mismatched.erase(blocknum);
+}
+
+void ChecksumDisk::report_mismatches(bool report) {
+    std::lock_guard<std::mutex> guard(Lock);
+    Reporting = report;
+}
+
+std::vector<uint64_t> ChecksumDisk::take_mismatches() {
+    std::lock_guard<std::mutex> guard(Lock);
+    std::vector<uint64_t> blocks;
+    blocks.swap(Unreported);
+    return blocks;
+}
+
+size_t ChecksumDisk::mismatched() {
+    std::lock_guard<std::mutex> guard(Lock);
+    return Mismatched.size();
+}
+
+void ChecksumDisk::refresh(const uint64_t *blocks, size_t count) {
+    BlockPool    arena(0);
+    PooledBuffer buffer(arena, SCAN_BLOCKS);
+    std::vector<BlockRequest> requests;
+    auto read_batch = [&]() {
+    	Device->readv(requests.data(), requests.size());
+    	for (size_t r = 0; r < requests.size(); r++) {
+    	    set_entry(requests[r].blocknum, entry(requests[r].data));
+    	}
+    	requests.clear();
+    };
+
+    // The lock is held from the read to the update, so a write racing
+    // with it either lands before the read or updates the entry after
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < count; i++) {
+    	if (verified(blocks[i])) {
+    	    continue;
+    	}
+    	BlockRequest request;
+    	request.blocknum = blocks[i];
+    	request.data     = buffer.data() + requests.size()*BLOCK_SIZE;
+    	requests.push_back(request);
+    	if (requests.size() == SCAN_BLOCKS) {
+    	    read_batch();
+    	}
+    }
+    read_batch();
+}
+
+void ChecksumDisk::trust_table_checksum(uint32_t checksum) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    TableChecksum = checksum;
+    TableKnown	  = true;
+}
+
+uint32_t ChecksumDisk::table_checksum() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    write_table();
+    if (TableKnown) {
+    	return TableChecksum;
+    }
+
+    // Blocks in memory are as on device now that they are written
+    BlockPool    arena(0);
+    PooledBuffer buffer(arena, SCAN_BLOCKS);
+    TableChecksum = 0;
+    for (size_t first = 0; first < TableBlocks; first += SCAN_BLOCKS) {
+    	size_t count = std::min(TableBlocks - first, +SCAN_BLOCKS);
+    	Device->read_blocks(Table + first, count, buffer.data());
+    	for (size_t i = 0; i < count; i++) {
+    	    TableChecksum ^= part(first + i, buffer.data() + i*BLOCK_SIZE);
+    	}
+    }
+    TableKnown = true;
+    return TableChecksum;
+}
+
+void ChecksumDisk::write_table() {
+    std::vector<BlockRequest> requests;
+    for (auto &entries : Pages) {
+    	if (!entries.second.Dirty) {
+    	    continue;
+    	}
+    	BlockRequest request;
+    	request.blocknum = Table + entries.first;
+    	request.data     = reinterpret_cast<char *>(entries.second.Entries);
+    	requests.push_back(request);
+    }
+    Device->writev(requests.data(), requests.size());
+    for (auto &entries : Pages) {
+    	if (entries.second.Dirty) {
+    	    written(entries.first, entries.second);
+    	}
+    }
+}
+
+void ChecksumDisk::flush() {
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	write_table();
+    }
+    Device->flush();
+}
+
+void ChecksumDisk::sync() {
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	write_table();
+    }
+    Device->sync();
+}
+
+void ChecksumDisk::metadata(uint64_t blocknum, size_t nblocks, bool metadata) {
+    range_check(blocknum, nblocks);
+
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	mark(blocknum, blocknum + nblocks, metadata);
+    	// the superblock and the table carry checksums of their own
+    	mark(0, 1, false);
+    	mark(Table, Table + TableBlocks, false);
+    }
+
+    Device->metadata(blocknum, nblocks, metadata);
+}
+
+void ChecksumDisk::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    Device->read(blocknum, data);
+    check(blocknum, data);
+
+    Reads++;
+}
+
+void ChecksumDisk::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    // the entry only changes once the block is on the device, so a failed
+    // write leaves the two matching
+    uint32_t value = entry(data);
+    Device->write(blocknum, data);
+    update(blocknum, value);
+
+    Writes++;
+}
+
+void ChecksumDisk::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    Device->discard(blocknum, nblocks);
+
+    // a table block whose entries all go is discarded too, rather than
+    // read in to be zeroed
+    std::lock_guard<std::mutex> guard(Lock);
+    uint64_t end = blocknum + nblocks;
+    Mismatched.erase(Mismatched.lower_bound(blocknum), Mismatched.lower_bound(end));
+    for (uint64_t b = blocknum; b < end; ) {
+    	size_t	 index = b / ENTRIES_PER_BLOCK;
+    	uint64_t stop  = std::min<uint64_t>((index + 1)*ENTRIES_PER_BLOCK, end);
+    	if (b % ENTRIES_PER_BLOCK == 0 && stop == (index + 1)*ENTRIES_PER_BLOCK) {
+    	    size_t whole = (end - b) / ENTRIES_PER_BLOCK;
+    	    if (TableKnown) {
+    	    	forget_parts(index, whole);
+    	    }
+    	    for (size_t t = 0; t < whole; t++) {
+    	    	drop(index + t);
+    	    }
+    	    Device->discard(Table + index, whole);
+    	    b += whole*ENTRIES_PER_BLOCK;
+    	    continue;
+    	}
+    	for (; b < stop; b++) {
+    	    set_entry(b, 0);
+    	}
+    }
+}
+
+void ChecksumDisk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    Device->read_blocks(blocknum, nblocks, data);
+    for (size_t i = 0; i < nblocks; i++) {
+    	check(blocknum + i, data + i*BLOCK_SIZE);
+    }
+
+    Reads += nblocks;
+}
+
+void ChecksumDisk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    std::vector<uint32_t> values(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	values[i] = entry(data + i*BLOCK_SIZE);
+    }
+    Device->write_blocks(blocknum, nblocks, data);
+    for (size_t i = 0; i < nblocks; i++) {
+    	update(blocknum + i, values[i]);
+    }
+
+    Writes += nblocks;
+}
+
+void ChecksumDisk::readv(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    Device->readv(requests, count);
+    for (size_t i = 0; i < count; i++) {
+    	check(requests[i].blocknum, requests[i].data);
+    }
+
+    Reads += count;
+}
+
+void ChecksumDisk::writev(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    // A block listed twice ends up with the last buffer, as on the device
+    std::vector<uint32_t> values(count);
+    for (size_t i = 0; i < count; i++) {
+    	values[i] = entry(requests[i].data);
+    }
+    Device->writev(requests, count);
+    for (size_t i = 0; i < count; i++) {
+    	update(requests[i].blocknum, values[i]);
+    }
+
+    Writes += count;
+}
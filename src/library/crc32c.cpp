@@ -0,0 +1,170 @@
+// crc32c.cpp: CRC32C (Castagnoli) checksums
+
+#include "sfs/crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Reflected Castagnoli polynomial
+static const uint32_t POLYNOMIAL = 0x82f63b78;
+
+// Bytes per stream of the three-way hardware loop; three streams cover
+// all but the last 16 bytes of a 4096-byte block
+static const size_t STREAM_BYTES = 1360;
+
+// Software implementation ------------------------------------------------------
+
+// Slicing-by-8 tables: Table[k][b] is the crc of byte b followed by k zeros
+static uint32_t Table[8][256];
+
+static void build_tables() {
+    for (uint32_t b = 0; b < 256; b++) {
+    	uint32_t crc = b;
+    	for (int bit = 0; bit < 8; bit++) {
+    	    crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+    	}
+    	Table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+    	for (int k = 1; k < 8; k++) {
+    	    Table[k][b] = (Table[k-1][b] >> 8) ^ Table[0][Table[k-1][b] & 0xff];
+    	}
+    }
+}
+
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *data, size_t length) {
+    while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    	crc = (crc >> 8) ^ Table[0][(crc ^ *data++) & 0xff];
+    	length--;
+    }
+
+    while (length >= 8) {
+    	uint64_t word;
+    	memcpy(&word, data, 8);
+    	word ^= crc;
+    	crc = Table[7][word & 0xff] ^ Table[6][(word >> 8) & 0xff] ^
+    	      Table[5][(word >> 16) & 0xff] ^ Table[4][(word >> 24) & 0xff] ^
+    	      Table[3][(word >> 32) & 0xff] ^ Table[2][(word >> 40) & 0xff] ^
+    	      Table[1][(word >> 48) & 0xff] ^ Table[0][word >> 56];
+    	data   += 8;
+    	length -= 8;
+    }
+
+    while (length > 0) {
+    	crc = (crc >> 8) ^ Table[0][(crc ^ *data++) & 0xff];
+    	length--;
+    }
+    return crc;
+}
+
+// Hardware implementation ------------------------------------------------------
+
+#if defined(__x86_64__)
+
+// Multipliers that advance a crc over one and two streams of zeros
+static uint64_t ShiftOne;
+static uint64_t ShiftTwo;
+
+// Return x^exponent mod POLYNOMIAL, bit-reflected
+static uint32_t power(size_t exponent) {
+    uint32_t value = 0x80000000;
+    while (exponent-- > 0) {
+    	value = (value >> 1) ^ (value & 1 ? POLYNOMIAL : 0);
+    }
+    return value;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_single(uint32_t crc, const unsigned char *data, size_t length) {
+    while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    	crc = _mm_crc32_u8(crc, *data++);
+    	length--;
+    }
+
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+    	uint64_t word;
+    	memcpy(&word, data, 8);
+    	crc64   = _mm_crc32_u64(crc64, word);
+    	data   += 8;
+    	length -= 8;
+    }
+    crc = crc64;
+
+    while (length > 0) {
+    	crc = _mm_crc32_u8(crc, *data++);
+    	length--;
+    }
+    return crc;
+}
+
+// Advance a crc over bytes of zeros: multiplying the crc by x^(8n-33) and
+// reducing the 64-bit product with the crc32 instruction (which multiplies
+// by x^33 more) gives crc * x^8n mod P
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift(uint32_t crc, uint64_t multiplier) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi64_si128(multiplier), 0x00);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hardware_streams(uint32_t crc, const unsigned char *data, size_t length) {
+    // The crc32 instruction has a latency of three cycles but can start
+    // every cycle, so three independent streams run it at full rate
+    while (length >= 3*STREAM_BYTES) {
+    	const unsigned char *one   = data;
+    	const unsigned char *two   = data + STREAM_BYTES;
+    	const unsigned char *three = data + 2*STREAM_BYTES;
+    	uint64_t a = crc, b = 0, c = 0;
+
+    	for (size_t i = 0; i < STREAM_BYTES; i += 8) {
+    	    uint64_t wa, wb, wc;
+    	    memcpy(&wa, one + i, 8);
+    	    memcpy(&wb, two + i, 8);
+    	    memcpy(&wc, three + i, 8);
+    	    a = _mm_crc32_u64(a, wa);
+    	    b = _mm_crc32_u64(b, wb);
+    	    c = _mm_crc32_u64(c, wc);
+    	}
+
+    	crc = shift(a, ShiftTwo) ^ shift(b, ShiftOne) ^ (uint32_t)c;
+    	data   += 3*STREAM_BYTES;
+    	length -= 3*STREAM_BYTES;
+    }
+
+    return crc32c_single(crc, data, length);
+}
+
+#endif
+
+// Dispatch ---------------------------------------------------------------------
+
+typedef uint32_t (*Implementation)(uint32_t, const unsigned char *, size_t);
+
+static Implementation choose() {
+    build_tables();
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+    	ShiftOne = power(8*STREAM_BYTES - 33);
+    	ShiftTwo = power(8*2*STREAM_BYTES - 33);
+    	return crc32c_hardware_streams;
+    }
+#endif
+
+    return crc32c_software;
+}
+
+static Implementation Selected = choose();
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    return ~Selected(~crc, static_cast<const unsigned char *>(data), length);
+}
+
+bool crc32c_hardware() {
+    return Selected != crc32c_software;
+}
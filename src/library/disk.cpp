@@ -1,16 +1,25 @@
 // disk.cpp: disk emulator
 
 #include "sfs/disk.h"
+#include "sfs/block_pool.h"
 
+#include <algorithm>
 #include <stdexcept>
+#include <vector>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 
-void Disk::open(const char *path, size_t nblocks) {
-    FileDescriptor = ::open(path, O_RDWR|O_CREAT, 0600);
+void Disk::open(const char *path, size_t nblocks, Mode mode) {
+    int flags = O_RDWR|O_CREAT;
+    if (mode == Mode::DIRECT) {
+    	flags |= O_DIRECT;
+    }
+
+    FileDescriptor = ::open(path, flags, 0600);
     if (FileDescriptor < 0) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
@@ -26,68 +35,294 @@ void Disk::open(const char *path, size_t nblocks) {
     Blocks = nblocks;
     Reads  = 0;
     Writes = 0;
+    Direct = mode == Mode::DIRECT;
+    Sparse = true;
+    if (Direct && Bounce == nullptr) {
+    	Bounce = new BlockPool(BOUNCE_BLOCKS);
+    }
 }
 
 Disk::~Disk() {
     if (FileDescriptor > 0) {
-    	/* printf("%lu disk block reads\n", Reads); */
-    	/* printf("%lu disk block writes\n", Writes); */
+    	/* printf("%lu disk block reads\n", reads()); */
+    	/* printf("%lu disk block writes\n", writes()); */
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
+    delete Bounce;
 }
 
-void Disk::sanity_check(int blocknum, char *data) {
-    char what[BUFSIZ];
+void Disk::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
 
-    if (blocknum < 0) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is negative!", blocknum);
-    	throw std::invalid_argument(what);
+    if (Direct) {
+    	iovec iov = { data, BLOCK_SIZE };
+    	transfer(blocknum, &iov, 1, false);
+    	Reads++;
+    	return;
     }
 
-    if (blocknum >= (int)Blocks) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is too big!", blocknum);
-    	throw std::invalid_argument(what);
+    // Positional I/O leaves the shared file offset alone, so concurrent
+    // callers cannot race on it
+    if (pread(FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != BLOCK_SIZE) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to read %lu: %s", blocknum, strerror(errno));
+    	throw std::runtime_error(what);
     }
 
-    if (data == NULL) {
-    	snprintf(what, BUFSIZ, "null data pointer!");
-    	throw std::invalid_argument(what);
-    }
+    Reads++;
 }
 
-void Disk::read(int blocknum, char *data) {
+void Disk::write(uint64_t blocknum, char *data) {
     sanity_check(blocknum, data);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    if (Sparse && zero_block(data)) {
+    	discard(blocknum, 1);
+    	Writes++;
+    	return;
+    }
+
+    if (Direct) {
+    	iovec iov = { data, BLOCK_SIZE };
+    	transfer(blocknum, &iov, 1, true);
+    	Writes++;
+    	return;
+    }
+
+    if (pwrite(FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to write %lu: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    Writes++;
+}
+
+void Disk::sync() {
+    // Block writes never change the image size, so only the data needs to
+    // reach the disk
+    if (fdatasync(FileDescriptor) < 0) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to sync: %s", strerror(errno));
     	throw std::runtime_error(what);
     }
+}
 
-    Reads++;
+void Disk::transfer(uint64_t blocknum, iovec *iov, size_t iovcnt, bool writing) {
+    while (iovcnt > 0) {
+    	int	count  = std::min(iovcnt, (size_t)IOV_MAX);
+    	off_t	offset = (off_t)blocknum*BLOCK_SIZE;
+    	ssize_t	expect = (ssize_t)count*BLOCK_SIZE;
+
+    	// O_DIRECT rejects unaligned buffers, so swap those for pool buffers
+    	std::vector<iovec> staged;
+    	iovec *vector = iov;
+    	if (Direct) {
+    	    for (int i = 0; i < count; i++) {
+    	    	if (BlockPool::aligned(iov[i].iov_base)) {
+    	    	    continue;
+    	    	}
+    	    	if (staged.empty()) {
+    	    	    staged.assign(iov, iov + count);
+    	    	}
+    	    	staged[i].iov_base = Bounce->acquire();
+    	    	if (writing) {
+    	    	    memcpy(staged[i].iov_base, iov[i].iov_base, BLOCK_SIZE);
+    	    	}
+    	    }
+    	    if (!staged.empty()) {
+    	    	vector = staged.data();
+    	    }
+    	}
+
+    	ssize_t	result = writing ? pwritev(FileDescriptor, vector, count, offset)
+    	    	    	    	 : preadv(FileDescriptor, vector, count, offset);
+    	int	error  = errno;
+
+    	for (size_t i = 0; i < staged.size(); i++) {
+    	    if (staged[i].iov_base == iov[i].iov_base) {
+    	    	continue;
+    	    }
+    	    if (!writing && result == expect) {
+    	    	memcpy(iov[i].iov_base, staged[i].iov_base, BLOCK_SIZE);
+    	    }
+    	    Bounce->release(static_cast<char *>(staged[i].iov_base));
+    	}
+
+    	if (result != expect) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to %s %lu+%d: %s", writing ? "write" : "read",
+    	    	     blocknum, count, strerror(error));
+    	    throw std::runtime_error(what);
+    	}
+
+    	blocknum += count;
+    	iov      += count;
+    	iovcnt   -= count;
+    }
+}
+
+void Disk::store(uint64_t blocknum, iovec *iov, size_t iovcnt) {
+    if (!Sparse) {
+    	transfer(blocknum, iov, iovcnt, true);
+    	return;
+    }
+
+    // Alternate between runs of zero blocks, which are punched out, and
+    // runs of data blocks, which are written
+    size_t end;
+    for (size_t start = 0; start < iovcnt; start = end) {
+    	bool zero = zero_block(static_cast<char *>(iov[start].iov_base));
+    	for (end = start + 1; end < iovcnt; end++) {
+    	    if (zero_block(static_cast<char *>(iov[end].iov_base)) != zero) {
+    	    	break;
+    	    }
+    	}
+
+    	if (zero) {
+    	    discard(blocknum + start, end - start);
+    	} else {
+    	    transfer(blocknum + start, &iov[start], end - start, true);
+    	}
+    }
+}
+
+void Disk::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    if (Sparse) {
+    	if (fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+    	    	      (off_t)blocknum*BLOCK_SIZE, (off_t)nblocks*BLOCK_SIZE) == 0) {
+    	    return;
+    	}
+
+    	if (errno != EOPNOTSUPP) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to discard %lu+%lu: %s", blocknum, nblocks, strerror(errno));
+    	    throw std::runtime_error(what);
+    	}
+
+    	// The host file system cannot punch holes, so stop trying
+    	Sparse = false;
+    }
+
+    BlockDevice::discard(blocknum, nblocks);
 }
 
-void Disk::write(int blocknum, char *data) {
+// Split a buffer holding a run of blocks into one iovec per block, so that
+// transfer() can stage each unaligned block on its own
+static std::vector<iovec> split_blocks(char *data, size_t nblocks) {
+    std::vector<iovec> iov(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	iov[i].iov_base = data + i*Disk::BLOCK_SIZE;
+    	iov[i].iov_len  = Disk::BLOCK_SIZE;
+    }
+    return iov;
+}
+
+void Disk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
     sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    if (Direct && !BlockPool::aligned(data)) {
+    	std::vector<iovec> iov = split_blocks(data, nblocks);
+    	transfer(blocknum, iov.data(), nblocks, false);
+    	Reads += nblocks;
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    iovec iov = { data, nblocks*BLOCK_SIZE };
+    if (pread(FileDescriptor, iov.iov_base, iov.iov_len, (off_t)blocknum*BLOCK_SIZE) != (ssize_t)iov.iov_len) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to read %lu+%lu: %s", blocknum, nblocks, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    Reads += nblocks;
+}
+
+void Disk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    bool holes = false;
+    for (size_t i = 0; Sparse && !holes && i < nblocks; i++) {
+    	holes = zero_block(data + i*BLOCK_SIZE);
+    }
+
+    if (holes || (Direct && !BlockPool::aligned(data))) {
+    	std::vector<iovec> iov = split_blocks(data, nblocks);
+    	store(blocknum, iov.data(), nblocks);
+    	Writes += nblocks;
+    	return;
+    }
+
+    iovec iov = { data, nblocks*BLOCK_SIZE };
+    if (pwrite(FileDescriptor, iov.iov_base, iov.iov_len, (off_t)blocknum*BLOCK_SIZE) != (ssize_t)iov.iov_len) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to write %lu+%lu: %s", blocknum, nblocks, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    Writes++;
+    Writes += nblocks;
+}
+
+// Sort a copy of the requests by block number and hand every run of
+// consecutive blocks to transfer() as one vectored I/O.  The sort is stable
+// so that when a block is written twice the later buffer still wins.
+static void coalesce(const Disk::BlockRequest *requests, size_t count,
+    	    	     std::vector<Disk::BlockRequest> &sorted, std::vector<iovec> &iov) {
+    sorted.assign(requests, requests + count);
+    std::stable_sort(sorted.begin(), sorted.end(),
+    	[](const Disk::BlockRequest &a, const Disk::BlockRequest &b) {
+    	    return a.blocknum < b.blocknum;
+    	});
+
+    iov.resize(count);
+    for (size_t i = 0; i < count; i++) {
+    	iov[i].iov_base = sorted[i].data;
+    	iov[i].iov_len  = Disk::BLOCK_SIZE;
+    }
+}
+
+void Disk::readv(const BlockRequest *requests, size_t count) {
+    std::vector<BlockRequest> sorted;
+    std::vector<iovec> iov;
+
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    coalesce(requests, count, sorted, iov);
+    for (size_t start = 0, end = 1; start < count; start = end++) {
+    	while (end < count && sorted[end].blocknum == sorted[end-1].blocknum + 1) {
+    	    end++;
+    	}
+    	transfer(sorted[start].blocknum, &iov[start], end - start, false);
+    }
+
+    Reads += count;
+}
+
+void Disk::writev(const BlockRequest *requests, size_t count) {
+    std::vector<BlockRequest> sorted;
+    std::vector<iovec> iov;
+
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    coalesce(requests, count, sorted, iov);
+    for (size_t start = 0, end = 1; start < count; start = end++) {
+    	while (end < count && sorted[end].blocknum == sorted[end-1].blocknum + 1) {
+    	    end++;
+    	}
+    	store(sorted[start].blocknum, &iov[start], end - start);
+    }
+
+    Writes += count;
 }
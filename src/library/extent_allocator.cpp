@@ -0,0 +1,165 @@
+// extent_allocator.cpp: block allocation bitmap with an index of free extents
+
+#include "sfs/extent_allocator.h"
+
+#include <algorithm>
+#include <iterator>
+
+ExtentAllocator::ExtentAllocator(size_t nitems) : Cursor(0) {
+    reset(nitems);
+}
+
+void ExtentAllocator::reset(size_t nitems) {
+    Bits.reset(nitems);
+    Cursor = 0;
+    reindex();
+}
+
+void ExtentAllocator::insert(size_t start, size_t length) {
+    Starts.insert(std::make_pair(start, length));
+    Lengths.insert(std::make_pair(length, start));
+}
+
+void ExtentAllocator::erase(StartIndex::iterator extent) {
+    Lengths.erase(std::make_pair(extent->second, extent->first));
+    Starts.erase(extent);
+}
+
+void ExtentAllocator::take(size_t start, size_t length) {
+    StartIndex::iterator extent = std::prev(Starts.upper_bound(start));
+    size_t first = extent->first;
+    size_t end   = extent->first + extent->second;
+    erase(extent);
+
+    if (first < start) {
+    	insert(first, start - first);
+    }
+    if (start + length < end) {
+    	insert(start + length, end - start - length);
+    }
+}
+
+void ExtentAllocator::give(size_t start, size_t length) {
+    StartIndex::iterator next = Starts.lower_bound(start);
+    if (next != Starts.end() && next->first == start + length) {
+    	length += next->second;
+    	erase(next);
+    }
+
+    StartIndex::iterator prev = Starts.lower_bound(start);
+    if (prev != Starts.begin()) {
+    	--prev;
+    	if (prev->first + prev->second == start) {
+    	    start   = prev->first;
+    	    length += prev->second;
+    	    erase(prev);
+    	}
+    }
+
+    insert(start, length);
+}
+
+void ExtentAllocator::reindex() {
+    Starts.clear();
+    Lengths.clear();
+
+    size_t start = Bits.find_free(0);
+    while (start != NONE) {
+    	size_t end = std::min(Bits.find_taken(start), Bits.size());
+    	insert(start, end - start);
+    	start = Bits.find_free(end);
+    }
+}
+
+void ExtentAllocator::set(size_t item) {
+    if (item < Bits.size() && !Bits.test(item)) {
+    	Bits.set(item);
+    	take(item, 1);
+    }
+}
+
+void ExtentAllocator::clear(size_t item) {
+    if (Bits.test(item)) {
+    	Bits.clear(item);
+    	give(item, 1);
+    }
+}
+
+void ExtentAllocator::clear_range(size_t item, size_t nitems) {
+    size_t end = std::min(item + nitems, Bits.size());
+    while (item < end) {
+    	if (!Bits.test(item)) {
+    	    item++;
+    	    continue;
+    	}
+
+    	size_t run = item;
+    	while (run < end && Bits.test(run)) {
+    	    run++;
+    	}
+    	Bits.clear_range(item, run - item);
+    	give(item, run - item);
+    	item = run;
+    }
+}
+
+size_t ExtentAllocator::allocate() {
+    size_t got;
+    return allocate_run(NONE, 1, &got);
+}
+
+size_t ExtentAllocator::allocate_run(size_t goal, size_t want, size_t *got) {
+    *got = 0;
+    if (Starts.empty() || want == 0) {
+    	return NONE;
+    }
+
+    bool   aimed     = goal < Bits.size();
+    size_t from      = aimed ? goal : Cursor;
+    size_t start     = NONE;
+    size_t available = 0;
+
+    // Find the extent holding the goal (or the cursor), else the one after
+    StartIndex::iterator extent = Starts.upper_bound(from);
+    if (extent != Starts.begin() && std::prev(extent)->first + std::prev(extent)->second > from) {
+    	--extent;
+    }
+
+    // Continue the extent holding the goal, however short it is
+    if (aimed && extent != Starts.end() && extent->first <= goal) {
+    	start     = goal;
+    	available = extent->first + extent->second - goal;
+    }
+
+    // Else take the first long enough extent among the next few
+    for (size_t n = 0; start == NONE && extent != Starts.end() && n < NEAR_EXTENTS; ++extent, ++n) {
+    	size_t first = std::max(extent->first, from);
+    	size_t end   = extent->first + extent->second;
+    	if (end - first >= want) {
+    	    start     = first;
+    	    available = end - first;
+    	}
+    }
+
+    // Else the shortest long enough extent anywhere, or the longest one
+    if (start == NONE) {
+    	LengthIndex::iterator fit = Lengths.lower_bound(std::make_pair(want, size_t(0)));
+    	if (fit == Lengths.end()) {
+    	    fit = std::prev(Lengths.end());
+    	}
+    	start     = fit->second;
+    	available = fit->first;
+    }
+
+    *got = std::min(want, available);
+    Bits.set_range(start, *got);
+    take(start, *got);
+    Cursor = start + *got < Bits.size() ? start + *got : 0;
+    return start;
+}
+
+void ExtentAllocator::load(const uint64_t *words) {
+    Bits.load(words);
+    Cursor = 0;
+    reindex();
+}
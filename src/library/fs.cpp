@@ -1,12 +1,11 @@
 // fs.cpp: File System
 
 #include "sfs/fs.h"
-
-// fs.cpp: File System
-
-#include "sfs/fs.h"
+#include "sfs/crc32c.h"
+#include "sfs/io_profile.h"
 
 #include <algorithm>
+#include <stdexcept>
 
 #include <assert.h>
 #include <stdio.h>
@@ -21,58 +20,101 @@ void FileSystem::print_dirent(Dirent &dirent) {
 
 // Debug file system -----------------------------------------------------------
 
-void FileSystem::debug(Disk *disk) {
+void FileSystem::debug(BlockDevice *disk) {
     Block block;
 
     // Read Superblock
     disk->read(0, block.Data);
 
+    SuperBlock super;
+    uint32_t version;
+    bool valid = load_super(block, &super, &version);
+
     // inode block num
-    uint32_t inode_b = block.Super.InodeBlocks;
+    uint64_t inode_b = super.InodeBlocks;
 
     printf("SuperBlock:\n");
-    if (block.Super.MagicNumber == FileSystem::MAGIC_NUMBER)
+    if (valid)
         printf("    magic number is %s\n", "valid");
     else
         printf("    magic number is %s\n", "invalid");
 
-    printf("    %u blocks\n"         , block.Super.Blocks);
-    printf("    %u inode blocks\n"   , inode_b);
-    printf("    %u inodes\n"         , block.Super.Inodes);
-
-    // Read Inode blocks
-    for (uint32_t i = 1; i <= inode_b; i++) {
-        disk->read(i, block.Data);
-        for (uint32_t j = 0; j < FileSystem::INODES_PER_BLOCK; j++) {
-            
-            if (block.Inodes[j].Valid) {
-                printf("Inode %d:\n", (i-1)*FileSystem::INODES_PER_BLOCK + j);
-                printf("    size: %d bytes\n", block.Inodes[j].Size);
-                printf("    direct blocks:");
-                for (int k = 0; k < 5; k++) {
-                    if (block.Inodes[j].Direct[k] != 0) {
-                        printf(" %d", block.Inodes[j].Direct[k]);
-                    }  
-                }
-                printf("\n");
-
-                if (block.Inodes[j].Indirect != 0) {
-                    printf("    indirect block: %d\n", block.Inodes[j].Indirect);
-                    // indirect block
-                    Block indi_block;                
-
-                    disk->read(block.Inodes[j].Indirect, indi_block.Data);
+    printf("    %lu blocks\n"         , super.Blocks);
+    printf("    %lu inode blocks\n"   , inode_b);
+    printf("    %lu inodes\n"         , super.Inodes);
+    if (valid && version != FORMAT_VERSION_32)
+        printf("    format version %u\n", version);
+    if (super.StripeMembers > 1)
+        printf("    striped across %u images, %u blocks per unit\n",
+               super.StripeMembers, super.StripeUnit);
+    if (super.Flags & FLAG_CHECKSUMS)
+        printf("    %lu checksum blocks, %s\n", super.ChecksumBlocks,
+               super.Flags & FLAG_CLEAN ? "clean" : "not clean");
+    if (super.Flags & FLAG_BITMAPS)
+        printf("    %u bitmap blocks\n", super.BitmapBlocks);
+    if (!valid)
+        return;
 
-                    printf("    indirect data blocks:");
-                    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        uint32_t block_ind = indi_block.Pointers[k];
-                        if (block_ind != 0) {
-                            printf(" %d", block_ind);
-                        } 
+    // Read Inode blocks in batches; the indirect blocks of each inode block
+    // are fetched together so a queueing disk can keep them all in flight
+    uint32_t per_block = inodes_per_block(version);
+    BlockPool    arena(0);
+    PooledBuffer batch(arena, MOUNT_BATCH_BLOCKS);
+    PooledBuffer indirects(arena, per_block);
+    Block *iblocks     = batch.as<Block>();
+    Block *indi_blocks = indirects.as<Block>();
+    std::vector<Inode> nodes(per_block);
+    std::vector<BlockDevice::BlockRequest> requests;
+
+    for (uint64_t first = 1; first <= inode_b; first += MOUNT_BATCH_BLOCKS) {
+        uint64_t count = std::min<uint64_t>(inode_b - first + 1, MOUNT_BATCH_BLOCKS);
+        disk->read_blocks(first, count, iblocks[0].Data);
+
+        for (uint64_t b = 0; b < count; b++) {
+            uint64_t i = first + b;
+
+            requests.clear();
+            for (uint32_t j = 0; j < per_block; j++) {
+                get_inode(iblocks[b], j, version, &nodes[j]);
+                if (nodes[j].Valid && nodes[j].Indirect != 0) {
+                    BlockDevice::BlockRequest request;
+                    request.blocknum = nodes[j].Indirect;
+                    request.data     = indi_blocks[j].Data;
+                    requests.push_back(request);
+                }
+            }
+            disk->readv(requests.data(), requests.size());
+
+            for (uint32_t j = 0; j < per_block; j++) {
+                Inode &node = nodes[j];
+
+                if (node.Valid) {
+                    printf("Inode %lu:\n", (i-1)*per_block + j);
+                    printf("    size: %lu bytes\n", node.Size);
+                    printf("    direct blocks:");
+                    for (uint32_t k = 0; k < POINTERS_PER_INODE; k++) {
+                        if (node.Direct[k] != 0) {
+                            printf(" %lu", node.Direct[k]);
+                        }  
                     }
                     printf("\n");
-                }
 
+                    if (node.Indirect != 0) {
+                        printf("    indirect block: %lu\n", node.Indirect);
+                        // indirect block
+                        Block &indi_block = indi_blocks[j];
+
+                        printf("    indirect data blocks:");
+                        for (uint32_t k = 0; k < pointers_per_block(version); k++) {
+                            uint64_t block_ind = get_pointer(indi_block, k, version);
+                            if (block_ind != 0) {
+                                printf(" %lu", block_ind);
+                            } 
+                        }
+                        printf("\n");
+                    }
+
+                }
             }
         }
     }
@@ -80,125 +122,220 @@ void FileSystem::debug(Disk *disk) {
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
+bool FileSystem::format(BlockDevice *disk) {
     if (disk->mounted())
         return false;
     Block block;
+    SuperBlock super = {0};
+
+    uint64_t n = disk->size();
+    super.MagicNumber = FileSystem::MAGIC_NUMBER;
+    super.Version = FORMAT_VERSION;
+    super.Blocks = n;
+    super.InodeBlocks = inode_blocks(n, FORMAT_VERSION);
+    super.Inodes = FileSystem::INODES_PER_BLOCK * super.InodeBlocks;
+    if (disk->stripe_members() > 1) {
+        super.StripeMembers = disk->stripe_members();
+        super.StripeUnit    = disk->stripe_unit();
+    }
 
-    int n = disk->size();
-    block.Super.MagicNumber = FileSystem::MAGIC_NUMBER;
-    block.Super.Blocks = n;
-    block.Super.InodeBlocks = (n%10 == 0? n/10: (n/10)+1);
-    block.Super.Inodes = FileSystem::INODES_PER_BLOCK * block.Super.InodeBlocks;
-    disk->write(0, block.Data);
+    // every block gets a checksum in a table right after the inode blocks,
+    // and the allocation bitmaps follow the table
+    uint64_t table   = super.InodeBlocks + 1;
+    uint64_t bitmaps = bitmap_blocks(n, super.Inodes);
+    super.Flags          = FLAG_CHECKSUMS | FLAG_CLEAN | FLAG_BITMAPS;
+    super.ChecksumBlocks = ChecksumDisk::table_blocks(n);
+    super.BitmapBlocks   = bitmaps;
+    if (bitmaps > UINT32_MAX || table + super.ChecksumBlocks + bitmaps >= n)
+        return false;
+    if (IOProfile *profile = disk->profile())
+        profile->layout(n, super.InodeBlocks, table + super.ChecksumBlocks + bitmaps);
 
-    char buf[Disk::BLOCK_SIZE];
-    memset(buf, 0, Disk::BLOCK_SIZE);
+    // clear the inode table and every data block by discarding them, which
+    // leaves holes in a sparse image rather than writing zeros
+    disk->discard(INODE_BLOCKS_OFFSET, n - INODE_BLOCKS_OFFSET);
+    disk->metadata(0, n, false);
+    disk->metadata(0, table + super.ChecksumBlocks + bitmaps, true);
 
-    // writing every inode block with zeros
-    for (uint32_t i = INODE_BLOCKS_OFFSET; i <= block.Super.InodeBlocks; i++) {
-        disk->write(i, buf); 
-    }
+    // a zeroed table matches the zeroed disk, so only the root inode's
+    // block needs a checksum
+    ChecksumDisk checksums(disk, table);
+    checksums.trust_table_checksum(0);
 
     // make the inode zero
     Inode izero = {0};
     izero.Valid = true;
     
     // since using save_inode we need this (bad design)
-    this->disk = disk;
+    BufferCache cache(&checksums, INODE_BLOCKS_OFFSET + 1);
+    this->disk = &cache;
+    m_cache    = &cache;
+    m_version  = FORMAT_VERSION;
 
     if (!save_inode(0, &izero)) return false;
+    write_inodes();
+    m_inodes.clear();
+    m_inode_lru.clear();
 
     // don't have to do this
     this->disk = nullptr;
+    m_cache    = nullptr;
+
+    // the bitmaps were discarded along with the rest, so only the root
+    // inode's bit needs setting
+    memset(block.Data, 0, BlockDevice::BLOCK_SIZE);
+    block.Pointers[0] = 1;
+    cache.write(table + super.ChecksumBlocks, block.Data);
+
+    // the superblock goes last, once everything it vouches for is written
+    cache.flush();
+    super.TableChecksum = checksums.table_checksum();
+    store_super(block, super, FORMAT_VERSION);
+    disk->write(0, block.Data);
+    disk->flush();
 
     return true;
 }
 
 // Mount file system -----------------------------------------------------------
-bool FileSystem::mount(Disk *disk) {
+bool FileSystem::mount(BlockDevice *disk) {
     if (disk->mounted())
         return false;
 
     // Read superblock
     Block sblock;
+    SuperBlock super;
+    uint32_t version;
     disk->read(0, sblock.Data); 
-    if (sblock.Super.MagicNumber != FileSystem::MAGIC_NUMBER)
+    if (!load_super(sblock, &super, &version))
         return false;
 
-    if (sblock.Super.Blocks != disk->size())
+    // a newer format may lay out anything differently
+    if (version > FORMAT_VERSION) {
+        printf("[-] unsupported format version %u\n", version);
         return false;
+    }
 
-    uint32_t n = disk->size();
-    uint32_t inode_blocks = (n%10 == 0? n/10: (n/10)+1);
+    // images formatted before checksums existed have no table and are
+    // mounted as they always were
+    bool checksummed = super.Flags & FLAG_CHECKSUMS;
+    if (checksummed && super.SuperChecksum != super_checksum(sblock, version)) {
+        printf("[-] superblock checksum mismatch\n");
+        return false;
+    }
 
-    if (sblock.Super.InodeBlocks != inode_blocks)
+    if (super.Blocks != disk->size())
         return false;
 
-    uint32_t inodes  = FileSystem::INODES_PER_BLOCK * sblock.Super.InodeBlocks;
+    uint64_t n = disk->size();
 
-    if (sblock.Super.Inodes != inodes)
+    if (super.InodeBlocks != inode_blocks(n, version))
         return false;
 
+    uint64_t inodes  = inodes_per_block(version) * super.InodeBlocks;
 
-    // Allocate free block bitmap
-    m_offset = sblock.Super.InodeBlocks+1;
-    m_free_bitmap_size = sblock.Super.Blocks-m_offset;
-    m_free_bitmap = new unsigned char[m_free_bitmap_size];
-    memset(m_free_bitmap, 0, m_free_bitmap_size);
-
-    // Allocate inode table
-    m_itable_size = sblock.Super.InodeBlocks*INODES_PER_BLOCK;
-    m_itable = new unsigned char[m_itable_size];
-    memset(m_itable, 0, m_free_bitmap_size);
+    if (super.Inodes != inodes)
+        return false;
 
-    Block iblock;
-    for (uint32_t i = 1; i <= sblock.Super.InodeBlocks; i++) {
-        disk->read(i, iblock.Data);
-        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+    // a striped image must be opened with the geometry it was formatted with
+    uint32_t members = super.StripeMembers ? super.StripeMembers : 1;
+    if (members != disk->stripe_members())
+        return false;
 
-            if (iblock.Inodes[j].Valid) {
-                m_itable[(i-1)*INODES_PER_BLOCK+j] = 1; 
+    if (members > 1 && super.StripeUnit != disk->stripe_unit())
+        return false;
 
-                // checking 5  direct pointers
-                for (uint32_t k = 0; k < POINTERS_PER_INODE; k++) {
-                    uint32_t block_ind = iblock.Inodes[j].Direct[k];
-                    if (block_ind != 0) {
-                        m_free_bitmap[block_ind-m_offset] = 1; 
-                    } 
-                }
+    uint64_t table   = super.InodeBlocks + 1;
+    if (checksummed && super.ChecksumBlocks != ChecksumDisk::table_blocks(n))
+        return false;
 
-                if (iblock.Inodes[j].Indirect != 0) {
-                    // indirect block
-                    Block indi_block;                
+    // images formatted before the bitmaps existed are scanned at every mount
+    bool bitmapped = super.Flags & FLAG_BITMAPS;
+    if (bitmapped && super.BitmapBlocks != bitmap_blocks(n, inodes))
+        return false;
 
-                    disk->read(iblock.Inodes[j].Indirect, indi_block.Data);
+    // Allocate free block bitmap
+    m_version = version;
+    m_bitmap_start  = table + (checksummed ? super.ChecksumBlocks : 0);
+    m_bitmap_blocks = bitmapped ? super.BitmapBlocks : 0;
+    m_offset = m_bitmap_start + m_bitmap_blocks;
+    m_free_bitmap.reset(super.Blocks-m_offset);
 
-                    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        uint32_t block_ind = indi_block.Pointers[k];
-                        if (block_ind != 0) {
-                            m_free_bitmap[block_ind-m_offset] = 1; 
-                        } 
-                    }
-                }
-            }
-        }
+    // Allocate inode table
+    m_itable.reset(inodes, inodes_per_block(version));
+
+    if (IOProfile *profile = disk->profile())
+        profile->layout(n, super.InodeBlocks, m_offset);
+    disk->metadata(0, n, false);
+    disk->metadata(0, m_offset, true);
+
+    m_device = disk;
+
+    // a table and bitmaps written at a clean unmount are trusted as they
+    // are, without reading them: the flag is only set once they are on
+    // disk, and the superblock carrying it is checksummed; otherwise the bitmaps are rebuilt by scanning every inode, and
+    // the table is kept, since a torn block is most likely to be found
+    // now: metadata that does not match it is reported rather than made
+    // to match, and the scan recomputes the entries of data blocks in use
+    bool clean = super.Flags & FLAG_CLEAN;
+    if (checksummed) {
+        m_checksums = new ChecksumDisk(disk, table);
+        if (clean)
+            m_checksums->trust_table_checksum(super.TableChecksum);
+    }
+    if (!clean && (checksummed || bitmapped)) {
+        printf("[!] not unmounted cleanly, %s\n",
+               !bitmapped ? "checking checksums" :
+               checksummed ? "checking checksums and rebuilding bitmaps" : "rebuilding bitmaps");
+        if (checksummed)
+            m_checksums->report_mismatches(true);
+        m_refresh_checksums = checksummed;
+    }
+    if (checksummed)
+        m_checksums->metadata(0, m_offset, true);
+
+    if (checksummed || bitmapped) {
+        // until unmount the table and bitmaps on disk may lag behind
+        super.Flags &= ~FLAG_CLEAN;
+        store_super(sblock, super, version);
+        disk->write(0, sblock.Data);
+        disk->flush();
     }
-    disk->mount();
 
-    this->disk = disk;
+    // everything from here on reads and writes through the cache, and the
+    // checksums below it
+    m_cache    = new BufferCache(m_checksums ? m_checksums : m_device, m_cache_blocks, m_cache_backing);
+    this->disk = m_cache;
 
     Inode node;
-    if (!load_inode(0, &node)) {
-        printf("failed on reading root directory\n");
-        return false; 
+    try {
+        if (bitmapped && clean)
+            load_bitmaps();
+        else
+            scan_inodes(super.InodeBlocks);
+        if (!load_inode(0, &node)) {
+            printf("failed on reading root directory\n");
+            release();
+            return false; 
+        }
+        if (!m_lazy_mount)
+            report_mismatches();
+    } catch (std::runtime_error &e) {
+        printf("[-] %s\n", e.what());
+        release();
+        return false;
     }
     if (!node.Valid){
 
         printf("[-] root directory not found\n");
+        release();
         return false;
     } 
 
+    m_device->mount();
+    if (m_checksums)
+        m_checksums->mount();
+    m_cache->mount();
     
     m_current_dir.Inode   = 0;
     m_current_dir.Type    = static_cast<uint8_t>(DirentType::DIR_T);
@@ -207,615 +344,482 @@ bool FileSystem::mount(Disk *disk) {
 
     m_is_mounted = true;
 
-    return true;
-}
-
-// Create inode ----------------------------------------------------------------
-
-ssize_t FileSystem::mkfile(const char *name) {
-    return make_file_or_dir(name, DirentType::FILE_T);
-}
-
-ssize_t FileSystem::mkdir(const char *name) {
-    return make_file_or_dir(name, DirentType::DIR_T);
-}
-
-char *FileSystem::get_current_dir() {
-    return m_current_dir.Name;
-}
-
-ssize_t FileSystem::make_file_or_dir(const char *name, DirentType type) {
-    if (!mounted()) {
-        printf("must be mounted\n");
-        return false; 
-    }
-    bool found = false;
-    // Locate free inode in inode table
-    uint32_t i;
-    for (i = 0; i < m_itable_size; i++) {
-        if (m_itable[i] == 0) {
-            found = true;
-            break;
-        } 
+    if (m_flush_interval > 0) {
+        m_flusher_stopping = false;
+        m_flusher = std::thread(&FileSystem::run_flusher, this);
     }
-    if (!found) return -1;
-    
-    Inode node = {0};
-    node.Valid = 1;
 
+    return true;
+}
 
-    // set the inode on the inode table that exist
-    m_itable[i] = 1;
-
-    // make Dirent for this inode in the current dirent 
-    Dirent new_dirent;
-    new_dirent.Inode = i;
-    if (type == DirentType::FILE_T) {
-        new_dirent.Type  = static_cast<uint8_t>(DirentType::FILE_T);
+void FileSystem::scan_inodes(uint64_t inode_blocks) {
+    size_t ranges  = (inode_blocks + MOUNT_BATCH_BLOCKS - 1) / MOUNT_BATCH_BLOCKS;
+    size_t threads = std::min(m_scan_threads, std::max<size_t>(ranges, 1));
+    {
+        std::lock_guard<std::mutex> lock(m_scan_lock);
+        m_scanned.assign(ranges, false);
+        m_scan_next   = 0;
+        m_scan_left   = ranges;
+        m_scan_failed = false;
+        m_scan_error.clear();
     }
-    else if (type == DirentType::DIR_T) {
-        new_dirent.Type  = static_cast<uint8_t>(DirentType::DIR_T);
-    }
-    else 
-        return -1;
+    for (size_t t = 0; t < threads; t++)
+        m_scanners.push_back(std::thread(&FileSystem::run_scanner, this));
 
-    new_dirent.NameLength = strnlen(name, DIRENT_NAME_SIZE);
-    strncpy(new_dirent.Name, name, DIRENT_NAME_SIZE);
-
-    // save the dirent to the current dirent
-    // add_dirent
-    if (!add_new_dirent(new_dirent, m_current_dir.Inode)) {
-        return -1;
-    }
-    else {
-        if (!save_inode(i, &node))
-            return -1;
-        else {
-            if (type == DirentType::DIR_T) {
-                // add new dirent to the content of the new directory inode
-                Dirent previous_dir;
-                previous_dir.Inode = m_current_dir.Inode;
-                previous_dir.Type  = static_cast<uint8_t>(DirentType::DIR_T);
-                
-                previous_dir.NameLength = 2;
-                strncpy(previous_dir.Name, "..", 2);
-                
-                if (!add_new_dirent(previous_dir, i))
-                    return -1;
-            }
-        }
-    }
+    if (m_lazy_mount)
+        return;
 
-    return i;
+    bool scanned = wait_scan();
+    stop_scanners();
+    if (!scanned)
+        throw std::runtime_error(m_scan_error);
 }
 
-// Remove inode ----------------------------------------------------------------
-
-bool FileSystem::remove(size_t inumber) {
-    if (!disk->mounted())
-        return false;
-    // Load inode information
-    Inode node;
-    load_inode(inumber, &node);
-    if (!node.Valid)
-        return false;
-
-    // Free direct blocks
-    for(int i=0;i<5;i++) { 
-        uint32_t t = node.Direct[i];
-        if (t != 0) {
-            m_free_bitmap[t-m_offset] = 0; 
+void FileSystem::run_scanner() {
+    BlockPool    arena(0);
+    PooledBuffer batch(arena, MOUNT_BATCH_BLOCKS);
+    PooledBuffer indirects(arena, MOUNT_BATCH_BLOCKS);
+
+    while (true) {
+        size_t range;
+        {
+            std::lock_guard<std::mutex> lock(m_scan_lock);
+            if (m_scan_failed || m_scan_next == m_scanned.size())
+                return;
+            range = m_scan_next++;
         }
-        node.Direct[i] = 0;
-    }
 
-    // Free indirect blocks
-    if (node.Indirect != 0) {
-        // clear pointer block
-        Block pblock;
-        disk->read(node.Indirect, pblock.Data);
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++) {
-            uint32_t t = pblock.Pointers[i]; 
-            if (t != 0) {
-                m_free_bitmap[t-m_offset] = 0;
-                pblock.Pointers[i] = 0;
+        // the reading happens outside the lock, only the bitmaps are
+        // updated under it
+        ScanResult found;
+        try {
+            scan_range(range, batch.as<Block>(), indirects.as<Block>(), found);
+            if (m_refresh_checksums)
+                refresh_checksums(found);
+        } catch (std::exception &e) {
+            std::lock_guard<std::mutex> lock(m_scan_lock);
+            if (!m_scan_failed) {
+                m_scan_failed = true;
+                m_scan_error  = e.what();
+                if (m_lazy_mount)
+                    printf("[-] mount scan failed: %s\n", e.what());
             }
+            m_scan_progress.notify_all();
+            return;
         }
-        
-        disk->write(node.Indirect, pblock.Data);
 
-        // m_free_bitmap[node.Indirect-offset] = 0;
-        unset_free_bitmap(node.Indirect);
-        node.Indirect = 0;
+        std::lock_guard<std::mutex> lock(m_scan_lock);
+        for (size_t i = 0; i < found.Inodes.size(); i++)
+            m_itable.set(found.Inodes[i]);
+        for (size_t i = 0; i < found.Blocks.size(); i++)
+            set_free_bitmap(found.Blocks[i]);
+        for (size_t i = 0; i < found.Indirects.size(); i++)
+            note_indirect(found.Indirects[i], true);
+        m_scanned[range] = true;
+        m_scan_left--;
+        m_scan_progress.notify_all();
+        // a lazy mount has returned by now, so the last scanner reports
+        if (m_scan_left == 0 && m_lazy_mount)
+            report_mismatches();
     }
-
-    node.Valid = 0;
-    // Clear inode in inode table
-    save_inode(inumber, &node);
-    m_itable[inumber] = 0;
-    return true;
-}
-
-// Inode stat ------------------------------------------------------------------
-
-ssize_t FileSystem::stat(size_t inumber) {
-
-    // Load inode information
-    Inode node;
-    load_inode(inumber, &node);
-    if (!node.Valid)
-        return -1;
-    
-    return node.Size;
-}
-
-// Read from inode -------------------------------------------------------------
-
-ssize_t FileSystem::read(size_t inumber, char *data) {
-    if (m_itable[inumber] == 0) return -1;
-
-    Inode node;
-
-    ssize_t bytes_read = 0;
-    // Load inode information
-    load_inode(inumber, &node);
-    
-    // Read block and copy to data
-    return bytes_read;
 }
 
-// Write to inode --------------------------------------------------------------
-ssize_t FileSystem::write(size_t inumber, char *data, 
-                          size_t length) {
+void FileSystem::refresh_checksums(const ScanResult &found) {
+    // indirect blocks are metadata, checked against the table as read
+    std::vector<uint64_t> indirects(found.Indirects);
+    std::sort(indirects.begin(), indirects.end());
 
-    Inode node;
-    load_inode(inumber, &node);
-    if (!node.Valid) {
-        return -1; 
+    std::vector<uint64_t> blocks;
+    for (size_t i = 0; i < found.Blocks.size(); i++) {
+        if (!std::binary_search(indirects.begin(), indirects.end(), found.Blocks[i]))
+            blocks.push_back(found.Blocks[i]);
     }
-    // find how many data blocks we need to write
-    uint32_t blocks_count = length / Disk::BLOCK_SIZE;
-    if (length % Disk::BLOCK_SIZE)
-        ++blocks_count;
-
-    size_t remaind_size = length;
-    ssize_t total_written_bytes = 0;
-    Block block;
-    for (uint32_t index = 0; index < blocks_count; ++index) {
-
-        uint32_t temp = remaind_size % Disk::BLOCK_SIZE;
-        uint32_t write_size =  temp == 0 ? Disk::BLOCK_SIZE : temp;
-
-        memcpy(block.Data, data, write_size);
-
-        if (!save_nth_block(inumber, index, &block)) {
-            printf("error while writing to disk save_nth_block\n"); 
-            return -1;
-        } 
-
-        data += write_size;
-        node.Size += write_size;
-        total_written_bytes += write_size;
-
-        remaind_size -= write_size;
-    }
-
-    return total_written_bytes;
-
+    m_checksums->refresh(blocks.data(), blocks.size());
 }
 
-bool FileSystem::load_inode(size_t inumber, Inode *node) {
-    
-    uint32_t block_ind = inumber / INODES_PER_BLOCK; 
-    Block iblock;
-
-    disk->read(block_ind+1, iblock.Data);
-
-    *node = iblock.Inodes[inumber];
+void FileSystem::report_mismatches() {
+    if (!m_checksums)
+        return;
 
-    // Record inode if found
-    return true;
+    std::vector<uint64_t> blocks = m_checksums->take_mismatches();
+    for (size_t i = 0; i < blocks.size(); i++)
+        printf("[!] checksum mismatch on block %lu, left as it is\n", blocks[i]);
 }
 
+void FileSystem::scan_range(size_t range, Block *iblocks, Block *indi_blocks, ScanResult &found) {
+    // Inode blocks are fetched with one read_blocks call, and the indirect
+    // blocks they point to are gathered into a single readv per batch
+    std::vector<BlockDevice::BlockRequest> requests;
+    uint32_t per_block = inodes_per_block(m_version);
+    uint64_t inode_blocks = m_itable.size() / per_block;
+    uint64_t first     = 1 + range*MOUNT_BATCH_BLOCKS;
+    uint64_t count     = std::min<uint64_t>(inode_blocks - first + 1, MOUNT_BATCH_BLOCKS);
+    disk->read_blocks(first, count, iblocks[0].Data);
 
-bool FileSystem::save_inode(size_t inumber, Inode *node) {
-    
-    uint32_t block_ind = inumber / INODES_PER_BLOCK; 
-    Block iblock;
-    disk->read(block_ind+INODE_BLOCKS_OFFSET, iblock.Data); 
-    iblock.Inodes[inumber] = *node;
-
-    disk->write(block_ind+1, iblock.Data);
+    for (uint64_t b = 0; b < count; b++) {
+        uint64_t i = first + b;
 
-    return true;
-}
+        for (uint32_t j = 0; j < per_block; j++) {
+            Inode node;
+            get_inode(iblocks[b], j, m_version, &node);
 
+            if (node.Valid) {
+                found.Inodes.push_back((i-1)*per_block+j);
 
-bool FileSystem::read_nth_block(size_t inumber, size_t nthblock, Block *block) {
-    Inode node;
-    load_inode(inumber, &node);
-
-    if (nthblock < POINTERS_PER_INODE) {
-        uint32_t t = node.Direct[nthblock]; 
-        if (t == 0) return false;
-        disk->read(t, block->Data);
-        return true;
-    }
-    else {
-        uint32_t t = node.Indirect;
-        if (t == 0) return false;
-        Block dblock;
-        
-        disk->read(t, dblock.Data);
+                // checking 5  direct pointers
+                for (uint32_t k = 0; k < POINTERS_PER_INODE; k++) {
+                    uint64_t block_ind = node.Direct[k];
+                    if (block_ind != 0) {
+                        found.Blocks.push_back(block_ind);
+                    } 
+                }
 
-        t = dblock.Pointers[nthblock-POINTERS_PER_INODE]; 
-        if (t == 0) return false;
+                if (node.Indirect != 0) {
+                    found.Blocks.push_back(node.Indirect);
+                    found.Indirects.push_back(node.Indirect);
 
-        disk->read(t, block->Data);    
-        return true;
-    }
-}
+                    BlockDevice::BlockRequest request;
+                    request.blocknum = node.Indirect;
+                    request.data     = indi_blocks[requests.size()].Data;
+                    requests.push_back(request);
 
-ssize_t FileSystem::allocate_free_block() {
-    for (uint32_t i = 0; i < m_free_bitmap_size; i++) {
-        if (m_free_bitmap[i] == 0) {
-            m_free_bitmap[i] = 1;
-            return (i+m_offset); 
+                    if (requests.size() == MOUNT_BATCH_BLOCKS) {
+                        mark_indirect_blocks(requests, found);
+                    }
+                }
+            }
         }
     }
-    return -1;
+    mark_indirect_blocks(requests, found);
 }
 
-bool FileSystem::save_nth_block(size_t inumber, 
-                                size_t nthblock, Block *block) {
-
-    Inode node;
-    load_inode(inumber, &node);
-
-    if (nthblock < POINTERS_PER_INODE) {
-        ssize_t t = node.Direct[nthblock]; 
-        if (t == 0) {
-            t = allocate_free_block();
-            node.Direct[nthblock] = t;
-            save_inode(inumber, &node);
+void FileSystem::stop_scanners() {
+    {
+        std::lock_guard<std::mutex> lock(m_scan_lock);
+        if (m_scan_left > 0 && !m_scan_failed) {
+            m_scan_failed = true;
+            m_scan_error  = "mount scan abandoned";
         }
-        disk->write(t, block->Data);
-        return true;
     }
-    else {
-        uint32_t indirect_block = node.Indirect;
-        if (indirect_block == 0) {
-            indirect_block = allocate_free_block();
-            node.Indirect = indirect_block;
-            save_inode(inumber, &node);
-        } 
-        Block dblock;
-
-        disk->read(indirect_block, dblock.Data);
-
-        uint32_t t = dblock.Pointers[nthblock-POINTERS_PER_INODE]; 
-        if (t == 0) {
-            t = allocate_free_block();
-            dblock.Pointers[nthblock-POINTERS_PER_INODE] = t;
-            disk->write(indirect_block, dblock.Data);
-        }
+    m_scan_progress.notify_all();
 
-        disk->write(t, block->Data);
-        return true;
-    }
+    for (size_t t = 0; t < m_scanners.size(); t++)
+        m_scanners[t].join();
+    m_scanners.clear();
 }
 
-bool FileSystem::add_new_dirent(const Dirent &dirent, uint32_t inum) {
-    // uint32_t inum = m_current_dir.Inode;
-    uint32_t total_inode_blocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
-    Block block = {0};
-
-    // iterate over the inode dirent blocks
-    for (uint32_t b = 0; b < total_inode_blocks; b++) {
-
-        if (!read_nth_block(inum, b, &block)) {
-            // make the nth block here
-            save_nth_block(inum, b, &block);
-        }
-
-        for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
-            uint8_t type = block.Dirents[i].Type;
-            if (type == static_cast<uint8_t>(DirentType::FILE_T) ||
-                type == static_cast<uint8_t>(DirentType::DIR_T)) {
-
-                continue;
-            } 
-                
-            block.Dirents[i].Inode = dirent.Inode;
-            block.Dirents[i].Type = dirent.Type;
-            block.Dirents[i].NameLength = dirent.NameLength;
-            strncpy(block.Dirents[i].Name, dirent.Name, DIRENT_NAME_SIZE) ;
-            save_nth_block(inum, b, &block);
-            return true;
-        }
-    }
-    return false;
+bool FileSystem::wait_scan() {
+    std::unique_lock<std::mutex> lock(m_scan_lock);
+    m_scan_progress.wait(lock, [this]() { return m_scan_failed || m_scan_left == 0; });
+    return !m_scan_failed;
 }
 
-
-void FileSystem::list() {
-    if (!mounted()) {
-        printf("must be mounted\n");
-        return;
-    } 
-
-    Inode node;
-    load_inode(m_current_dir.Inode, &node);
-
-    Block block;
-    for (uint32_t i = 0; i < POINTERS_PER_INODE+POINTERS_PER_BLOCK; i++) {
-        if (!read_nth_block(m_current_dir.Inode, i, &block))
-            break;
-
-        for (uint32_t j = 0; j < DIRENTS_PER_BLOCK; j++) {
-            uint8_t type = block.Dirents[j].Type;
-
-            if (type == static_cast<uint8_t>(DirentType::FILE_T)) {
-                
-                print_dirent(block.Dirents[j]);
-                printf("\n");
-            }
-            else if (type == static_cast<uint8_t>(DirentType::DIR_T)) {
-                printf("\x1b[94m");
-                print_dirent(block.Dirents[j]);
-                printf("\x1b[39m");
-                printf("\n");
-            }
-        }
-    }
+bool FileSystem::range_scanned(size_t inumber) {
+    size_t range = inumber / inodes_per_block(m_version) / MOUNT_BATCH_BLOCKS;
+    return range >= m_scanned.size() || m_scanned[range];
 }
 
-bool FileSystem::change_directory(char *name) {
-    if (!mounted()) {
-        printf("must be mounted\n");
+bool FileSystem::inode_in_use(size_t inumber) {
+    std::lock_guard<std::mutex> lock(m_scan_lock);
+    if (inumber >= m_itable.size())
         return false;
-    } 
-
-    Inode node;
-    load_inode(m_current_dir.Inode, &node);
-
-    Block block;
-    for (uint32_t i = 0; i < POINTERS_PER_INODE+POINTERS_PER_BLOCK; i++) {
-
-        if (!read_nth_block(m_current_dir.Inode, i, &block))
-            break;
-
-        for (uint32_t j = 0; j < DIRENTS_PER_BLOCK; j++) {
-            uint8_t type = block.Dirents[j].Type;
-
-            if (type == static_cast<uint8_t>(DirentType::DIR_T)) {
-                if (strncmp(block.Dirents[j].Name, name, block.Dirents[j].NameLength) == 0 &&
-                    strlen(name) == block.Dirents[j].NameLength) {
 
-                    m_current_dir = block.Dirents[j];
-                    if (m_current_dir.Inode == 0) {
-                        strcpy(m_current_dir.Name, "/");
-                    }
+    // until its range is scanned the inode itself has to tell
+    return !range_scanned(inumber) || m_itable.test(inumber);
+}
 
-                    return true;
-                }
-            }
+ssize_t FileSystem::take_free_inode() {
+    // inode blocks that get written anyway come first: the one last
+    // allocated from or freed into, then the current directory's, which
+    // lookups keep cached; after that the lowest block with room.  A range
+    // not scanned yet only looks free, so it is waited for
+    std::unique_lock<std::mutex> lock(m_scan_lock);
+    uint32_t per_block = inodes_per_block(m_version);
+    size_t preferred[] = {m_inode_hint, m_current_dir.Inode / per_block};
+    for (size_t p = 0; p < 2; p++) {
+        size_t block = preferred[p];
+        if (m_itable.free_in_block(block) > 0 && range_scanned(block*per_block)) {
+            size_t i = m_itable.find_free_in(block);
+            m_itable.set(i);
+            m_inode_hint = block;
+            return i;
         }
     }
-    return true;
-}
-
-#include <algorithm>
-
-#include <assert.h>
-#include <stdio.h>
-#include <string.h>
 
-void FileSystem::print_dirent(Dirent &dirent) {
-    for (int i = 0; i < dirent.NameLength; i++) {
-        printf("%c", dirent.Name[i]);
+    for (size_t block = m_itable.find_free_block(0); block != InodeTable::NONE;
+         block = m_itable.find_free_block(block + 1)) {
+        m_scan_progress.wait(lock, [&]() { return m_scan_failed || range_scanned(block*per_block); });
+        if (m_scan_failed)
+            return -1;
+        if (m_itable.free_in_block(block) > 0) {
+            size_t i = m_itable.find_free_in(block);
+            m_itable.set(i);
+            m_inode_hint = block;
+            return i;
+        }
     }
+    return -1;
 }
 
+void FileSystem::unmount() {
+    if (!mounted())
+        return;
 
-// Debug file system -----------------------------------------------------------
-
-void FileSystem::debug(Disk *disk) {
-    Block block;
-
-    // Read Superblock
-    disk->read(0, block.Data);
-
-    // inode block num
-    uint32_t inode_b = block.Super.InodeBlocks;
-
-    printf("SuperBlock:\n");
-    if (block.Super.MagicNumber == FileSystem::MAGIC_NUMBER)
-        printf("    magic number is %s\n", "valid");
-    else
-        printf("    magic number is %s\n", "invalid");
-
-    printf("    %u blocks\n"         , block.Super.Blocks);
-    printf("    %u inode blocks\n"   , inode_b);
-    printf("    %u inodes\n"         , block.Super.Inodes);
-
-    // Read Inode blocks
-    for (uint32_t i = 1; i <= inode_b; i++) {
-        disk->read(i, block.Data);
-        for (uint32_t j = 0; j < FileSystem::INODES_PER_BLOCK; j++) {
-            
-            if (block.Inodes[j].Valid) {
-                printf("Inode %d:\n", (i-1)*FileSystem::INODES_PER_BLOCK + j);
-                printf("    size: %d bytes\n", block.Inodes[j].Size);
-                printf("    direct blocks:");
-                for (int k = 0; k < 5; k++) {
-                    if (block.Inodes[j].Direct[k] != 0) {
-                        printf(" %d", block.Inodes[j].Direct[k]);
-                    }  
-                }
-                printf("\n");
-
-                if (block.Inodes[j].Indirect != 0) {
-                    printf("    indirect block: %d\n", block.Inodes[j].Indirect);
-                    // indirect block
-                    Block indi_block;                
-
-                    disk->read(block.Inodes[j].Indirect, indi_block.Data);
-
-                    printf("    indirect data blocks:");
-                    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        uint32_t block_ind = indi_block.Pointers[k];
-                        if (block_ind != 0) {
-                            printf(" %d", block_ind);
-                        } 
-                    }
-                    printf("\n");
-                }
-
-            }
-        }
+    stop_flusher();
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    // cached inodes, the bitmaps and blocks go out first, then the table
+    // that covers them, then the superblock that vouches for both; the
+    // bitmaps wait for a lazy mount's scan, and one that failed leaves the
+    // image not clean so the next mount scans again
+    place_all_delayed();
+    write_inodes();
+    bool scanned = wait_scan();
+    if (m_bitmap_blocks && scanned)
+        save_bitmaps();
+    m_cache->flush();
+    if (m_checksums)
+        m_checksums->flush();
+    // blocks that failed the check and were not rewritten are reported
+    // again at the next mount rather than vouched for by a clean flag
+    report_mismatches();
+    bool matched = !m_checksums || m_checksums->mismatched() == 0;
+    if ((m_checksums || m_bitmap_blocks) && scanned && matched) {
+        Block sblock;
+        SuperBlock super;
+        uint32_t version;
+        m_device->read(0, sblock.Data);
+        load_super(sblock, &super, &version);
+        super.Flags |= FLAG_CLEAN;
+        if (m_checksums)
+            super.TableChecksum = m_checksums->table_checksum();
+        store_super(sblock, super, version);
+        m_device->write(0, sblock.Data);
+        m_device->flush();
     }
+    if (m_checksums)
+        m_checksums->unmount();
+    if (m_durability != Durability::NONE)
+        m_device->sync();
+    m_cache->unmount();
+    m_device->unmount();
+
+    release();
+    m_is_mounted = false;
 }
 
-// Format file system ----------------------------------------------------------
+void FileSystem::sync() {
+    if (!mounted())
+        return;
 
-bool FileSystem::format(Disk *disk) {
-    if (disk->mounted())
-        return false;
-    Block block;
+    std::lock_guard<std::mutex> guard(m_lock);
+    place_all_delayed();
+    write_inodes();
+    m_cache->sync();
+}
 
-    int n = disk->size();
-    block.Super.MagicNumber = FileSystem::MAGIC_NUMBER;
-    block.Super.Blocks = n;
-    block.Super.InodeBlocks = (n%10 == 0? n/10: (n/10)+1);
-    block.Super.Inodes = FileSystem::INODES_PER_BLOCK * block.Super.InodeBlocks;
-    disk->write(0, block.Data);
+// Background write back -------------------------------------------------------
 
-    char buf[Disk::BLOCK_SIZE];
-    memset(buf, 0, Disk::BLOCK_SIZE);
+void FileSystem::run_flusher() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_flusher_lock);
+            if (m_flusher_wakeup.wait_for(lock, std::chrono::milliseconds(m_flush_interval),
+                                          [this]() { return m_flusher_stopping; }))
+                return;
+        }
 
-    // writing every inode block with zeros
-    for (uint32_t i = INODE_BLOCKS_OFFSET; i <= block.Super.InodeBlocks; i++) {
-        disk->write(i, buf); 
+        try {
+            write_back();
+        } catch (std::exception &e) {
+            fprintf(stderr, "Unable to write back: %s\n", e.what());
+        }
     }
+}
 
-    // make the inode zero
-    Inode izero = {0};
-    izero.Valid = true;
-    
-    // since using save_inode we need this (bad design)
-    this->disk = disk;
-
-    if (!save_inode(0, &izero)) return false;
-
-    // don't have to do this
-    this->disk = nullptr;
+void FileSystem::stop_flusher() {
+    if (!m_flusher.joinable())
+        return;
 
-    return true;
+    {
+        std::lock_guard<std::mutex> lock(m_flusher_lock);
+        m_flusher_stopping = true;
+    }
+    m_flusher_wakeup.notify_all();
+    m_flusher.join();
 }
 
-// Mount file system -----------------------------------------------------------
-bool FileSystem::mount(Disk *disk) {
-    if (disk->mounted())
-        return false;
-
-    // Read superblock
-    Block sblock;
-    disk->read(0, sblock.Data); 
-    if (sblock.Super.MagicNumber != FileSystem::MAGIC_NUMBER)
-        return false;
+void FileSystem::write_back() {
+    // inodes and delayed blocks carry no age of their own, so they start
+    // aging as soon as they reach their blocks
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        place_all_delayed();
+        write_inodes();
+    }
 
-    if (sblock.Super.Blocks != disk->size())
-        return false;
+    // the cache writes back without holding up the operations under m_lock
+    m_cache->expire(std::chrono::milliseconds(m_dirty_expire), m_cache_blocks*m_dirty_ratio/100);
 
-    uint32_t n = disk->size();
-    uint32_t inode_blocks = (n%10 == 0? n/10: (n/10)+1);
+    if (m_durability == Durability::PERIODIC)
+        (m_checksums ? static_cast<BlockDevice *>(m_checksums) : m_device)->sync();
+}
 
-    if (sblock.Super.InodeBlocks != inode_blocks)
-        return false;
+void FileSystem::release() {
+    stop_scanners();
+    m_scanned.clear();
+    m_scan_next   = 0;
+    m_scan_left   = 0;
+    m_scan_failed = false;
+    m_refresh_checksums = false;
+    m_advice.clear();
+    while (!m_delayed.empty())
+        drop_delayed(m_delayed.begin()->first);
+    m_inodes.clear();
+    m_inode_lru.clear();
+    m_dentries.clear();
+    m_dentry_lru.clear();
+    delete m_cache;
+    m_cache = nullptr;
+    delete m_checksums;
+    m_checksums = nullptr;
+    m_device    = nullptr;
+    disk        = nullptr;
+
+    m_free_bitmap.reset(0);
+    m_itable.reset(0, 1);
+    m_inode_hint = InodeTable::NONE;
+    m_bitmap_start  = 0;
+    m_bitmap_blocks = 0;
+}
 
-    uint32_t inodes  = FileSystem::INODES_PER_BLOCK * sblock.Super.InodeBlocks;
+// On-disk formats -------------------------------------------------------------
 
-    if (sblock.Super.Inodes != inodes)
-        return false;
+bool FileSystem::load_super(const Block &block, SuperBlock *super, uint32_t *version) {
+    if (block.Super.MagicNumber == MAGIC_NUMBER) {
+        *super   = block.Super;
+        *version = block.Super.Version;
+        return true;
+    }
 
+    // 32-bit images predate the version field
+    const SuperBlock32 &old = block.Super32;
+    memset(super, 0, sizeof(*super));
+    super->MagicNumber    = old.MagicNumber;
+    super->Version        = FORMAT_VERSION_32;
+    super->Blocks         = old.Blocks;
+    super->InodeBlocks    = old.InodeBlocks;
+    super->Inodes         = old.Inodes;
+    super->StripeMembers  = old.StripeMembers;
+    super->StripeUnit     = old.StripeUnit;
+    super->Flags          = old.Flags;
+    super->ChecksumBlocks = old.ChecksumBlocks;
+    super->TableChecksum  = old.TableChecksum;
+    super->SuperChecksum  = old.SuperChecksum;
+    *version = FORMAT_VERSION_32;
+    return old.MagicNumber == MAGIC_NUMBER_32;
+}
 
-    // Allocate free block bitmap
-    m_offset = sblock.Super.InodeBlocks+1;
-    m_free_bitmap_size = sblock.Super.Blocks-m_offset;
-    m_free_bitmap = new unsigned char[m_free_bitmap_size];
-    memset(m_free_bitmap, 0, m_free_bitmap_size);
+void FileSystem::store_super(Block &block, const SuperBlock &super, uint32_t version) {
+    memset(block.Data, 0, BlockDevice::BLOCK_SIZE);
+
+    if (version == FORMAT_VERSION_32) {
+        SuperBlock32 &old = block.Super32;
+        old.MagicNumber    = MAGIC_NUMBER_32;
+        old.Blocks         = super.Blocks;
+        old.InodeBlocks    = super.InodeBlocks;
+        old.Inodes         = super.Inodes;
+        old.StripeMembers  = super.StripeMembers;
+        old.StripeUnit     = super.StripeUnit;
+        old.Flags          = super.Flags;
+        old.ChecksumBlocks = super.ChecksumBlocks;
+        old.TableChecksum  = super.TableChecksum;
+        old.SuperChecksum  = super_checksum(block, version);
+        return;
+    }
 
-    // Allocate inode table
-    m_itable_size = sblock.Super.InodeBlocks*INODES_PER_BLOCK;
-    m_itable = new unsigned char[m_itable_size];
-    memset(m_itable, 0, m_free_bitmap_size);
+    block.Super = super;
+    block.Super.MagicNumber   = MAGIC_NUMBER;
+    block.Super.Version       = version;
+    block.Super.SuperChecksum = super_checksum(block, version);
+}
 
-    Block iblock;
-    for (uint32_t i = 1; i <= sblock.Super.InodeBlocks; i++) {
-        disk->read(i, iblock.Data);
-        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+uint32_t FileSystem::super_checksum(const Block &block, uint32_t version) {
+    if (version == FORMAT_VERSION_32) {
+        SuperBlock32 copy = block.Super32;
+        copy.SuperChecksum = 0;
+        return crc32c(0, &copy, sizeof(copy));
+    }
 
-            if (iblock.Inodes[j].Valid) {
-                m_itable[(i-1)*INODES_PER_BLOCK+j] = 1; 
+    SuperBlock copy = block.Super;
+    copy.SuperChecksum = 0;
+    return crc32c(0, &copy, sizeof(copy));
+}
 
-                // checking 5  direct pointers
-                for (uint32_t k = 0; k < POINTERS_PER_INODE; k++) {
-                    uint32_t block_ind = iblock.Inodes[j].Direct[k];
-                    if (block_ind != 0) {
-                        m_free_bitmap[block_ind-m_offset] = 1; 
-                    } 
-                }
+uint64_t FileSystem::bitmap_blocks(uint64_t blocks, uint64_t inodes) {
+    uint64_t words     = (inodes + 63)/64 + (blocks + 63)/64;
+    uint64_t per_block = BlockDevice::BLOCK_SIZE / sizeof(uint64_t);
+    return (words + per_block - 1) / per_block;
+}
 
-                if (iblock.Inodes[j].Indirect != 0) {
-                    // indirect block
-                    Block indi_block;                
+uint64_t FileSystem::inode_blocks(uint64_t blocks, uint32_t version) {
+    uint64_t count = (blocks%10 == 0? blocks/10: (blocks/10)+1);
+    if (version == FORMAT_VERSION_32)
+        return count;
 
-                    disk->read(iblock.Inodes[j].Indirect, indi_block.Data);
+    // every inode must be reachable from a 32-bit dirent
+    return std::min<uint64_t>(count, MAX_INODES / INODES_PER_BLOCK);
+}
 
-                    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
-                        uint32_t block_ind = indi_block.Pointers[k];
-                        if (block_ind != 0) {
-                            m_free_bitmap[block_ind-m_offset] = 1; 
-                        } 
-                    }
-                }
-            }
-        }
+void FileSystem::get_inode(const Block &block, uint32_t j, uint32_t version, Inode *node) {
+    if (version != FORMAT_VERSION_32) {
+        *node = block.Inodes[j];
+        return;
     }
-    disk->mount();
 
-    this->disk = disk;
+    const Inode32 &old = block.Inodes32[j];
+    memset(node, 0, sizeof(*node));
+    node->Valid = old.Valid;
+    node->Size  = old.Size;
+    for (uint32_t k = 0; k < POINTERS_PER_INODE; k++)
+        node->Direct[k] = old.Direct[k];
+    node->Indirect = old.Indirect;
+}
 
-    Inode node;
-    if (!load_inode(0, &node)) {
-        printf("failed on reading root directory\n");
-        return false; 
+void FileSystem::put_inode(Block &block, uint32_t j, uint32_t version, const Inode *node) {
+    if (version != FORMAT_VERSION_32) {
+        block.Inodes[j] = *node;
+        return;
     }
-    if (!node.Valid){
 
-        printf("[-] root directory not found\n");
-        return false;
-    } 
-
-    
-    m_current_dir.Inode   = 0;
-    m_current_dir.Type    = static_cast<uint8_t>(DirentType::DIR_T);
-    strcpy(m_current_dir.Name, "/");
-    printf("[+] root dir mounted\n");
+    Inode32 &old = block.Inodes32[j];
+    old.Valid = node->Valid;
+    old.Size  = node->Size;
+    for (uint32_t k = 0; k < POINTERS_PER_INODE; k++)
+        old.Direct[k] = node->Direct[k];
+    old.Indirect = node->Indirect;
+}
 
-    m_is_mounted = true;
+uint64_t FileSystem::get_pointer(const Block &block, uint32_t k, uint32_t version) {
+    return version == FORMAT_VERSION_32 ? block.Pointers32[k] : block.Pointers[k];
+}
 
-    return true;
+void FileSystem::put_pointer(Block &block, uint32_t k, uint32_t version, uint64_t b) {
+    if (version == FORMAT_VERSION_32)
+        block.Pointers32[k] = b;
+    else
+        block.Pointers[k] = b;
 }
 
 // Create inode ----------------------------------------------------------------
 
 ssize_t FileSystem::mkfile(const char *name) {
+    std::lock_guard<std::mutex> guard(m_lock);
     return make_file_or_dir(name, DirentType::FILE_T);
 }
 
 ssize_t FileSystem::mkdir(const char *name) {
+    std::lock_guard<std::mutex> guard(m_lock);
     return make_file_or_dir(name, DirentType::DIR_T);
 }
 
@@ -828,26 +832,16 @@ ssize_t FileSystem::make_file_or_dir(const char *name, DirentType type) {
         printf("must be mounted\n");
         return false; 
     }
-    bool found = false;
     // Locate free inode in inode table
-    uint32_t i;
-    for (i = 0; i < m_itable_size; i++) {
-        if (m_itable[i] == 0) {
-            found = true;
-            break;
-        } 
-    }
-    if (!found) return -1;
+    ssize_t i = take_free_inode();
+    if (i < 0) return -1;
     
     Inode node = {0};
     node.Valid = 1;
 
 
-    // set the inode on the inode table that exist
-    m_itable[i] = 1;
-
     // make Dirent for this inode in the current dirent 
-    Dirent new_dirent;
+    Dirent new_dirent = {0};
     new_dirent.Inode = i;
     if (type == DirentType::FILE_T) {
         new_dirent.Type  = static_cast<uint8_t>(DirentType::FILE_T);
@@ -872,7 +866,7 @@ ssize_t FileSystem::make_file_or_dir(const char *name, DirentType type) {
         else {
             if (type == DirentType::DIR_T) {
                 // add new dirent to the content of the new directory inode
-                Dirent previous_dir;
+                Dirent previous_dir = {0};
                 previous_dir.Inode = m_current_dir.Inode;
                 previous_dir.Type  = static_cast<uint8_t>(DirentType::DIR_T);
                 
@@ -893,51 +887,83 @@ ssize_t FileSystem::make_file_or_dir(const char *name, DirentType type) {
 bool FileSystem::remove(size_t inumber) {
     if (!disk->mounted())
         return false;
+    std::lock_guard<std::mutex> guard(m_lock);
+    // blocks are freed only once the scan can no longer mark them used
+    if (!wait_scan())
+        return false;
     // Load inode information
     Inode node;
     load_inode(inumber, &node);
     if (!node.Valid)
         return false;
 
+    // blocks still waiting for a place never reach the disk at all
+    drop_delayed(inumber);
+
+    // freed blocks are discarded so a sparse image gets the space back
+    std::vector<uint64_t> freed;
+
     // Free direct blocks
-    for(int i=0;i<5;i++) { 
-        uint32_t t = node.Direct[i];
+    for(uint32_t i=0;i<POINTERS_PER_INODE;i++) { 
+        uint64_t t = node.Direct[i];
         if (t != 0) {
-            m_free_bitmap[t-m_offset] = 0; 
+            unset_free_bitmap(t);
+            freed.push_back(t);
         }
         node.Direct[i] = 0;
     }
 
     // Free indirect blocks
     if (node.Indirect != 0) {
-        // clear pointer block
-        Block pblock;
-        disk->read(node.Indirect, pblock.Data);
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++) {
-            uint32_t t = pblock.Pointers[i]; 
+        Block *pblock = reinterpret_cast<Block *>(m_cache->pin(node.Indirect));
+        for (uint32_t i = 0; i < pointers_per_block(m_version); i++) {
+            uint64_t t = get_pointer(*pblock, i, m_version); 
             if (t != 0) {
-                m_free_bitmap[t-m_offset] = 0;
-                pblock.Pointers[i] = 0;
+                unset_free_bitmap(t);
+                freed.push_back(t);
             }
         }
-        
-        disk->write(node.Indirect, pblock.Data);
+        m_cache->unpin(node.Indirect);
 
-        // m_free_bitmap[node.Indirect-offset] = 0;
+        // the pointer block goes too, which also clears its pointers
         unset_free_bitmap(node.Indirect);
+        note_indirect(node.Indirect, false);
+        freed.push_back(node.Indirect);
         node.Indirect = 0;
     }
 
+    std::sort(freed.begin(), freed.end());
+    for (size_t start = 0, end = 1; start < freed.size(); start = end++) {
+        while (end < freed.size() && freed[end] == freed[end-1] + 1)
+            end++;
+        disk->discard(freed[start], end - start);
+    }
+
     node.Valid = 0;
     // Clear inode in inode table
     save_inode(inumber, &node);
-    m_itable[inumber] = 0;
+    m_itable.clear(inumber);
+    m_inode_hint = inumber / inodes_per_block(m_version);
+    m_advice.erase(inumber);
+
+    // names that led to the inode, or lived in it, mean nothing now
+    for (auto entry = m_dentries.begin(); entry != m_dentries.end(); ) {
+        CachedDentry &dentry = entry->second;
+        if ((dentry.Found && dentry.Entry.Inode == inumber) ||
+            entry->first.compare(0, sizeof(uint32_t), dentry_key(inumber, "", 0)) == 0) {
+            m_dentry_lru.erase(dentry.Position);
+            entry = m_dentries.erase(entry);
+        } else {
+            entry++;
+        }
+    }
     return true;
 }
 
 // Inode stat ------------------------------------------------------------------
 
 ssize_t FileSystem::stat(size_t inumber) {
+    std::lock_guard<std::mutex> guard(m_lock);
 
     // Load inode information
     Inode node;
@@ -950,23 +976,164 @@ ssize_t FileSystem::stat(size_t inumber) {
 
 // Read from inode -------------------------------------------------------------
 
-ssize_t FileSystem::read(size_t inumber, char *data, size_t length) {
-    if (m_itable[inumber] == 0) return -1;
+ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
+    if (!mounted() || !inode_in_use(inumber)) return -1;
+    std::lock_guard<std::mutex> guard(m_lock);
 
     Inode node;
 
-    ssize_t bytes_read = 0;
     // Load inode information
     load_inode(inumber, &node);
-
-    
-    // Read block and copy to data
+    if (!node.Valid)
+        return -1;
+    if (offset >= node.Size || length == 0)
+        return 0;
+    length = std::min<size_t>(length, node.Size - offset);
+
+    auto advised = m_advice.find(inumber);
+    Advice advice = advised == m_advice.end() ? Advice::NORMAL : advised->second;
+
+    // the blocks asked for, then the read-ahead that fits in the file
+    size_t first  = offset / BlockDevice::BLOCK_SIZE;
+    size_t last   = (offset + length - 1) / BlockDevice::BLOCK_SIZE + 1;
+    size_t ahead  = advice == Advice::RANDOM     ? 0 :
+                    advice == Advice::SEQUENTIAL ? 4*READAHEAD_BLOCKS : READAHEAD_BLOCKS;
+    size_t blocks = (node.Size + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE;
+    size_t end    = std::min<size_t>(std::min<size_t>(last + ahead, blocks),
+                                     POINTERS_PER_INODE + pointers_per_block(m_version));
+
+    std::vector<uint64_t> pointers;
+    map_blocks(node, first, end, pointers);
+
+    // each batch is fetched with one readv, after which copying it out
+    // only hits the cache; blocks not to be reused are only put first in
+    // line for eviction once they have been read, or read-ahead would be
+    // evicted before it is used
+    BufferCache::Priority priority = advice_priority(advice);
+    size_t  batch      = prefetch_batch();
+    ssize_t bytes_read = 0;
+    for (size_t from = first; from < end; from += batch) {
+        size_t to = std::min(from + batch, end);
+        prefetch_blocks(&pointers[from - first], to - from,
+                        priority == BufferCache::Priority::LOW ? BufferCache::Priority::NORMAL : priority);
+
+        // Read block and copy to data
+        for (size_t b = from; b < to && b < last; b++) {
+            size_t start = b == first ? offset % BlockDevice::BLOCK_SIZE : 0;
+            size_t count = std::min<size_t>(BlockDevice::BLOCK_SIZE - start, length - bytes_read);
+            uint64_t pointer = pointers[b - first];
+            if (pointer == 0) {
+                char *delayed = delayed_block(inumber, b);
+                if (delayed)
+                    memcpy(data + bytes_read, delayed + start, count);
+                else
+                    memset(data + bytes_read, 0, count);
+            } else {
+                char *cached = m_cache->pin(pointer);
+                memcpy(data + bytes_read, cached + start, count);
+                m_cache->unpin(pointer);
+                if (priority == BufferCache::Priority::LOW)
+                    m_cache->prioritize(&pointer, 1, priority);
+            }
+            bytes_read += count;
+        }
+    }
     return bytes_read;
 }
 
+bool FileSystem::advise(size_t inumber, Advice advice) {
+    if (!mounted() || !inode_in_use(inumber)) return false;
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    Inode node;
+    load_inode(inumber, &node);
+    if (!node.Valid)
+        return false;
+
+    size_t blocks = std::min<size_t>((node.Size + BlockDevice::BLOCK_SIZE - 1) / BlockDevice::BLOCK_SIZE,
+                                     POINTERS_PER_INODE + pointers_per_block(m_version));
+    std::vector<uint64_t> pointers;
+
+    switch (advice) {
+        case Advice::WILLNEED: {
+            // the indirect block first, since mapping needs it anyway
+            if (node.Indirect != 0)
+                m_cache->prefetch(&node.Indirect, 1, BufferCache::Priority::HIGH);
+            map_blocks(node, 0, blocks, pointers);
+            auto advised = m_advice.find(inumber);
+            Advice mode  = advised == m_advice.end() ? Advice::NORMAL : advised->second;
+            for (size_t from = 0; from < pointers.size(); from += prefetch_batch())
+                prefetch_blocks(&pointers[from], std::min(prefetch_batch(), pointers.size() - from),
+                                advice_priority(mode));
+            break;
+        }
+        case Advice::DONTNEED:
+            map_blocks(node, 0, blocks, pointers);
+            pointers.erase(std::remove(pointers.begin(), pointers.end(), 0), pointers.end());
+            m_cache->drop(pointers.data(), pointers.size());
+            break;
+        case Advice::NORMAL:
+            m_advice.erase(inumber);
+            break;
+        default:
+            m_advice[inumber] = advice;
+            // blocks already cached follow the new advice too
+            map_blocks(node, 0, blocks, pointers);
+            m_cache->prioritize(pointers.data(), pointers.size(), advice_priority(advice));
+            break;
+    }
+    return true;
+}
+
+void FileSystem::map_blocks(const Inode &node, size_t first, size_t end, std::vector<uint64_t> &blocks) {
+    blocks.clear();
+    for (size_t b = first; b < end && b < POINTERS_PER_INODE; b++)
+        blocks.push_back(node.Direct[b]);
+    if (end <= POINTERS_PER_INODE)
+        return;
+
+    first = std::max<size_t>(first, POINTERS_PER_INODE);
+    if (node.Indirect == 0) {
+        blocks.resize(blocks.size() + end - first, 0);
+        return;
+    }
+
+    Block *pblock = reinterpret_cast<Block *>(m_cache->pin(node.Indirect));
+    for (size_t b = first; b < end; b++)
+        blocks.push_back(get_pointer(*pblock, b - POINTERS_PER_INODE, m_version));
+    m_cache->unpin(node.Indirect);
+}
+
+size_t FileSystem::prefetch_batch() {
+    // a quarter of the cache, the share 2Q gives blocks seen once, so that
+    // a batch never pushes out blocks that have proven themselves
+    return std::max<size_t>(m_cache_blocks / 4, 1);
+}
+
+void FileSystem::prefetch_blocks(const uint64_t *pointers, size_t count, BufferCache::Priority priority) {
+    std::vector<uint64_t> fetch;
+    for (size_t i = 0; i < count; i++) {
+        if (pointers[i] != 0)
+            fetch.push_back(pointers[i]);
+    }
+    m_cache->prefetch(fetch.data(), fetch.size(), priority);
+}
+
+BufferCache::Priority FileSystem::advice_priority(Advice advice) {
+    switch (advice) {
+        case Advice::RANDOM:
+            return BufferCache::Priority::HIGH;
+        case Advice::NOREUSE:
+            return BufferCache::Priority::LOW;
+        default:
+            return BufferCache::Priority::NORMAL;
+    }
+}
+
 // Write to inode --------------------------------------------------------------
 ssize_t FileSystem::write(size_t inumber, char *data, 
                           size_t length) {
+    std::lock_guard<std::mutex> guard(m_lock);
 
     Inode node;
     load_inode(inumber, &node);
@@ -974,44 +1141,245 @@ ssize_t FileSystem::write(size_t inumber, char *data,
         return -1; 
     }
     // find how many data blocks we need to write
-    uint32_t blocks_count = length / Disk::BLOCK_SIZE;
-    if (length % Disk::BLOCK_SIZE)
+    uint32_t blocks_count = length / BlockDevice::BLOCK_SIZE;
+    if (length % BlockDevice::BLOCK_SIZE)
         ++blocks_count;
+    blocks_count = std::min(blocks_count, POINTERS_PER_INODE + pointers_per_block(m_version));
+
+    // Blocks already on disk are written in place, handed to the disk in
+    // one writev so that runs of adjacent blocks become single I/Os; the
+    // rest wait in memory for place_delayed to give them a place
+    std::vector<BlockDevice::BlockRequest> requests;
+    std::vector<uint64_t> pointers;
+    PooledBuffer tail_buffer(m_arena);
+    Block &tail = *tail_buffer.as<Block>();
+    map_blocks(node, 0, blocks_count, pointers);
 
     size_t remaind_size = length;
     ssize_t total_written_bytes = 0;
-    Block block;
     for (uint32_t index = 0; index < blocks_count; ++index) {
 
-        uint32_t temp = remaind_size % Disk::BLOCK_SIZE;
-        uint32_t write_size =  temp == 0 ? Disk::BLOCK_SIZE : temp;
+        uint32_t write_size = std::min(remaind_size, +BlockDevice::BLOCK_SIZE);
+        uint64_t pointer    = pointers[index];
 
-        memcpy(block.Data, data, write_size);
-
-        if (!save_nth_block(inumber, index, &block)) {
-            printf("error while writing to disk save_nth_block\n"); 
-            return -1;
-        } 
+        if (pointer == 0) {
+            // whatever followed the end of the write stays in the buffer
+            char *buffer = delay_block(inumber, node, index);
+            if (!buffer) break;
+            memcpy(buffer, data, write_size);
+        }
+        else {
+            BlockDevice::BlockRequest request;
+            request.blocknum = pointer;
+            request.data     = data;
+            if (write_size < BlockDevice::BLOCK_SIZE) {
+                // keep whatever followed the end of the write in the last block
+                disk->read(pointer, tail.Data);
+                memcpy(tail.Data, data, write_size);
+                request.data = tail.Data;
+            }
+            requests.push_back(request);
+        }
 
         data += write_size;
-        node.Size += write_size;
         total_written_bytes += write_size;
 
         remaind_size -= write_size;
     }
+    disk->writev(requests.data(), requests.size());
+
+    node.Size = std::max<size_t>(node.Size, total_written_bytes);
+    save_inode(inumber, &node);
+
+    if (m_delayed_blocks > DELAYED_BLOCKS)
+        place_all_delayed();
 
     return total_written_bytes;
 
 }
 
+// Delayed allocation ----------------------------------------------------------
+
+char *FileSystem::delayed_block(size_t inumber, size_t nthblock) {
+    auto file = m_delayed.find(inumber);
+    if (file == m_delayed.end())
+        return nullptr;
+    auto block = file->second.Blocks.find(nthblock);
+    return block == file->second.Blocks.end() ? nullptr : block->second;
+}
+
+char *FileSystem::delay_block(size_t inumber, const Inode &node, size_t nthblock) {
+    if (char *buffer = delayed_block(inumber, nthblock))
+        return buffer;
+
+    // room is reserved now, so placing the block later cannot fail; the
+    // count of free blocks needs the whole scan
+    DelayedFile &file = m_delayed[inumber];
+    size_t need = 1;
+    if (nthblock >= POINTERS_PER_INODE && node.Indirect == 0 && !file.Indirect)
+        need++;
+    if (!wait_scan() ||
+        m_free_bitmap.size() - m_free_bitmap.used() < m_delayed_blocks + need) {
+        if (file.Blocks.empty())
+            m_delayed.erase(inumber);
+        return nullptr;
+    }
+    m_delayed_blocks += need;
+    if (need > 1)
+        file.Indirect = true;
+
+    char *buffer = m_delayed_pool.acquire();
+    memset(buffer, 0, BlockDevice::BLOCK_SIZE);
+    file.Blocks[nthblock] = buffer;
+    return buffer;
+}
+
+bool FileSystem::place_delayed(size_t inumber) {
+    auto file = m_delayed.find(inumber);
+    if (file == m_delayed.end())
+        return true;
+    DelayedFile &delayed = file->second;
+
+    Inode node;
+    load_inode(inumber, &node);
+
+    std::vector<BlockDevice::BlockRequest> requests;
+    PooledBuffer indirect_buffer(m_arena);
+    Block &indirect       = *indirect_buffer.as<Block>();
+    bool  indirect_dirty  = false;
+    if (node.Indirect != 0 && delayed.Blocks.rbegin()->first >= POINTERS_PER_INODE)
+        disk->read(node.Indirect, indirect.Data);
+    else
+        memset(indirect.Data, 0, BlockDevice::BLOCK_SIZE);
+
+    // every block the file waits for is known now, so runs are taken as
+    // long as all of them, each placed right after the block of the file
+    // before it where there is room; the indirect block comes out of the
+    // run too, between the blocks it follows and the ones it points to
+    BlockRun run  = {0, 0};
+    size_t   left = delayed.Blocks.size() + (delayed.Indirect ? 1 : 0);
+    bool     placed = true;
+    for (auto &block : delayed.Blocks) {
+        uint32_t index = block.first;
+        uint64_t goal  = 0;
+        if (index > 0 && index <= POINTERS_PER_INODE)
+            goal = node.Direct[index-1];
+        else if (index > POINTERS_PER_INODE)
+            goal = get_pointer(indirect, index-POINTERS_PER_INODE-1, m_version);
+        if (goal == 0 && index == POINTERS_PER_INODE)
+            goal = node.Indirect;
+        if (goal != 0)
+            goal++;
+
+        if (index >= POINTERS_PER_INODE && node.Indirect == 0) {
+            ssize_t t = allocate_from_run(run, goal, left--);
+            if (t < 0) { placed = false; break; }
+            node.Indirect  = t;
+            note_indirect(t, true);
+            indirect_dirty = true;
+            goal = t + 1;
+        }
+
+        ssize_t t = allocate_from_run(run, goal, left--);
+        if (t < 0) { placed = false; break; }
+        if (index < POINTERS_PER_INODE) {
+            node.Direct[index] = t;
+        }
+        else {
+            put_pointer(indirect, index-POINTERS_PER_INODE, m_version, t);
+            indirect_dirty = true;
+        }
+
+        BlockDevice::BlockRequest request;
+        request.blocknum = t;
+        request.data     = block.second;
+        requests.push_back(request);
+    }
+
+    // blocks the run had left over go back free
+    if (run.Left > 0)
+        m_free_bitmap.clear_range(run.Next - m_offset, run.Left);
+
+    size_t written = requests.size();
+    if (indirect_dirty) {
+        BlockDevice::BlockRequest request;
+        request.blocknum = node.Indirect;
+        request.data     = indirect.Data;
+        requests.push_back(request);
+    }
+    disk->writev(requests.data(), requests.size());
+    save_inode(inumber, &node);
+
+    if (placed) {
+        drop_delayed(inumber);
+        return true;
+    }
+
+    // blocks that found no place keep waiting, their room still reserved,
+    // so nothing written to them is lost; only the placed ones are dropped
+    auto block = delayed.Blocks.begin();
+    for (size_t i = 0; i < written; i++) {
+        m_delayed_pool.release(block->second);
+        block = delayed.Blocks.erase(block);
+    }
+    m_delayed_blocks -= written;
+    if (delayed.Indirect && node.Indirect != 0) {
+        delayed.Indirect = false;
+        m_delayed_blocks--;
+    }
+    return false;
+}
+
+void FileSystem::place_all_delayed() {
+    // in inode order, which is roughly the order the files were made in
+    std::vector<uint32_t> files;
+    for (auto &file : m_delayed)
+        files.push_back(file.first);
+    std::sort(files.begin(), files.end());
+
+    for (uint32_t inumber : files) {
+        if (!place_delayed(inumber))
+            fprintf(stderr, "[-] no room for the blocks of inode %u\n", inumber);
+    }
+}
+
+void FileSystem::drop_delayed(size_t inumber) {
+    auto file = m_delayed.find(inumber);
+    if (file == m_delayed.end())
+        return;
+
+    for (auto &block : file->second.Blocks)
+        m_delayed_pool.release(block.second);
+    m_delayed_blocks -= file->second.Blocks.size() + (file->second.Indirect ? 1 : 0);
+    m_delayed.erase(file);
+}
+
 bool FileSystem::load_inode(size_t inumber, Inode *node) {
     
-    uint32_t block_ind = inumber / INODES_PER_BLOCK; 
-    Block iblock;
+    auto cached = m_inodes.find(inumber);
+    if (cached != m_inodes.end()) {
+        m_inode_lru.splice(m_inode_lru.end(), m_inode_lru, cached->second.Position);
+        *node = cached->second.Node;
+        return true;
+    }
+
+    uint64_t block_ind = inumber / inodes_per_block(m_version) + INODE_BLOCKS_OFFSET; 
 
-    disk->read(block_ind+1, iblock.Data);
+    // decoded straight out of the cached block
+    Block *iblock = reinterpret_cast<Block *>(m_cache->pin(block_ind));
+    get_inode(*iblock, inumber % inodes_per_block(m_version), m_version, node);
+    m_cache->unpin(block_ind);
 
-    *node = iblock.Inodes[inumber];
+    // a mount that loaded the bitmaps has not seen the indirect blocks yet
+    if (node->Valid && node->Indirect != 0)
+        note_indirect(node->Indirect, true);
+
+    if (m_inodes.size() >= INODE_CACHE_INODES)
+        evict_inode();
+    CachedInode &entry = m_inodes[inumber];
+    entry.Node     = *node;
+    entry.Dirty    = false;
+    entry.Position = m_inode_lru.insert(m_inode_lru.end(), inumber);
 
     // Record inode if found
     return true;
@@ -1020,50 +1388,148 @@ bool FileSystem::load_inode(size_t inumber, Inode *node) {
 
 bool FileSystem::save_inode(size_t inumber, Inode *node) {
     
-    uint32_t block_ind = inumber / INODES_PER_BLOCK; 
-    Block iblock;
-    disk->read(block_ind+INODE_BLOCKS_OFFSET, iblock.Data); 
-    iblock.Inodes[inumber] = *node;
-
-    disk->write(block_ind+1, iblock.Data);
+    // the inode block is only touched when the inode is written back
+    auto cached = m_inodes.find(inumber);
+    if (cached == m_inodes.end()) {
+        if (m_inodes.size() >= INODE_CACHE_INODES)
+            evict_inode();
+        cached = m_inodes.insert(std::make_pair(inumber, CachedInode())).first;
+        cached->second.Position = m_inode_lru.insert(m_inode_lru.end(), inumber);
+    } else {
+        m_inode_lru.splice(m_inode_lru.end(), m_inode_lru, cached->second.Position);
+    }
+    cached->second.Node  = *node;
+    cached->second.Dirty = true;
 
     return true;
 }
 
+void FileSystem::write_inodes() {
+    std::vector<uint32_t> dirty;
+    for (auto &entry : m_inodes) {
+        if (entry.second.Dirty)
+            dirty.push_back(entry.first);
+    }
+    std::sort(dirty.begin(), dirty.end());
+
+    // sorted, so the inodes of a block are next to each other; each block
+    // is changed in a copy and written back whole, since a lazy mount's
+    // scanners may be reading it out of the cache meanwhile
+    PooledBuffer buffer(m_arena);
+    Block &iblock = *buffer.as<Block>();
+    uint32_t per_block = inodes_per_block(m_version);
+    for (size_t start = 0, end = 0; start < dirty.size(); start = end) {
+        uint64_t block_ind = dirty[start] / per_block + INODE_BLOCKS_OFFSET;
+        m_cache->read(block_ind, iblock.Data);
+        for (end = start; end < dirty.size() && dirty[end] / per_block + INODE_BLOCKS_OFFSET == block_ind; end++) {
+            CachedInode &entry = m_inodes[dirty[end]];
+            put_inode(iblock, dirty[end] % per_block, m_version, &entry.Node);
+            entry.Dirty = false;
+        }
+        m_cache->write(block_ind, iblock.Data);
+    }
+}
+
+void FileSystem::evict_inode() {
+    uint32_t inumber = m_inode_lru.front();
+    CachedInode &entry = m_inodes[inumber];
+
+    // written back through a copy, as in write_inodes
+    if (entry.Dirty) {
+        uint64_t block_ind = inumber / inodes_per_block(m_version) + INODE_BLOCKS_OFFSET;
+        PooledBuffer buffer(m_arena);
+        Block &iblock = *buffer.as<Block>();
+        m_cache->read(block_ind, iblock.Data);
+        put_inode(iblock, inumber % inodes_per_block(m_version), m_version, &entry.Node);
+        m_cache->write(block_ind, iblock.Data);
+    }
+
+    m_inode_lru.pop_front();
+    m_inodes.erase(inumber);
+}
+
 
 bool FileSystem::read_nth_block(size_t inumber, size_t nthblock, Block *block) {
     Inode node;
     load_inode(inumber, &node);
 
-    if (nthblock < POINTERS_PER_INODE) {
-        uint32_t t = node.Direct[nthblock]; 
-        if (t == 0) return false;
-        disk->read(t, block->Data);
+    std::vector<uint64_t> pointers;
+    map_blocks(node, nthblock, nthblock + 1, pointers);
+    uint64_t t = pointers[0];
+    if (t == 0) {
+        char *delayed = delayed_block(inumber, nthblock);
+        if (!delayed) return false;
+        memcpy(block->Data, delayed, BlockDevice::BLOCK_SIZE);
         return true;
     }
-    else {
-        uint32_t t = node.Indirect;
-        if (t == 0) return false;
-        Block dblock;
-        
-        disk->read(t, dblock.Data);
 
-        t = dblock.Pointers[nthblock-POINTERS_PER_INODE]; 
-        if (t == 0) return false;
+    disk->read(t, block->Data);
+    return true;
+}
+
+void FileSystem::mark_indirect_blocks(std::vector<BlockDevice::BlockRequest> &requests, ScanResult &found) {
+    if (requests.empty())
+        return;
 
-        disk->read(t, block->Data);    
-        return true;
+    disk->readv(requests.data(), requests.size());
+
+    for (size_t r = 0; r < requests.size(); r++) {
+        Block *indi_block = reinterpret_cast<Block *>(requests[r].data);
+        for (uint32_t k = 0; k < pointers_per_block(m_version); k++) {
+            uint64_t block_ind = get_pointer(*indi_block, k, m_version);
+            if (block_ind != 0) {
+                found.Blocks.push_back(block_ind);
+            } 
+        }
     }
+    requests.clear();
 }
 
-ssize_t FileSystem::allocate_free_block() {
-    for (uint32_t i = 0; i < m_free_bitmap_size; i++) {
-        if (m_free_bitmap[i] == 0) {
-            m_free_bitmap[i] = 1;
-            return (i+m_offset); 
-        }
+void FileSystem::load_bitmaps() {
+    BlockPool    arena(0);
+    PooledBuffer region(arena, m_bitmap_blocks);
+    disk->read_blocks(m_bitmap_start, m_bitmap_blocks, region.data());
+
+    const uint64_t *words = region.as<uint64_t>();
+    m_itable.load(words);
+    m_free_bitmap.load(words + m_itable.words());
+}
+
+void FileSystem::save_bitmaps() {
+    BlockPool    arena(0);
+    PooledBuffer region(arena, m_bitmap_blocks);
+    memset(region.data(), 0, m_bitmap_blocks*BlockDevice::BLOCK_SIZE);
+
+    uint64_t *words = region.as<uint64_t>();
+    m_itable.store(words);
+    m_free_bitmap.store(words + m_itable.words());
+    disk->write_blocks(m_bitmap_start, m_bitmap_blocks, region.data());
+}
+
+void FileSystem::note_indirect(uint64_t b, bool indirect) {
+    disk->metadata(b, 1, indirect);
+    if (IOProfile *profile = disk->profile())
+        profile->set_indirect(b, indirect);
+}
+
+ssize_t FileSystem::allocate_blocks(uint64_t goal, size_t count, size_t *got) {
+    // any inode may use any block, so the whole scan has to be done
+    if (!wait_scan()) return -1;
+
+    size_t aim = goal >= m_offset ? goal - m_offset : ExtentAllocator::NONE;
+    size_t i   = m_free_bitmap.allocate_run(aim, count, got);
+    if (i == ExtentAllocator::NONE) return -1;
+    return (i+m_offset);
+}
+
+ssize_t FileSystem::allocate_from_run(BlockRun &run, uint64_t goal, size_t count) {
+    if (run.Left == 0) {
+        ssize_t t = allocate_blocks(goal, count, &run.Left);
+        if (t < 0) return -1;
+        run.Next = t;
     }
-    return -1;
+    run.Left--;
+    return run.Next++;
 }
 
 bool FileSystem::save_nth_block(size_t inumber, 
@@ -1072,49 +1538,37 @@ bool FileSystem::save_nth_block(size_t inumber,
     Inode node;
     load_inode(inumber, &node);
 
-    if (nthblock < POINTERS_PER_INODE) {
-        ssize_t t = node.Direct[nthblock]; 
-        if (t == 0) {
-            t = allocate_free_block();
-            node.Direct[nthblock] = t;
-            save_inode(inumber, &node);
-        }
-        disk->write(t, block->Data);
+    std::vector<uint64_t> pointers;
+    map_blocks(node, nthblock, nthblock + 1, pointers);
+    uint64_t t = pointers[0];
+    if (t == 0) {
+        // a new block waits for a place like any written by write
+        char *delayed = delay_block(inumber, node, nthblock);
+        if (!delayed) return false;
+        memcpy(delayed, block->Data, BlockDevice::BLOCK_SIZE);
         return true;
     }
-    else {
-        uint32_t indirect_block = node.Indirect;
-        if (indirect_block == 0) {
-            indirect_block = allocate_free_block();
-            node.Indirect = indirect_block;
-            save_inode(inumber, &node);
-        } 
-        Block dblock;
-
-        disk->read(indirect_block, dblock.Data);
-
-        uint32_t t = dblock.Pointers[nthblock-POINTERS_PER_INODE]; 
-        if (t == 0) {
-            t = allocate_free_block();
-            dblock.Pointers[nthblock-POINTERS_PER_INODE] = t;
-            disk->write(indirect_block, dblock.Data);
-        }
 
-        disk->write(t, block->Data);
-        return true;
-    }
+    disk->write(t, block->Data);
+    return true;
 }
 
 bool FileSystem::add_new_dirent(const Dirent &dirent, uint32_t inum) {
+    // a negative entry for the name would hide it from now on
+    forget_dentry(inum, dirent.Name, dirent.NameLength);
+
     // uint32_t inum = m_current_dir.Inode;
-    uint32_t total_inode_blocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
-    Block block = {0};
+    uint32_t total_inode_blocks = POINTERS_PER_INODE + pointers_per_block(m_version);
+    PooledBuffer buffer(m_arena);
+    Block &block = *buffer.as<Block>();
 
     // iterate over the inode dirent blocks
     for (uint32_t b = 0; b < total_inode_blocks; b++) {
 
         if (!read_nth_block(inum, b, &block)) {
-            // make the nth block here
+            // make the nth block here, empty rather than a copy of the
+            // full block before it
+            memset(block.Data, 0, BlockDevice::BLOCK_SIZE);
             save_nth_block(inum, b, &block);
         }
 
@@ -1143,12 +1597,14 @@ void FileSystem::list() {
         printf("must be mounted\n");
         return;
     } 
+    std::lock_guard<std::mutex> guard(m_lock);
 
     Inode node;
     load_inode(m_current_dir.Inode, &node);
 
-    Block block;
-    for (uint32_t i = 0; i < POINTERS_PER_INODE+POINTERS_PER_BLOCK; i++) {
+    PooledBuffer buffer(m_arena);
+    Block &block = *buffer.as<Block>();
+    for (uint32_t i = 0; i < POINTERS_PER_INODE+pointers_per_block(m_version); i++) {
         if (!read_nth_block(m_current_dir.Inode, i, &block))
             break;
 
@@ -1175,33 +1631,88 @@ bool FileSystem::change_directory(char *name) {
         printf("must be mounted\n");
         return false;
     } 
+    std::lock_guard<std::mutex> guard(m_lock);
 
-    Inode node;
-    load_inode(m_current_dir.Inode, &node);
+    Dirent dirent;
+    if (lookup_dirent(m_current_dir.Inode, name, &dirent) &&
+        dirent.Type == static_cast<uint8_t>(DirentType::DIR_T)) {
 
-    Block block;
-    for (uint32_t i = 0; i < POINTERS_PER_INODE+POINTERS_PER_BLOCK; i++) {
+        m_current_dir = dirent;
+        if (m_current_dir.Inode == 0) {
+            strcpy(m_current_dir.Name, "/");
+        }
+    }
+    return true;
+}
 
-        if (!read_nth_block(m_current_dir.Inode, i, &block))
+ssize_t FileSystem::find_inumber(char *name, size_t directory_inumber) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    Dirent dirent;
+    if (!lookup_dirent(directory_inumber, name, &dirent))
+        return -1;
+
+    return dirent.Inode;
+}
+
+// Dentry cache ----------------------------------------------------------------
+
+std::string FileSystem::dentry_key(size_t directory_inumber, const char *name, size_t length) {
+    // the directory's inumber as four raw bytes, then the name
+    uint32_t inumber = directory_inumber;
+    return std::string(reinterpret_cast<const char *>(&inumber), sizeof(inumber)) +
+           std::string(name, length);
+}
+
+void FileSystem::forget_dentry(size_t directory_inumber, const char *name, size_t length) {
+    auto entry = m_dentries.find(dentry_key(directory_inumber, name, length));
+    if (entry != m_dentries.end()) {
+        m_dentry_lru.erase(entry->second.Position);
+        m_dentries.erase(entry);
+    }
+}
+
+bool FileSystem::lookup_dirent(size_t directory_inumber, const char *name, Dirent *dirent) {
+    std::string key = dentry_key(directory_inumber, name, strlen(name));
+
+    auto cached = m_dentries.find(key);
+    if (cached != m_dentries.end()) {
+        m_dentry_lru.splice(m_dentry_lru.end(), m_dentry_lru, cached->second.Position);
+        *dirent = cached->second.Entry;
+        return cached->second.Found;
+    }
+
+    bool found = false;
+    PooledBuffer buffer(m_arena);
+    Block &block = *buffer.as<Block>();
+    for (uint32_t i = 0; i < POINTERS_PER_INODE+pointers_per_block(m_version) && !found; i++) {
+
+        if (!read_nth_block(directory_inumber, i, &block))
             break;
 
         for (uint32_t j = 0; j < DIRENTS_PER_BLOCK; j++) {
             uint8_t type = block.Dirents[j].Type;
 
-            if (type == static_cast<uint8_t>(DirentType::DIR_T)) {
+            if (type == static_cast<uint8_t>(DirentType::FILE_T) ||
+                type == static_cast<uint8_t>(DirentType::DIR_T)) {
                 if (strncmp(block.Dirents[j].Name, name, block.Dirents[j].NameLength) == 0 &&
                     strlen(name) == block.Dirents[j].NameLength) {
 
-                    m_current_dir = block.Dirents[j];
-                    if (m_current_dir.Inode == 0) {
-                        strcpy(m_current_dir.Name, "/");
-                    }
-
-                    return true;
+                    *dirent = block.Dirents[j];
+                    found   = true;
+                    break;
                 }
             }
         }
     }
-    return true;
-}
 
+    if (m_dentries.size() >= DENTRY_CACHE_NAMES) {
+        m_dentries.erase(m_dentry_lru.front());
+        m_dentry_lru.pop_front();
+    }
+    CachedDentry &entry = m_dentries[key];
+    entry.Found    = found;
+    entry.Entry    = found ? *dirent : Dirent();
+    entry.Position = m_dentry_lru.insert(m_dentry_lru.end(), key);
+
+    return found;
+}
@@ -0,0 +1,123 @@
+// inode_table.cpp: inode allocation bitmap with free counts per inode block
+
+#include "sfs/inode_table.h"
+
+#include <algorithm>
+
+InodeTable::InodeTable(size_t ninodes, size_t per_block) : PerBlock(1) {
+    reset(ninodes, per_block);
+}
+
+void InodeTable::reset(size_t ninodes, size_t per_block) {
+    PerBlock = std::max<size_t>(per_block, 1);
+    Bits.reset(ninodes);
+
+    // One level per factor of FANOUT, down from a single count at the top
+    Free.clear();
+    size_t counts = (ninodes + PerBlock - 1) / PerBlock;
+    while (counts > 0) {
+    	Free.push_back(std::vector<uint32_t>(counts, 0));
+    	if (counts == 1) {
+    	    break;
+    	}
+    	counts = (counts + FANOUT - 1) / FANOUT;
+    }
+    recount();
+}
+
+void InodeTable::recount() {
+    if (Free.empty()) {
+    	return;
+    }
+
+    std::vector<uint32_t> &blocks = Free[0];
+    for (size_t b = 0; b < blocks.size(); b++) {
+    	size_t first = b*PerBlock;
+    	size_t n     = std::min(PerBlock, Bits.size() - first);
+    	blocks[b]    = n - Bits.count(first, n);
+    }
+
+    for (size_t level = 1; level < Free.size(); level++) {
+    	std::vector<uint32_t> &below = Free[level - 1];
+    	std::vector<uint32_t> &above = Free[level];
+    	std::fill(above.begin(), above.end(), 0);
+    	for (size_t g = 0; g < below.size(); g++) {
+    	    above[g / FANOUT] += below[g];
+    	}
+    }
+}
+
+void InodeTable::adjust(size_t item, int delta) {
+    size_t index = item / PerBlock;
+    for (size_t level = 0; level < Free.size(); level++) {
+    	Free[level][index] += delta;
+    	index /= FANOUT;
+    }
+}
+
+void InodeTable::set(size_t item) {
+    if (item < Bits.size() && !Bits.test(item)) {
+    	Bits.set(item);
+    	adjust(item, -1);
+    }
+}
+
+void InodeTable::clear(size_t item) {
+    if (Bits.test(item)) {
+    	Bits.clear(item);
+    	adjust(item, 1);
+    }
+}
+
+size_t InodeTable::free_in_block(size_t block) const {
+    if (Free.empty() || block >= Free[0].size()) {
+    	return 0;
+    }
+    return Free[0][block];
+}
+
+size_t InodeTable::find_free_block(size_t block) const {
+    if (Free.empty()) {
+    	return NONE;
+    }
+
+    // Climb while the rest of the group at this level has nothing free
+    size_t level = 0;
+    size_t index = block;
+    while (true) {
+    	const std::vector<uint32_t> &counts = Free[level];
+    	size_t group = index / FANOUT;
+    	size_t end   = std::min((group + 1)*FANOUT, counts.size());
+    	while (index < end && counts[index] == 0) {
+    	    index++;
+    	}
+    	if (index < end) {
+    	    break;
+    	}
+    	if (level + 1 == Free.size()) {
+    	    return NONE;
+    	}
+    	level++;
+    	index = group + 1;
+    }
+
+    // Then descend to the first block with room under what was found
+    while (level > 0) {
+    	level--;
+    	index *= FANOUT;
+    	while (Free[level][index] == 0) {
+    	    index++;
+    	}
+    }
+    return index;
+}
+
+size_t InodeTable::find_free_in(size_t block) const {
+    size_t item = Bits.find_free(block*PerBlock);
+    return item < (block + 1)*PerBlock ? item : NONE;
+}
+
+void InodeTable::load(const uint64_t *words) {
+    Bits.load(words);
+    recount();
+}
@@ -0,0 +1,168 @@
+// io_profile.cpp: I/O profile of a block device
+
+#include "sfs/io_profile.h"
+
+#include <string.h>
+
+// Return histogram bucket for a sample
+static size_t bucket(size_t value) {
+    size_t index = 0;
+    while (value > 0 && index < IOProfile::HISTOGRAM_BUCKETS - 1) {
+    	value >>= 1;
+    	index++;
+    }
+    return index;
+}
+
+static void add_sample(IOProfile::Histogram &histogram, size_t value) {
+    histogram.Buckets[bucket(value)]++;
+    histogram.Count++;
+    histogram.Total += value;
+    if (value > histogram.Max) {
+    	histogram.Max = value;
+    }
+}
+
+// Print the non-empty buckets of a histogram, labelled by their upper bound
+static void dump_buckets(FILE *stream, const IOProfile::Histogram &histogram, double scale, int precision, const char *unit) {
+    for (size_t i = 0; i < IOProfile::HISTOGRAM_BUCKETS; i++) {
+    	if (histogram.Buckets[i] == 0) {
+    	    continue;
+    	}
+    	if (i == 0) {
+    	    fprintf(stream, "        %12s %s: %lu\n", "0", unit, histogram.Buckets[i]);
+    	} else if (i == IOProfile::HISTOGRAM_BUCKETS - 1) {
+    	    fprintf(stream, "        >= %9.*f %s: %lu\n", precision, (1UL << (i - 1))*scale, unit, histogram.Buckets[i]);
+    	} else {
+    	    fprintf(stream, "        <  %9.*f %s: %lu\n", precision, (1UL << i)*scale, unit, histogram.Buckets[i]);
+    	}
+    }
+}
+
+IOProfile::IOProfile() : Head(-1), InodeBlocks(0), DataStart(1) {
+    memset(&Stats, 0, sizeof(Stats));
+}
+
+void IOProfile::layout(size_t blocks, size_t inode_blocks, size_t data_start) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    InodeBlocks = inode_blocks;
+    DataStart   = data_start;
+    Indirect.assign(blocks, false);
+}
+
+void IOProfile::set_indirect(size_t blocknum, bool indirect) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (blocknum < Indirect.size()) {
+    	Indirect[blocknum] = indirect;
+    }
+}
+
+IOProfile::BlockClass IOProfile::classify(size_t blocknum) const {
+    if (blocknum == 0) {
+    	return BlockClass::SUPER;
+    }
+    if (blocknum <= InodeBlocks) {
+    	return BlockClass::INODE;
+    }
+    if (blocknum < DataStart) {
+    	return BlockClass::TABLE;
+    }
+    if (blocknum < Indirect.size() && Indirect[blocknum]) {
+    	return BlockClass::INDIRECT;
+    }
+    return BlockClass::DATA;
+}
+
+void IOProfile::record_call(Op op, size_t nanoseconds) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    add_sample(Stats.Latency[static_cast<size_t>(op)], nanoseconds);
+}
+
+void IOProfile::record_access(size_t blocknum, size_t nblocks, bool writing) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // The first access of all has nothing to seek from
+    size_t distance = 0;
+    if (Head >= 0) {
+    	distance = blocknum > (size_t)Head ? blocknum - Head : Head - blocknum;
+    	add_sample(Stats.Seeks, distance);
+    }
+    Head = blocknum + nblocks;
+
+    size_t *counts = writing ? Stats.Writes : Stats.Reads;
+    for (size_t i = 0; i < nblocks; i++) {
+    	counts[static_cast<size_t>(classify(blocknum + i))]++;
+    }
+    if (distance > 0) {
+    	Stats.Random[static_cast<size_t>(classify(blocknum))]++;
+    }
+}
+
+IOProfile::Report IOProfile::report() const {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Stats;
+}
+
+void IOProfile::reset() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    memset(&Stats, 0, sizeof(Stats));
+    Head = -1;
+}
+
+void IOProfile::dump(FILE *stream) const {
+    Report stats = report();
+
+    fprintf(stream, "Latency:\n");
+    for (size_t op = 0; op < OPS; op++) {
+    	const Histogram &latency = stats.Latency[op];
+    	if (latency.Count == 0) {
+    	    continue;
+    	}
+    	fprintf(stream, "    %s: %lu calls, avg %.1f us, max %.1f us\n",
+    	    name(static_cast<Op>(op)), latency.Count,
+    	    latency.Total / 1000.0 / latency.Count, latency.Max / 1000.0);
+    	dump_buckets(stream, latency, 1 / 1000.0, 1, "us");
+    }
+
+    fprintf(stream, "Seek distance:\n");
+    size_t sequential = stats.Seeks.Buckets[0];
+    fprintf(stream, "    %lu sequential, %lu random, avg %.1f blocks, max %lu blocks\n",
+    	sequential, stats.Seeks.Count - sequential,
+    	stats.Seeks.Count ? (double)stats.Seeks.Total / stats.Seeks.Count : 0.0, stats.Seeks.Max);
+    dump_buckets(stream, stats.Seeks, 1, 0, "blocks");
+
+    fprintf(stream, "Block classes:\n");
+    fprintf(stream, "    %-10s %10s %10s %10s\n", "", "reads", "writes", "random");
+    for (size_t type = 0; type < CLASSES; type++) {
+    	fprintf(stream, "    %-10s %10lu %10lu %10lu\n", name(static_cast<BlockClass>(type)),
+    	    stats.Reads[type], stats.Writes[type], stats.Random[type]);
+    }
+}
+
+const char *IOProfile::name(Op op) {
+    switch (op) {
+    	case Op::READ:		return "read";
+    	case Op::WRITE:		return "write";
+    	case Op::READ_BLOCKS:	return "read_blocks";
+    	case Op::WRITE_BLOCKS:	return "write_blocks";
+    	case Op::READV:		return "readv";
+    	case Op::WRITEV:	return "writev";
+    	default:		return "unknown";
+    }
+}
+
+const char *IOProfile::name(BlockClass type) {
+    switch (type) {
+    	case BlockClass::SUPER:	    return "superblock";
+    	case BlockClass::INODE:	    return "inode";
+    	case BlockClass::TABLE:	    return "table";
+    	case BlockClass::INDIRECT:  return "indirect";
+    	case BlockClass::DATA:	    return "data";
+    	default:		    return "unknown";
+    }
+}
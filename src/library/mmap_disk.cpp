@@ -0,0 +1,115 @@
+// mmap_disk.cpp: memory-mapped disk emulator
+
+#include "sfs/mmap_disk.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void MmapDisk::open(const char *path, size_t nblocks, Mode mode) {
+    Disk::open(path, nblocks, Mode::BUFFERED);
+
+    if (nblocks == 0) {
+    	return;
+    }
+
+    void *mapping = mmap(NULL, nblocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+    if (mapping == MAP_FAILED) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to mmap %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    Mapping = static_cast<char *>(mapping);
+}
+
+MmapDisk::~MmapDisk() {
+    if (Mapping != nullptr) {
+    	msync(Mapping, Blocks*BLOCK_SIZE, MS_SYNC);
+    	munmap(Mapping, Blocks*BLOCK_SIZE);
+    	Mapping = nullptr;
+    }
+}
+
+void MmapDisk::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    memcpy(data, Mapping + (size_t)blocknum*BLOCK_SIZE, BLOCK_SIZE);
+
+    Reads++;
+}
+
+void MmapDisk::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    memcpy(Mapping + (size_t)blocknum*BLOCK_SIZE, data, BLOCK_SIZE);
+
+    Writes++;
+}
+
+void MmapDisk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    memcpy(data, Mapping + (size_t)blocknum*BLOCK_SIZE, nblocks*BLOCK_SIZE);
+
+    Reads += nblocks;
+}
+
+void MmapDisk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    memcpy(Mapping + (size_t)blocknum*BLOCK_SIZE, data, nblocks*BLOCK_SIZE);
+
+    Writes += nblocks;
+}
+
+void MmapDisk::readv(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	read(requests[i].blocknum, requests[i].data);
+    }
+}
+
+void MmapDisk::writev(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	write(requests[i].blocknum, requests[i].data);
+    }
+}
+
+void MmapDisk::sync(bool async) {
+    if (Mapping == nullptr) {
+    	return;
+    }
+
+    if (msync(Mapping, Blocks*BLOCK_SIZE, async ? MS_ASYNC : MS_SYNC) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to msync: %s", strerror(errno));
+    	throw std::runtime_error(what);
+    }
+}
+
+void MmapDisk::advise(Advice advice, uint64_t blocknum, size_t nblocks) {
+    if (Mapping == nullptr || blocknum >= Blocks) {
+    	return;
+    }
+
+    if (nblocks == 0 || blocknum + nblocks > Blocks) {
+    	nblocks = Blocks - blocknum;
+    }
+
+    int flag;
+    switch (advice) {
+    	case Advice::SEQUENTIAL: flag = MADV_SEQUENTIAL; break;
+    	case Advice::RANDOM:     flag = MADV_RANDOM;     break;
+    	case Advice::WILLNEED:   flag = MADV_WILLNEED;   break;
+    	case Advice::DONTNEED:   flag = MADV_DONTNEED;   break;
+    	default:                 flag = MADV_NORMAL;     break;
+    }
+
+    // Advice is only a hint, so failures are not worth reporting
+    madvise(Mapping + (size_t)blocknum*BLOCK_SIZE, nblocks*BLOCK_SIZE, flag);
+}
@@ -0,0 +1,90 @@
+// profiled_disk.cpp: block device wrapper that profiles the I/O passing through
+
+#include "sfs/profiled_disk.h"
+
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+// Return nanoseconds elapsed since start
+static size_t elapsed(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+ProfiledDisk::ProfiledDisk(BlockDevice *device) : BlockDevice(), Device(device) {
+    Blocks = Device->size();
+    Profile.layout(Blocks, 0, 1);
+}
+
+ProfiledDisk::~ProfiledDisk() {
+    delete Device;
+}
+
+void ProfiledDisk::read(uint64_t blocknum, char *data) {
+    Clock::time_point start = Clock::now();
+    Device->read(blocknum, data);
+    Profile.record_call(IOProfile::Op::READ, elapsed(start));
+    Profile.record_access(blocknum, 1, false);
+
+    Reads++;
+}
+
+void ProfiledDisk::write(uint64_t blocknum, char *data) {
+    Clock::time_point start = Clock::now();
+    Device->write(blocknum, data);
+    Profile.record_call(IOProfile::Op::WRITE, elapsed(start));
+    Profile.record_access(blocknum, 1, true);
+
+    Writes++;
+}
+
+void ProfiledDisk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    Clock::time_point start = Clock::now();
+    Device->read_blocks(blocknum, nblocks, data);
+    Profile.record_call(IOProfile::Op::READ_BLOCKS, elapsed(start));
+    Profile.record_access(blocknum, nblocks, false);
+
+    Reads += nblocks;
+}
+
+void ProfiledDisk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    Clock::time_point start = Clock::now();
+    Device->write_blocks(blocknum, nblocks, data);
+    Profile.record_call(IOProfile::Op::WRITE_BLOCKS, elapsed(start));
+    Profile.record_access(blocknum, nblocks, true);
+
+    Writes += nblocks;
+}
+
+// Seeks are recorded in the order the caller listed the blocks, which is
+// the access pattern the file system asked for before any reordering below
+
+void ProfiledDisk::readv(const BlockRequest *requests, size_t count) {
+    if (count == 0) {
+    	return;
+    }
+
+    Clock::time_point start = Clock::now();
+    Device->readv(requests, count);
+    Profile.record_call(IOProfile::Op::READV, elapsed(start));
+    for (size_t i = 0; i < count; i++) {
+    	Profile.record_access(requests[i].blocknum, 1, false);
+    }
+
+    Reads += count;
+}
+
+void ProfiledDisk::writev(const BlockRequest *requests, size_t count) {
+    if (count == 0) {
+    	return;
+    }
+
+    Clock::time_point start = Clock::now();
+    Device->writev(requests, count);
+    Profile.record_call(IOProfile::Op::WRITEV, elapsed(start));
+    for (size_t i = 0; i < count; i++) {
+    	Profile.record_access(requests[i].blocknum, 1, true);
+    }
+
+    Writes += count;
+}
@@ -0,0 +1,103 @@
+// ram_disk.cpp: in-memory block device
+
+#include "sfs/ram_disk.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+RamDisk::RamDisk(size_t nblocks) : BlockDevice(), Memory(nullptr) {
+    if (nblocks > 0) {
+    	void *memory = mmap(NULL, nblocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    	if (memory == MAP_FAILED) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to allocate %lu blocks: %s", nblocks, strerror(errno));
+    	    throw std::runtime_error(what);
+    	}
+    	Memory = static_cast<char *>(memory);
+    }
+
+    Blocks = nblocks;
+}
+
+RamDisk::~RamDisk() {
+    if (Memory != nullptr) {
+    	munmap(Memory, Blocks*BLOCK_SIZE);
+    	Memory = nullptr;
+    }
+}
+
+void RamDisk::load(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    size_t offset = 0;
+    while (offset < Blocks*BLOCK_SIZE) {
+    	ssize_t result = pread(fd, Memory + offset, Blocks*BLOCK_SIZE - offset, offset);
+    	if (result < 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to read %s: %s", path, strerror(errno));
+    	    close(fd);
+    	    throw std::runtime_error(what);
+    	}
+    	if (result == 0) {
+    	    break;
+    	}
+    	offset += result;
+    }
+
+    close(fd);
+}
+
+void RamDisk::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    memcpy(data, Memory + (size_t)blocknum*BLOCK_SIZE, BLOCK_SIZE);
+
+    Reads++;
+}
+
+void RamDisk::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    memcpy(Memory + (size_t)blocknum*BLOCK_SIZE, data, BLOCK_SIZE);
+
+    Writes++;
+}
+
+void RamDisk::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    // Private anonymous pages read back as zeros once they are dropped
+    char *start = Memory + (size_t)blocknum*BLOCK_SIZE;
+    if (nblocks > 0 && madvise(start, nblocks*BLOCK_SIZE, MADV_DONTNEED) < 0) {
+    	memset(start, 0, nblocks*BLOCK_SIZE);
+    }
+}
+
+void RamDisk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    memcpy(data, Memory + (size_t)blocknum*BLOCK_SIZE, nblocks*BLOCK_SIZE);
+
+    Reads += nblocks;
+}
+
+void RamDisk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    memcpy(Memory + (size_t)blocknum*BLOCK_SIZE, data, nblocks*BLOCK_SIZE);
+
+    Writes += nblocks;
+}
@@ -0,0 +1,254 @@
+// striped_disk.cpp: block device striped across several disk images
+
+#include "sfs/striped_disk.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <stdio.h>
+
+void StripedDisk::open(const std::vector<std::string> &paths, size_t nblocks, size_t unit, Disk::Mode mode) {
+    if (paths.empty() || unit == 0) {
+    	throw std::runtime_error("Unable to open striped disk: no members or empty stripe unit");
+    }
+
+    teardown();
+    StripeUnit = unit;
+
+    // Every member holds the same number of whole stripe units
+    size_t stripes    = (nblocks + unit - 1) / unit;
+    size_t per_member = (stripes + paths.size() - 1) / paths.size() * unit;
+
+    try {
+    	for (size_t i = 0; i < paths.size(); i++) {
+    	    Member *member   = new Member();
+    	    member->Image    = new Disk();
+    	    member->Stopping = false;
+    	    Members.push_back(member);
+    	    member->Image->open(paths[i].c_str(), per_member, mode);
+    	}
+    } catch (std::runtime_error &e) {
+    	teardown();
+    	throw;
+    }
+
+    for (size_t i = 0; i < Members.size(); i++) {
+    	Members[i]->Worker = std::thread(&StripedDisk::work, this, Members[i]);
+    }
+
+    Blocks = nblocks;
+    Reads  = 0;
+    Writes = 0;
+}
+
+StripedDisk::~StripedDisk() {
+    teardown();
+}
+
+void StripedDisk::teardown() {
+    for (size_t i = 0; i < Members.size(); i++) {
+    	Member *member = Members[i];
+    	{
+    	    std::lock_guard<std::mutex> guard(member->Lock);
+    	    member->Stopping = true;
+    	}
+    	member->Ready.notify_one();
+    	if (member->Worker.joinable()) {
+    	    member->Worker.join();
+    	}
+    	delete member->Image;
+    	delete member;
+    }
+    Members.clear();
+}
+
+void StripedDisk::work(Member *member) {
+    while (true) {
+    	Job *job;
+    	{
+    	    std::unique_lock<std::mutex> lock(member->Lock);
+    	    member->Ready.wait(lock, [member]() { return member->Stopping || !member->Jobs.empty(); });
+    	    if (member->Jobs.empty()) {
+    	    	return;
+    	    }
+    	    job = member->Jobs.front();
+    	    member->Jobs.pop_front();
+    	}
+
+    	std::string error;
+    	try {
+    	    if (job->Writing) {
+    	    	member->Image->writev(job->Requests.data(), job->Requests.size());
+    	    } else {
+    	    	member->Image->readv(job->Requests.data(), job->Requests.size());
+    	    }
+    	} catch (std::exception &e) {
+    	    error = e.what();
+    	}
+
+    	Batch *batch = job->Owner;
+    	std::lock_guard<std::mutex> guard(batch->Lock);
+    	if (!error.empty() && batch->Error.empty()) {
+    	    batch->Error = error;
+    	}
+    	if (--batch->Remaining == 0) {
+    	    batch->Done.notify_all();
+    	}
+    }
+}
+
+void StripedDisk::locate(uint64_t blocknum, size_t &member, uint64_t &offset) const {
+    size_t stripe = blocknum / StripeUnit;
+    member = stripe % Members.size();
+    offset = (stripe / Members.size()) * StripeUnit + blocknum % StripeUnit;
+}
+
+void StripedDisk::dispatch(const BlockRequest *requests, size_t count, bool writing) {
+    std::vector<Job> jobs(Members.size());
+
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+
+    	size_t member;
+    	BlockRequest request;
+    	locate(requests[i].blocknum, member, request.blocknum);
+    	request.data = requests[i].data;
+    	jobs[member].Requests.push_back(request);
+    }
+
+    Batch batch;
+    batch.Remaining = 0;
+    size_t last = 0;
+    for (size_t m = 0; m < jobs.size(); m++) {
+    	if (!jobs[m].Requests.empty()) {
+    	    batch.Remaining++;
+    	    last = m;
+    	}
+    }
+
+    if (batch.Remaining == 1) {
+    	// Only one member involved: no point in waking its thread
+    	if (writing) {
+    	    Members[last]->Image->writev(jobs[last].Requests.data(), jobs[last].Requests.size());
+    	} else {
+    	    Members[last]->Image->readv(jobs[last].Requests.data(), jobs[last].Requests.size());
+    	}
+    } else if (batch.Remaining > 1) {
+    	for (size_t m = 0; m < jobs.size(); m++) {
+    	    if (jobs[m].Requests.empty()) {
+    	    	continue;
+    	    }
+    	    jobs[m].Writing = writing;
+    	    jobs[m].Owner   = &batch;
+    	    {
+    	    	std::lock_guard<std::mutex> guard(Members[m]->Lock);
+    	    	Members[m]->Jobs.push_back(&jobs[m]);
+    	    }
+    	    Members[m]->Ready.notify_one();
+    	}
+
+    	std::unique_lock<std::mutex> lock(batch.Lock);
+    	batch.Done.wait(lock, [&batch]() { return batch.Remaining == 0; });
+    	if (!batch.Error.empty()) {
+    	    throw std::runtime_error(batch.Error);
+    	}
+    }
+
+    if (writing) {
+    	Writes += count;
+    } else {
+    	Reads += count;
+    }
+}
+
+void StripedDisk::sync() {
+    for (Member *member : Members) {
+    	member->Image->sync();
+    }
+}
+
+void StripedDisk::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    size_t member;
+    uint64_t offset;
+    locate(blocknum, member, offset);
+    Members[member]->Image->read(offset, data);
+
+    Reads++;
+}
+
+void StripedDisk::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    size_t member;
+    uint64_t offset;
+    locate(blocknum, member, offset);
+    Members[member]->Image->write(offset, data);
+
+    Writes++;
+}
+
+void StripedDisk::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    // Stripe units of one member that follow each other in the logical run
+    // also follow each other on the member, so each member gets one discard
+    // per unbroken stretch
+    std::vector<uint64_t> starts(Members.size(), 0);
+    std::vector<size_t>	counts(Members.size(), 0);  // 0 while no stretch is open
+
+    for (size_t done = 0; done < nblocks; ) {
+    	uint64_t block = blocknum + done;
+    	size_t	chunk = std::min(StripeUnit - block % StripeUnit, nblocks - done);
+    	size_t	member;
+    	uint64_t offset;
+    	locate(block, member, offset);
+
+    	if (counts[member] > 0 && starts[member] + counts[member] != offset) {
+    	    Members[member]->Image->discard(starts[member], counts[member]);
+    	    counts[member] = 0;
+    	}
+    	if (counts[member] == 0) {
+    	    starts[member] = offset;
+    	}
+    	counts[member] += chunk;
+    	done += chunk;
+    }
+
+    for (size_t m = 0; m < Members.size(); m++) {
+    	if (counts[m] > 0) {
+    	    Members[m]->Image->discard(starts[m], counts[m]);
+    	}
+    }
+}
+
+void StripedDisk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    range_check(blocknum, nblocks);
+
+    std::vector<BlockRequest> requests(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	requests[i].blocknum = blocknum + i;
+    	requests[i].data     = data + i*BLOCK_SIZE;
+    }
+    dispatch(requests.data(), nblocks, false);
+}
+
+void StripedDisk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    range_check(blocknum, nblocks);
+
+    std::vector<BlockRequest> requests(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	requests[i].blocknum = blocknum + i;
+    	requests[i].data     = data + i*BLOCK_SIZE;
+    }
+    dispatch(requests.data(), nblocks, true);
+}
+
+void StripedDisk::readv(const BlockRequest *requests, size_t count) {
+    dispatch(requests, count, false);
+}
+
+void StripedDisk::writev(const BlockRequest *requests, size_t count) {
+    dispatch(requests, count, true);
+}
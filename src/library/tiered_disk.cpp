@@ -0,0 +1,559 @@
+// tiered_disk.cpp: block device split between a fast and a slow disk image
+
+#include "sfs/tiered_disk.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#include <stdio.h>
+#include <string.h>
+
+// Hold Placement shared for the lifetime of the guard
+class SharedPlacement {
+private:
+    pthread_rwlock_t *Lock;
+
+public:
+    SharedPlacement(pthread_rwlock_t *lock) : Lock(lock) { pthread_rwlock_rdlock(Lock); }
+    ~SharedPlacement() { pthread_rwlock_unlock(Lock); }
+};
+
+// Hold Placement exclusively for the lifetime of the guard
+class ExclusivePlacement {
+private:
+    pthread_rwlock_t *Lock;
+
+public:
+    ExclusivePlacement(pthread_rwlock_t *lock) : Lock(lock) { pthread_rwlock_wrlock(Lock); }
+    ~ExclusivePlacement() { pthread_rwlock_unlock(Lock); }
+};
+
+TieredDisk::TieredDisk() : BlockDevice(), Fast(nullptr), Slow(nullptr), Slots(0), MapBlocks(0),
+    Stopping(false), Interval(+MIGRATE_INTERVAL_MS) {
+    pthread_rwlock_init(&Placement, NULL);
+}
+
+TieredDisk::~TieredDisk() {
+    teardown();
+    pthread_rwlock_destroy(&Placement);
+}
+
+void TieredDisk::open(const char *fast_path, size_t fast_blocks, const char *slow_path, size_t nblocks,
+    	    	      Disk::Mode mode, unsigned interval_ms) {
+    teardown();
+
+    // The fast image needs its header, at least one map block and a slot
+    if (fast_blocks < 3) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open %s: %lu blocks is too small for a fast image", fast_path, fast_blocks);
+    	throw std::runtime_error(what);
+    }
+
+    Slots = fast_blocks - 1;
+    while (Slots + (Slots + SLOTS_PER_MAP_BLOCK - 1) / SLOTS_PER_MAP_BLOCK + 1 > fast_blocks) {
+    	Slots--;
+    }
+    MapBlocks = (Slots + SLOTS_PER_MAP_BLOCK - 1) / SLOTS_PER_MAP_BLOCK;
+
+    try {
+    	Fast = new Disk();
+    	Fast->open(fast_path, fast_blocks, mode);
+    	Slow = new Disk();
+    	Slow->open(slow_path, nblocks, mode);
+
+    	Blocks = nblocks;
+    	Owner.assign(Slots, -1);
+    	load_map();
+    } catch (std::runtime_error &e) {
+    	teardown();
+    	throw;
+    }
+
+    Reads    = 0;
+    Writes   = 0;
+    Stopping = false;
+    if (interval_ms > 0) {
+    	Interval = std::chrono::milliseconds(interval_ms);
+    	Migrator = std::thread(&TieredDisk::work, this);
+    }
+}
+
+void TieredDisk::teardown() {
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Stopping = true;
+    }
+    Wakeup.notify_one();
+    if (Migrator.joinable()) {
+    	Migrator.join();
+    }
+
+    delete Fast;
+    delete Slow;
+    Fast = nullptr;
+    Slow = nullptr;
+    Location.clear();
+    Owner.clear();
+    Metadata.clear();
+    Stale.clear();	// Left on slow image; a later demotion overwrites them
+    Accesses.clear();
+}
+
+void TieredDisk::load_map() {
+    alignas(BLOCK_SIZE) char buffer[BLOCK_SIZE];
+    Header *header = reinterpret_cast<Header *>(buffer);
+
+    Fast->read(0, buffer);
+    if (header->MagicNumber == MAGIC_NUMBER_32) {
+    	// Its slots start elsewhere, so starting over would lose their blocks
+    	throw std::runtime_error("Unable to open tiered disk: fast image has a 32-bit placement map");
+    }
+    if (header->MagicNumber != MAGIC_NUMBER) {
+    	// Fresh fast image: write a header and an empty map
+    	memset(buffer, 0, BLOCK_SIZE);
+    	header->MagicNumber = MAGIC_NUMBER;
+    	header->Blocks      = Blocks;
+    	header->Slots       = Slots;
+    	header->MapBlocks   = MapBlocks;
+    	Fast->discard(1, MapBlocks);
+    	Fast->write(0, buffer);
+    	return;
+    }
+
+    if (header->Blocks != Blocks || header->Slots != Slots || header->MapBlocks != MapBlocks) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open tiered disk: fast image holds %lu blocks in %lu slots, not %lu in %lu",
+    	    	 header->Blocks, header->Slots, Blocks, Slots);
+    	throw std::runtime_error(what);
+    }
+
+    for (size_t m = 0; m < MapBlocks; m++) {
+    	Fast->read(1 + m, buffer);
+    	const uint64_t *entries = reinterpret_cast<uint64_t *>(buffer);
+    	for (size_t i = 0; i < SLOTS_PER_MAP_BLOCK && m*SLOTS_PER_MAP_BLOCK + i < Slots; i++) {
+    	    // Entries hold block + 1 so that a zeroed map is empty
+    	    if (entries[i] == 0 || entries[i] > Blocks) {
+    	    	continue;
+    	    }
+    	    size_t slot = m*SLOTS_PER_MAP_BLOCK + i;
+    	    Owner[slot] = entries[i] - 1;
+    	    Location[entries[i] - 1] = slot;
+    	}
+    }
+}
+
+void TieredDisk::save_map(size_t slot) {
+    alignas(BLOCK_SIZE) char buffer[BLOCK_SIZE];
+    uint64_t *entries = reinterpret_cast<uint64_t *>(buffer);
+
+    size_t m = slot / SLOTS_PER_MAP_BLOCK;
+    memset(buffer, 0, BLOCK_SIZE);
+    for (size_t i = 0; i < SLOTS_PER_MAP_BLOCK && m*SLOTS_PER_MAP_BLOCK + i < Slots; i++) {
+    	entries[i] = Owner[m*SLOTS_PER_MAP_BLOCK + i] + 1;
+    }
+    Fast->write(1 + m, buffer);
+}
+
+uint64_t TieredDisk::locate(uint64_t blocknum, Disk *&image) const {
+    auto slot = Location.find(blocknum);
+    if (slot != Location.end()) {
+    	image = Fast;
+    	return 1 + MapBlocks + slot->second;
+    }
+    image = Slow;
+    return blocknum;
+}
+
+void TieredDisk::touch(uint64_t blocknum) {
+    std::lock_guard<std::mutex> guard(Counting);
+
+    // Once the list is full, blocks not on it wait for the next pass to
+    // drop the ones that went cold
+    auto count = Accesses.find(blocknum);
+    if (count != Accesses.end()) {
+    	if (count->second < UINT32_MAX) {
+    	    count->second++;
+    	}
+    } else if (Accesses.size() < HOT_PER_SLOT * Slots) {
+    	Accesses[blocknum] = 1;
+    }
+}
+
+uint32_t TieredDisk::accesses(uint64_t blocknum) const {
+    auto count = Accesses.find(blocknum);
+    return count == Accesses.end() ? 0 : count->second;
+}
+
+bool TieredDisk::is_metadata(uint64_t blocknum) const {
+    auto run = Metadata.upper_bound(blocknum);
+    return run != Metadata.begin() && std::prev(run)->second > blocknum;
+}
+
+void TieredDisk::move(uint64_t blocknum, int64_t slot) {
+    alignas(BLOCK_SIZE) char buffer[BLOCK_SIZE];
+
+    if (slot >= 0) {
+    	// The data is made durable before the map points at it, and the slow
+    	// copy is only dropped by sync() once the map is durable too
+    	Slow->read(blocknum, buffer);
+    	Fast->write(1 + MapBlocks + slot, buffer);
+    	Fast->sync();
+    	Owner[slot] = blocknum;
+    	Location[blocknum] = slot;
+    	save_map(slot);
+    	Stale.insert(blocknum);
+    	Promotions++;
+    } else {
+    	size_t from = Location.at(blocknum);
+    	Fast->read(1 + MapBlocks + from, buffer);
+    	Slow->write(blocknum, buffer);
+    	Slow->sync();
+    	Stale.erase(blocknum);
+    	Owner[from] = -1;
+    	Location.erase(blocknum);
+    	save_map(from);
+    	Demotions++;
+    }
+}
+
+void TieredDisk::work() {
+    while (true) {
+    	{
+    	    std::unique_lock<std::mutex> lock(Lock);
+    	    if (Wakeup.wait_for(lock, Interval, [this]() { return Stopping; })) {
+    	    	return;
+    	    }
+    	}
+
+    	try {
+    	    migrate();
+    	} catch (std::exception &e) {
+    	    fprintf(stderr, "Unable to migrate blocks: %s\n", e.what());
+    	}
+    }
+}
+
+size_t TieredDisk::migrate() {
+    // Plan from a snapshot, then recheck every move under the exclusive lock
+    // since I/O carries on in between
+    std::vector<std::pair<uint32_t, uint64_t>> promote;	// (priority, block)
+    std::vector<std::pair<uint32_t, int64_t>> victims;	// (accesses, slot)
+    std::vector<int64_t> free_slots;
+    {
+    	SharedPlacement guard(&Placement);
+    	std::lock_guard<std::mutex> counting(Counting);
+
+    	// Metadata first, walking no further than a batch of it past the
+    	// blocks already on the fast image
+    	size_t metadata = 0;
+    	for (auto run = Metadata.begin(); run != Metadata.end() && metadata < MIGRATE_BATCH; ++run) {
+    	    for (uint64_t b = run->first; b < run->second && metadata < MIGRATE_BATCH; b++) {
+    	    	if (Location.count(b) == 0) {
+    	    	    promote.push_back(std::make_pair(UINT32_MAX, b));
+    	    	    metadata++;
+    	    	}
+    	    }
+    	}
+
+    	for (auto &count : Accesses) {
+    	    if (count.second >= PROMOTE_ACCESSES && Location.count(count.first) == 0 &&
+    	    	!is_metadata(count.first)) {
+    	    	promote.push_back(std::make_pair(count.second, count.first));
+    	    }
+    	}
+
+    	for (size_t s = 0; s < Slots; s++) {
+    	    if (Owner[s] < 0) {
+    	    	free_slots.push_back(s);
+    	    } else if (!is_metadata(Owner[s])) {
+    	    	victims.push_back(std::make_pair(accesses(Owner[s]), (int64_t)s));
+    	    }
+    	}
+    }
+
+    std::sort(promote.begin(), promote.end(), std::greater<std::pair<uint32_t, uint64_t>>());
+    std::sort(victims.begin(), victims.end());
+    std::reverse(free_slots.begin(), free_slots.end());
+    if (promote.size() > MIGRATE_BATCH) {
+    	promote.resize(MIGRATE_BATCH);
+    }
+
+    size_t moved  = 0;
+    size_t victim = 0;
+    for (size_t p = 0; p < promote.size(); p++) {
+    	ExclusivePlacement guard(&Placement);
+
+    	uint64_t block = promote[p].second;
+    	if (Location.count(block) != 0) {
+    	    continue;
+    	}
+
+    	int64_t slot = -1;
+    	while (slot < 0 && !free_slots.empty()) {
+    	    if (Owner[free_slots.back()] < 0) {
+    	    	slot = free_slots.back();
+    	    }
+    	    free_slots.pop_back();
+    	}
+
+    	// Only evict a block that is colder than the one coming in
+    	while (slot < 0 && victim < victims.size() && victims[victim].first < promote[p].first) {
+    	    int64_t candidate = victims[victim++].second;
+    	    if (Owner[candidate] >= 0 && !is_metadata(Owner[candidate])) {
+    	    	move(Owner[candidate], -1);
+    	    	moved++;
+    	    	slot = candidate;
+    	    }
+    	}
+
+    	if (slot < 0) {
+    	    break;
+    	}
+    	move(block, slot);
+    	moved++;
+    }
+
+    // Halve every count so that old accesses fade out, making room for
+    // other blocks once a count reaches zero
+    std::lock_guard<std::mutex> counting(Counting);
+    for (auto count = Accesses.begin(); count != Accesses.end();) {
+    	count->second >>= 1;
+    	if (count->second == 0) {
+    	    count = Accesses.erase(count);
+    	} else {
+    	    ++count;
+    	}
+    }
+
+    return moved;
+}
+
+size_t TieredDisk::resident() {
+    SharedPlacement guard(&Placement);
+
+    return Location.size();
+}
+
+void TieredDisk::metadata(uint64_t blocknum, size_t nblocks, bool metadata) {
+    range_check(blocknum, nblocks);
+
+    ExclusivePlacement guard(&Placement);
+
+    uint64_t first = blocknum;
+    uint64_t end   = blocknum + nblocks;
+    if (first >= end) {
+    	return;
+    }
+
+    // Cut the run out of the ones there are, keeping what sticks out
+    auto run = Metadata.upper_bound(first);
+    if (run != Metadata.begin() && std::prev(run)->second > first) {
+    	--run;
+    }
+    while (run != Metadata.end() && run->first < end) {
+    	uint64_t start = run->first;
+    	uint64_t stop  = run->second;
+    	run = Metadata.erase(run);
+    	if (start < first) {
+    	    Metadata[start] = first;
+    	}
+    	if (stop > end) {
+    	    Metadata[end] = stop;
+    	}
+    }
+    if (!metadata) {
+    	return;
+    }
+
+    // Then add it, merged with the runs it touches
+    auto next = Metadata.find(end);
+    if (next != Metadata.end()) {
+    	end = next->second;
+    	Metadata.erase(next);
+    }
+    auto prev = Metadata.lower_bound(first);
+    if (prev != Metadata.begin() && std::prev(prev)->second == first) {
+    	--prev;
+    	first = prev->first;
+    	Metadata.erase(prev);
+    }
+    Metadata[first] = end;
+}
+
+void TieredDisk::sync() {
+    // The placement map is written as soon as a block moves, so syncing the
+    // fast image covers it too; only then can the slow copies go.  No block
+    // may move in between, or its slow copy would go before its map entry
+    // is synced, so Placement is held until they are gone.
+    {
+    	ExclusivePlacement guard(&Placement);
+    	Fast->sync();
+    	for (auto it = Stale.begin(); it != Stale.end(); it++) {
+    	    Slow->discard(*it, 1);
+    	}
+    	Stale.clear();
+    }
+    Slow->sync();
+}
+
+void TieredDisk::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    {
+    	SharedPlacement guard(&Placement);
+
+    	Disk *image;
+    	uint64_t offset = locate(blocknum, image);
+    	image->read(offset, data);
+    }
+    touch(blocknum);
+
+    Reads++;
+}
+
+void TieredDisk::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    {
+    	SharedPlacement guard(&Placement);
+
+    	Disk *image;
+    	uint64_t offset = locate(blocknum, image);
+    	image->write(offset, data);
+    }
+    touch(blocknum);
+
+    Writes++;
+}
+
+void TieredDisk::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    ExclusivePlacement guard(&Placement);
+
+    // Find the slots of the run, matching a run longer than the fast image
+    // against the slots rather than looking it up block by block
+    uint64_t end = blocknum + nblocks;
+    std::vector<size_t> freed;
+    if (nblocks > Slots) {
+    	for (size_t slot = 0; slot < Slots; slot++) {
+    	    if (Owner[slot] >= 0 && (uint64_t)Owner[slot] >= blocknum && (uint64_t)Owner[slot] < end) {
+    	    	freed.push_back(slot);
+    	    }
+    	}
+    } else {
+    	for (size_t i = 0; i < nblocks; i++) {
+    	    auto slot = Location.find(blocknum + i);
+    	    if (slot != Location.end()) {
+    	    	freed.push_back(slot->second);
+    	    }
+    	}
+    }
+
+    // Free them first and rewrite each map block that changed once
+    std::vector<size_t> changed;
+    for (size_t slot : freed) {
+    	Location.erase(Owner[slot]);
+    	Owner[slot] = -1;
+    	Fast->discard(1 + MapBlocks + slot, 1);
+    	if (std::find(changed.begin(), changed.end(), slot / SLOTS_PER_MAP_BLOCK) == changed.end()) {
+    	    changed.push_back(slot / SLOTS_PER_MAP_BLOCK);
+    	}
+    }
+    for (size_t m = 0; m < changed.size(); m++) {
+    	save_map(changed[m] * SLOTS_PER_MAP_BLOCK);
+    }
+    Stale.erase(Stale.lower_bound(blocknum), Stale.lower_bound(end));
+
+    {
+    	std::lock_guard<std::mutex> counting(Counting);
+    	if (nblocks > Accesses.size()) {
+    	    for (auto count = Accesses.begin(); count != Accesses.end();) {
+    	    	if (count->first >= blocknum && count->first < end) {
+    	    	    count = Accesses.erase(count);
+    	    	} else {
+    	    	    ++count;
+    	    	}
+    	    }
+    	} else {
+    	    for (size_t i = 0; i < nblocks; i++) {
+    	    	Accesses.erase(blocknum + i);
+    	    }
+    	}
+    }
+
+    Slow->discard(blocknum, nblocks);
+}
+
+void TieredDisk::dispatch(const BlockRequest *requests, size_t count, bool writing) {
+    std::vector<BlockRequest> fast;
+    std::vector<BlockRequest> slow;
+
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    {
+    	SharedPlacement guard(&Placement);
+
+    	for (size_t i = 0; i < count; i++) {
+    	    Disk *image;
+    	    BlockRequest request;
+    	    request.blocknum = locate(requests[i].blocknum, image);
+    	    request.data     = requests[i].data;
+    	    (image == Fast ? fast : slow).push_back(request);
+    	}
+
+    	if (writing) {
+    	    Fast->writev(fast.data(), fast.size());
+    	    Slow->writev(slow.data(), slow.size());
+    	} else {
+    	    Fast->readv(fast.data(), fast.size());
+    	    Slow->readv(slow.data(), slow.size());
+    	}
+    }
+
+    for (size_t i = 0; i < count; i++) {
+    	touch(requests[i].blocknum);
+    }
+}
+
+void TieredDisk::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    range_check(blocknum, nblocks);
+
+    std::vector<BlockRequest> requests(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	requests[i].blocknum = blocknum + i;
+    	requests[i].data     = data + i*BLOCK_SIZE;
+    }
+    dispatch(requests.data(), nblocks, false);
+
+    Reads += nblocks;
+}
+
+void TieredDisk::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    range_check(blocknum, nblocks);
+
+    std::vector<BlockRequest> requests(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	requests[i].blocknum = blocknum + i;
+    	requests[i].data     = data + i*BLOCK_SIZE;
+    }
+    dispatch(requests.data(), nblocks, true);
+
+    Writes += nblocks;
+}
+
+void TieredDisk::readv(const BlockRequest *requests, size_t count) {
+    dispatch(requests, count, false);
+
+    Reads += count;
+}
+
+void TieredDisk::writev(const BlockRequest *requests, size_t count) {
+    dispatch(requests, count, true);
+
+    Writes += count;
+}
@@ -0,0 +1,368 @@
+// uring_disk.cpp: io_uring disk emulator
+
+#include "sfs/uring_disk.h"
+#include "sfs/block_pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// <linux/fs.h> (pulled in by <linux/io_uring.h>) defines BLOCK_SIZE as 1024,
+// which would shadow Disk::BLOCK_SIZE in this file
+#undef BLOCK_SIZE
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void UringDisk::open(const char *path, size_t nblocks, Mode mode) {
+    Disk::open(path, nblocks, mode);
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    RingFd = io_uring_setup(QUEUE_DEPTH, &params);
+    if (RingFd < 0) {
+    	// No io_uring in this kernel (or not allowed): stay synchronous
+    	RingFd = -1;
+    	return;
+    }
+    Depth = params.sq_entries;
+
+    SqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    CqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    SqesSize   = params.sq_entries*sizeof(io_uring_sqe);
+
+    SqRing = mmap(NULL, SqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+    CqRing = mmap(NULL, CqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, SqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFd, IORING_OFF_SQES);
+    if (SqRing == MAP_FAILED || CqRing == MAP_FAILED || sqes == MAP_FAILED) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to map io_uring for %s: %s", path, strerror(errno));
+    	if (SqRing == MAP_FAILED) SqRing = nullptr;
+    	if (CqRing == MAP_FAILED) CqRing = nullptr;
+    	if (sqes != MAP_FAILED) munmap(sqes, SqesSize);
+    	teardown();
+    	throw std::runtime_error(what);
+    }
+
+    char *sq = static_cast<char *>(SqRing);
+    char *cq = static_cast<char *>(CqRing);
+    SqHead  = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    SqTail  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    SqMask  = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    SqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    Sqes    = static_cast<io_uring_sqe *>(sqes);
+    CqHead  = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    CqTail  = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    CqMask  = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    Cqes    = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Register the image as fixed file 0
+    if (io_uring_register(RingFd, IORING_REGISTER_FILES, &FileDescriptor, 1) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to register %s with io_uring: %s", path, strerror(errno));
+    	teardown();
+    	throw std::runtime_error(what);
+    }
+
+    // Allocate the buffer pool: Depth blocks callers may fill themselves
+    // followed by one bounce block per slot
+    void *buffers = mmap(NULL, 2*Depth*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to allocate io_uring buffers: %s", strerror(errno));
+    	teardown();
+    	throw std::runtime_error(what);
+    }
+    FixedBuffers = static_cast<char *>(buffers);
+
+    // Register the pool; without it requests just use plain opcodes
+    std::vector<iovec> iov(2*Depth);
+    for (unsigned i = 0; i < 2*Depth; i++) {
+    	iov[i].iov_base = FixedBuffers + i*BLOCK_SIZE;
+    	iov[i].iov_len  = BLOCK_SIZE;
+    }
+    Registered = io_uring_register(RingFd, IORING_REGISTER_BUFFERS, iov.data(), 2*Depth) == 0;
+
+    Slots.resize(Depth);
+    FreeSlots.clear();
+    for (unsigned i = Depth; i > 0; i--) {
+    	FreeSlots.push_back(i-1);
+    }
+}
+
+UringDisk::~UringDisk() {
+    if (RingFd >= 0) {
+    	try {
+    	    wait();
+    	} catch (std::runtime_error &e) {
+    	    // Nothing left to report the failure to
+    	}
+    }
+    teardown();
+}
+
+void UringDisk::teardown() {
+    if (FixedBuffers != nullptr) {
+    	munmap(FixedBuffers, 2*Depth*BLOCK_SIZE);
+    	FixedBuffers = nullptr;
+    }
+    if (Sqes != nullptr) {
+    	munmap(Sqes, SqesSize);
+    	Sqes = nullptr;
+    }
+    if (CqRing != nullptr) {
+    	munmap(CqRing, CqRingSize);
+    	CqRing = nullptr;
+    }
+    if (SqRing != nullptr) {
+    	munmap(SqRing, SqRingSize);
+    	SqRing = nullptr;
+    }
+    if (RingFd >= 0) {
+    	close(RingFd);
+    	RingFd = -1;
+    }
+}
+
+char *UringDisk::fixed_buffer(size_t index) const {
+    if (FixedBuffers == nullptr || index >= Depth) {
+    	return nullptr;
+    }
+    return FixedBuffers + index*BLOCK_SIZE;
+}
+
+void UringDisk::queue(uint64_t blocknum, char *data, bool writing) {
+    sanity_check(blocknum, data);
+
+    // Never have more requests outstanding than the completion ring holds
+    if (Pending + Inflight >= Depth) {
+    	submit();
+    	reap(1);
+    }
+
+    unsigned slot = FreeSlots.back();
+    FreeSlots.pop_back();
+    Slots[slot].blocknum = blocknum;
+    Slots[slot].data     = data;
+    Slots[slot].writing  = writing;
+    Slots[slot].staged   = Direct && !BlockPool::aligned(data);
+
+    // Pick the buffer the kernel transfers to or from
+    char *buffer = data;
+    if (Slots[slot].staged) {
+    	buffer = FixedBuffers + (Depth + slot)*BLOCK_SIZE;
+    	if (writing) {
+    	    memcpy(buffer, data, BLOCK_SIZE);
+    	}
+    }
+
+    unsigned tail  = *SqTail;
+    unsigned index = tail & *SqMask;
+    io_uring_sqe *sqe = &Sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->fd        = 0;
+    sqe->off       = (unsigned long long)blocknum*BLOCK_SIZE;
+    sqe->addr      = (unsigned long long)buffer;
+    sqe->len       = BLOCK_SIZE;
+    sqe->user_data = slot;
+
+    if (Registered && buffer >= FixedBuffers && buffer < FixedBuffers + 2*Depth*BLOCK_SIZE &&
+    	(buffer - FixedBuffers) % BLOCK_SIZE == 0) {
+    	sqe->opcode    = writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    	sqe->buf_index = (buffer - FixedBuffers) / BLOCK_SIZE;
+    }
+
+    SqArray[index] = index;
+    __atomic_store_n(SqTail, tail + 1, __ATOMIC_RELEASE);
+    Pending++;
+}
+
+void UringDisk::submit() {
+    while (Pending > 0) {
+    	int submitted = io_uring_enter(RingFd, Pending, 0, 0);
+    	if (submitted < 0) {
+    	    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+    	    	reap(Inflight > 0 ? 1 : 0);
+    	    	continue;
+    	    }
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to submit to io_uring: %s", strerror(errno));
+    	    throw std::runtime_error(what);
+    	}
+    	Pending  -= submitted;
+    	Inflight += submitted;
+    }
+}
+
+void UringDisk::reap(unsigned min_complete) {
+    if (min_complete > 0) {
+    	while (io_uring_enter(RingFd, 0, min_complete, IORING_ENTER_GETEVENTS) < 0) {
+    	    if (errno != EINTR) {
+    	    	char what[BUFSIZ];
+    	    	snprintf(what, BUFSIZ, "Unable to wait on io_uring: %s", strerror(errno));
+    	    	throw std::runtime_error(what);
+    	    }
+    	}
+    }
+
+    unsigned head = *CqHead;
+    unsigned tail = __atomic_load_n(CqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+    	io_uring_cqe *cqe = &Cqes[head & *CqMask];
+    	unsigned slot = cqe->user_data;
+    	Slot &request = Slots[slot];
+
+    	if (cqe->res != (int)BLOCK_SIZE) {
+    	    if (FailedErrno == 0) {
+    	    	FailedBlock = request.blocknum;
+    	    	FailedErrno = cqe->res < 0 ? -cqe->res : EIO;
+    	    }
+    	} else if (request.staged && !request.writing) {
+    	    memcpy(request.data, FixedBuffers + (Depth + slot)*BLOCK_SIZE, BLOCK_SIZE);
+    	}
+
+    	if (request.writing) {
+    	    Writes++;
+    	} else {
+    	    Reads++;
+    	}
+    	FreeSlots.push_back(slot);
+    	Inflight--;
+    }
+    __atomic_store_n(CqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringDisk::submit_read(uint64_t blocknum, char *data) {
+    if (RingFd < 0) {
+    	Disk::read(blocknum, data);
+    	return;
+    }
+    queue(blocknum, data, false);
+}
+
+void UringDisk::submit_write(uint64_t blocknum, char *data) {
+    if (RingFd < 0) {
+    	Disk::write(blocknum, data);
+    	return;
+    }
+    queue(blocknum, data, true);
+}
+
+void UringDisk::wait() {
+    if (RingFd < 0) {
+    	return;
+    }
+
+    submit();
+    while (Inflight > 0) {
+    	reap(1);
+    }
+
+    if (FailedErrno != 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to transfer %lu: %s", FailedBlock, strerror(FailedErrno));
+    	FailedErrno = 0;
+    	throw std::runtime_error(what);
+    }
+}
+
+void UringDisk::read(uint64_t blocknum, char *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    submit_read(blocknum, data);
+    wait();
+}
+
+void UringDisk::write(uint64_t blocknum, char *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // A zero block is punched out rather than written, as Disk::write does
+    if (Sparse && RingFd >= 0) {
+    	sanity_check(blocknum, data);
+    	if (zero_block(data)) {
+    	    discard(blocknum, 1);
+    	    Writes++;
+    	    return;
+    	}
+    }
+
+    submit_write(blocknum, data);
+    wait();
+}
+
+void UringDisk::readv(const BlockRequest *requests, size_t count) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Check every request before queueing any, so a bad one cannot leave
+    // earlier ones behind on the ring holding the caller's buffers
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+    	submit_read(requests[i].blocknum, requests[i].data);
+    }
+    wait();
+}
+
+void UringDisk::writev(const BlockRequest *requests, size_t count) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    // Requests complete in any order, so only the last write to each block
+    // may be put in flight
+    std::vector<BlockRequest> sorted(requests, requests + count);
+    std::stable_sort(sorted.begin(), sorted.end(),
+    	[](const BlockRequest &a, const BlockRequest &b) {
+    	    return a.blocknum < b.blocknum;
+    	});
+    size_t last = 0;
+    for (size_t i = 0; i < count; i++) {
+    	if (i + 1 < count && sorted[i+1].blocknum == sorted[i].blocknum) {
+    	    continue;
+    	}
+    	sorted[last++] = sorted[i];
+    }
+    sorted.resize(last);
+
+    // Runs of zero blocks are punched out and the rest queued, as
+    // Disk::store does
+    bool sparse = Sparse && RingFd >= 0;
+    for (size_t start = 0, end = 1; start < sorted.size(); start = end++) {
+    	if (!sparse || !zero_block(sorted[start].data)) {
+    	    submit_write(sorted[start].blocknum, sorted[start].data);
+    	    continue;
+    	}
+    	while (end < sorted.size() && sorted[end].blocknum == sorted[end-1].blocknum + 1 &&
+    	       zero_block(sorted[end].data)) {
+    	    end++;
+    	}
+    	discard(sorted[start].blocknum, end - start);
+    	Writes += end - start;
+    }
+    wait();
+}
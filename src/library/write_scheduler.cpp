@@ -0,0 +1,208 @@
+// write_scheduler.cpp: block device wrapper that queues and sorts writes
+
+#include "sfs/write_scheduler.h"
+
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+WriteScheduler::WriteScheduler(BlockDevice *device, size_t capacity)
+    : BlockDevice(), Device(device), Buffers(capacity), Capacity(capacity), Absorbed(0), Flushes(0) {
+    Blocks = Device->size();
+}
+
+WriteScheduler::~WriteScheduler() {
+    try {
+    	flush();
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to flush write queue: %s\n", e.what());
+    }
+
+    for (auto &entry : Queue) {
+    	Buffers.release(entry.second);
+    }
+    delete Device;
+}
+
+void WriteScheduler::enqueue(uint64_t blocknum, const char *data) {
+    auto entry = Queue.find(blocknum);
+    if (entry != Queue.end()) {
+    	memcpy(entry->second, data, BLOCK_SIZE);
+    	Absorbed++;
+    	return;
+    }
+
+    if (Queue.size() >= Capacity) {
+    	drain();
+    }
+
+    char *buffer = Buffers.acquire();
+    memcpy(buffer, data, BLOCK_SIZE);
+    Queue[blocknum] = buffer;
+}
+
+void WriteScheduler::overlay(uint64_t blocknum, size_t nblocks, char *data) {
+    auto entry = Queue.lower_bound(blocknum);
+    for (; entry != Queue.end() && (size_t)entry->first < blocknum + nblocks; entry++) {
+    	memcpy(data + (size_t)(entry->first - blocknum)*BLOCK_SIZE, entry->second, BLOCK_SIZE);
+    }
+}
+
+void WriteScheduler::drain() {
+    if (Queue.empty()) {
+    	return;
+    }
+
+    // The map is ordered by block number, so this is the elevator sweep
+    std::vector<BlockRequest> requests;
+    requests.reserve(Queue.size());
+    for (auto &entry : Queue) {
+    	BlockRequest request;
+    	request.blocknum = entry.first;
+    	request.data     = entry.second;
+    	requests.push_back(request);
+    }
+
+    Device->writev(requests.data(), requests.size());
+
+    for (auto &entry : Queue) {
+    	Buffers.release(entry.second);
+    }
+    Queue.clear();
+
+    Writes += requests.size();
+    Flushes++;
+}
+
+void WriteScheduler::flush() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    drain();
+    Device->flush();
+}
+
+void WriteScheduler::sync() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    drain();
+    Device->sync();
+}
+
+size_t WriteScheduler::queued() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Queue.size();
+}
+
+size_t WriteScheduler::absorbed() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Absorbed;
+}
+
+size_t WriteScheduler::flushes() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return Flushes;
+}
+
+// Reads hold the lock across the device call so that a flush cannot retire
+// a queued block between the device read and the overlay
+
+void WriteScheduler::read(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    auto entry = Queue.find(blocknum);
+    if (entry != Queue.end()) {
+    	memcpy(data, entry->second, BLOCK_SIZE);
+    } else {
+    	Device->read(blocknum, data);
+    }
+
+    Reads++;
+}
+
+void WriteScheduler::write(uint64_t blocknum, char *data) {
+    sanity_check(blocknum, data);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    enqueue(blocknum, data);
+}
+
+void WriteScheduler::read_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Device->read_blocks(blocknum, nblocks, data);
+    overlay(blocknum, nblocks, data);
+
+    Reads += nblocks;
+}
+
+void WriteScheduler::write_blocks(uint64_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, data);
+    range_check(blocknum, nblocks);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	enqueue(blocknum + i, data + i*BLOCK_SIZE);
+    }
+}
+
+void WriteScheduler::discard(uint64_t blocknum, size_t nblocks) {
+    range_check(blocknum, nblocks);
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    auto first = Queue.lower_bound(blocknum);
+    auto last  = Queue.lower_bound(blocknum + nblocks);
+    for (auto entry = first; entry != last; entry++) {
+    	Buffers.release(entry->second);
+    	Absorbed++;
+    }
+    Queue.erase(first, last);
+
+    Device->discard(blocknum, nblocks);
+}
+
+void WriteScheduler::readv(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Only blocks missing from the queue go to the device
+    std::vector<BlockRequest> misses;
+    for (size_t i = 0; i < count; i++) {
+    	auto entry = Queue.find(requests[i].blocknum);
+    	if (entry != Queue.end()) {
+    	    memcpy(requests[i].data, entry->second, BLOCK_SIZE);
+    	} else {
+    	    misses.push_back(requests[i]);
+    	}
+    }
+    Device->readv(misses.data(), misses.size());
+
+    Reads += count;
+}
+
+void WriteScheduler::writev(const BlockRequest *requests, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(requests[i].blocknum, requests[i].data);
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t i = 0; i < count; i++) {
+    	enqueue(requests[i].blocknum, requests[i].data);
+    }
+}
@@ -1,16 +1,29 @@
 // sfssh.cpp: Simple file system shell
 
+#include "sfs/buffer_cache.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
-
+#include "sfs/io_profile.h"
+#include "sfs/mmap_disk.h"
+#include "sfs/profiled_disk.h"
+#include "sfs/ram_disk.h"
+#include "sfs/striped_disk.h"
+#include "sfs/tiered_disk.h"
+#include "sfs/uring_disk.h"
+#include "sfs/write_scheduler.h"
+
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Macros
 
@@ -20,49 +33,218 @@
 //
 void list_dir(char * dirname, FileSystem& fs);
 
-void do_debug   (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_format  (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_mount   (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_cat     (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_copyout (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_list    (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_mkfile  (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_mkdir   (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_pwd     (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_cd     (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_remove  (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_stat    (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_copyin  (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_help    (Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_debug   (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_format  (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_mount   (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_cat     (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copyout (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_list    (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_mkfile  (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_mkdir   (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_pwd     (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_cd     (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_remove  (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_stat    (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_advise  (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copyin  (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_migrate (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_flush   (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_profile (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_cache   (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_help    (BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
+
+// Tiered disk under any wrappers, for the migrate command
+static TieredDisk *tiered_disk = nullptr;
 bool copyin(FileSystem &fs, const char *path, size_t inumber);
 
 // Main execution
 
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m|-u|-r|-t fastfile:nblocks|-s nblocks] [-d] [-p] [-w] [-c nblocks] [-H] [-f ms] [-D mode] [-j threads] [-l] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "Usage: %s [-m|-u|-r|-t fastfile:nblocks|-s nblocks] [-d] [-p] [-w] [-c nblocks] [-H] [-f ms] [-D mode] [-j threads] [-l] <diskfile> <nblocks> <folder_to_convert>\n", program);
+    fprintf(stderr, "    -m    memory-map the disk image\n");
+    fprintf(stderr, "    -u    issue disk I/O through io_uring\n");
+    fprintf(stderr, "    -r    load the disk image into memory and never write it back\n");
+    fprintf(stderr, "    -t    keep hot blocks on a fast image of nblocks blocks and the\n");
+    fprintf(stderr, "          rest on <diskfile> (see the migrate command)\n");
+    fprintf(stderr, "    -d    open the disk image with O_DIRECT\n");
+    fprintf(stderr, "    -p    profile disk I/O (see the profile command)\n");
+    fprintf(stderr, "    -w    queue writes and issue them in block order (see the flush command)\n");
+    fprintf(stderr, "    -c    blocks in the file system's buffer cache (default %lu,\n", BufferCache::CACHE_BLOCKS);
+    fprintf(stderr, "          see the cache command)\n");
+    fprintf(stderr, "    -H    back the buffer cache with huge pages\n");
+    fprintf(stderr, "    -f    write dirty blocks back in the background every ms milliseconds\n");
+    fprintf(stderr, "          (default %u, 0 for never)\n", FileSystem::FLUSH_INTERVAL_MS);
+    fprintf(stderr, "    -D    sync the disk image never (none), after every background\n");
+    fprintf(stderr, "          write back (periodic) or on unmount (close, the default)\n");
+    fprintf(stderr, "    -j    threads scanning the inodes when mount has to rebuild the\n");
+    fprintf(stderr, "          allocation bitmaps (default one per CPU)\n");
+    fprintf(stderr, "    -l    mount without waiting for that scan; allocations wait for\n");
+    fprintf(stderr, "          the part of it they need\n");
+    fprintf(stderr, "    -s    blocks per stripe unit when <diskfile> is a comma-separated\n");
+    fprintf(stderr, "          list of images to stripe across (default %lu)\n", StripedDisk::STRIPE_UNIT);
+}
+
 int main(int argc, char *argv[]) {
-    Disk	disk;
-    FileSystem	fs;
+    const char	*program = argv[0];
+    bool	use_mmap = false;
+    bool	use_uring = false;
+    bool	use_direct = false;
+    bool	use_ram = false;
+    bool	use_profile = false;
+    bool	use_scheduler = false;
+    size_t	cache_blocks = BufferCache::CACHE_BLOCKS;
+    bool	use_huge_pages = false;
+    unsigned	flush_interval = FileSystem::FLUSH_INTERVAL_MS;
+    FileSystem::Durability durability = FileSystem::Durability::ON_CLOSE;
+    size_t	scan_threads = std::max(1u, std::thread::hardware_concurrency());
+    bool	lazy_mount = false;
+    size_t	stripe_unit = StripedDisk::STRIPE_UNIT;
+    std::string	fast_image;
+    size_t	fast_blocks = 0;
+    int	option;
+
+    while ((option = getopt(argc, argv, "mudprws:t:c:Hf:D:j:l")) != -1) {
+    	switch (option) {
+    	    case 't':
+    	    	if (strchr(optarg, ':') == NULL) {
+    	    	    usage(program);
+    	    	    return EXIT_FAILURE;
+    	    	}
+    	    	fast_image  = std::string(optarg, strrchr(optarg, ':'));
+    	    	fast_blocks = strtoull(strrchr(optarg, ':') + 1, NULL, 10);
+    	    	break;
+    	    case 's':
+    	    	stripe_unit = atoi(optarg);
+    	    	break;
+    	    case 'c':
+    	    	cache_blocks = strtoull(optarg, NULL, 10);
+    	    	break;
+    	    case 'H':
+    	    	use_huge_pages = true;
+    	    	break;
+    	    case 'f':
+    	    	flush_interval = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'D':
+    	    	if (streq(optarg, "none")) {
+    	    	    durability = FileSystem::Durability::NONE;
+    	    	} else if (streq(optarg, "periodic")) {
+    	    	    durability = FileSystem::Durability::PERIODIC;
+    	    	} else if (streq(optarg, "close")) {
+    	    	    durability = FileSystem::Durability::ON_CLOSE;
+    	    	} else {
+    	    	    usage(program);
+    	    	    return EXIT_FAILURE;
+    	    	}
+    	    	break;
+    	    case 'j':
+    	    	scan_threads = strtoul(optarg, NULL, 10);
+    	    	break;
+    	    case 'l':
+    	    	lazy_mount = true;
+    	    	break;
+    	    case 'p':
+    	    	use_profile = true;
+    	    	break;
+    	    case 'w':
+    	    	use_scheduler = true;
+    	    	break;
+    	    case 'r':
+    	    	use_ram = true;
+    	    	break;
+    	    case 'd':
+    	    	use_direct = true;
+    	    	break;
+    	    case 'm':
+    	    	use_mmap = true;
+    	    	break;
+    	    case 'u':
+    	    	use_uring = true;
+    	    	break;
+    	    default:
+    	    	usage(program);
+    	    	return EXIT_FAILURE;
+    	}
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // A comma-separated list of images means striping across them
+    std::vector<std::string> members;
+    if (argc >= 2 && strchr(argv[1], ',') != NULL) {
+    	std::stringstream list(argv[1]);
+    	std::string member;
+    	while (std::getline(list, member, ',')) {
+    	    members.push_back(member);
+    	}
+    }
 
-    if (argc != 3 && argc != 4) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks> <folder_to_convert>\n", argv[0]);
+    if ((argc != 3 && argc != 4) || use_mmap + use_uring + use_ram + !members.empty() + !fast_image.empty() > 1 ||
+    	(use_direct && (use_mmap || use_ram))) {
+    	usage(program);
     	return EXIT_FAILURE;
     }
 
+    BlockDevice	*disk = nullptr;
+    FileSystem	fs;
+    size_t	nblocks = strtoull(argv[2], NULL, 10);
+
+    fs.set_cache_blocks(cache_blocks);
+    fs.set_cache_huge_pages(use_huge_pages);
+    fs.set_writeback(flush_interval);
+    fs.set_durability(durability);
+    fs.set_mount_scan(scan_threads, lazy_mount);
+
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	if (!members.empty()) {
+    	    StripedDisk *striped = new StripedDisk();
+    	    disk = striped;
+    	    striped->open(members, nblocks, stripe_unit,
+    	    	    	  use_direct ? Disk::Mode::DIRECT : Disk::Mode::BUFFERED);
+    	} else if (!fast_image.empty()) {
+    	    tiered_disk = new TieredDisk();
+    	    disk = tiered_disk;
+    	    tiered_disk->open(fast_image.c_str(), fast_blocks, argv[1], nblocks,
+    	    	    	      use_direct ? Disk::Mode::DIRECT : Disk::Mode::BUFFERED);
+    	} else if (use_ram) {
+    	    RamDisk *ram = new RamDisk(nblocks);
+    	    disk = ram;
+    	    ram->load(argv[1]);
+    	} else {
+    	    Disk *file;
+    	    if (use_mmap) {
+    	    	file = new MmapDisk();
+    	    } else if (use_uring) {
+    	    	file = new UringDisk();
+    	    } else {
+    	    	file = new Disk();
+    	    }
+    	    disk = file;
+    	    file->open(argv[1], nblocks, use_direct ? Disk::Mode::DIRECT : Disk::Mode::BUFFERED);
+    	}
+    	if (use_profile) {
+    	    disk = new ProfiledDisk(disk);
+    	}
+    	if (use_scheduler) {
+    	    disk = new WriteScheduler(disk);
+    	}
     } catch (std::runtime_error &e) {
     	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	delete disk;
     	return EXIT_FAILURE;
     }
 
-    if (argv[3]) {
+    if (argc == 4) {
         printf("argv[3]: %s\n", argv[3]);
-        fs.format(&disk);
-        fs.mount(&disk);
+        fs.format(disk);
+        fs.mount(disk);
         list_dir(argv[3], fs);
         printf("list_dir executed\n");
+        fs.unmount();
     }
     else {
     
@@ -81,58 +263,77 @@ int main(int argc, char *argv[]) {
                 continue;
             }
 
-            if (streq(cmd, "debug")) {
-                do_debug(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "format")) {
-                do_format(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "mount")) {
-                do_mount(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "cat")) {
-                do_cat(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "copyout")) {
-                do_copyout(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "mkfile")) {
-                do_mkfile(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "mkdir")) {
-                do_mkdir(disk, fs, args, arg1, arg2); 
-            } else if (streq(cmd, "pwd")) {
-                do_pwd(disk, fs, args, arg1, arg2); 
-            } else if (streq(cmd, "cd")) {
-                do_cd(disk, fs, args, arg1, arg2); 
-            } else if (streq(cmd, "ls")) {
-                do_list(disk, fs, args, arg1, arg2); 
-            } else if (streq(cmd, "remove")) {
-                do_remove(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "stat")) {
-                do_stat(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "copyin")) {
-                do_copyin(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "help")) {
-                do_help(disk, fs, args, arg1, arg2);
-            } else if (streq(cmd, "exit") || streq(cmd, "quit")) {
-                break;
-            } else {
-                printf("Unknown command: %s", line);
-                printf("Type 'help' for a list of commands.\n");
+            // a block that fails its checksum aborts just the command
+            try {
+                if (streq(cmd, "debug")) {
+                    do_debug(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "format")) {
+                    do_format(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "mount")) {
+                    do_mount(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "cat")) {
+                    do_cat(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "copyout")) {
+                    do_copyout(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "mkfile")) {
+                    do_mkfile(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "mkdir")) {
+                    do_mkdir(*disk, fs, args, arg1, arg2); 
+                } else if (streq(cmd, "pwd")) {
+                    do_pwd(*disk, fs, args, arg1, arg2); 
+                } else if (streq(cmd, "cd")) {
+                    do_cd(*disk, fs, args, arg1, arg2); 
+                } else if (streq(cmd, "ls")) {
+                    do_list(*disk, fs, args, arg1, arg2); 
+                } else if (streq(cmd, "remove")) {
+                    do_remove(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "stat")) {
+                    do_stat(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "advise")) {
+                    do_advise(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "copyin")) {
+                    do_copyin(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "migrate")) {
+                    do_migrate(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "flush")) {
+                    do_flush(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "profile")) {
+                    do_profile(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "cache")) {
+                    do_cache(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "help")) {
+                    do_help(*disk, fs, args, arg1, arg2);
+                } else if (streq(cmd, "exit") || streq(cmd, "quit")) {
+                    break;
+                } else {
+                    printf("Unknown command: %s", line);
+                    printf("Type 'help' for a list of commands.\n");
+                }
+            } catch (std::runtime_error &e) {
+                printf("%s failed: %s\n", cmd, e.what());
             }
         }
     }
 
+    fs.unmount();
+    delete disk;
     return EXIT_SUCCESS;
 }
 
 // Command functions
 
-void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_debug(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
     	printf("Usage: debug\n");
     	return;
     }
 
+    // debug reads the disk itself, so cached changes go out first
+    fs.sync();
     fs.debug(&disk);
 }
 
-void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_format(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
     	printf("Usage: format\n");
     	return;
@@ -145,7 +346,7 @@ void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_mount(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
     	printf("Usage: mount\n");
     	return;
@@ -158,7 +359,7 @@ void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_cat(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: cat <inode>\n");
     	return;
@@ -169,7 +370,7 @@ void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_mkfile(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_mkfile(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: mkfile file_name\n");
     	return;
@@ -181,7 +382,7 @@ void do_mkfile(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
         printf("failed to create file\n");
     }
 }
-void do_mkdir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_mkdir(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: mkdir dir_name\n");
     	return;
@@ -194,7 +395,7 @@ void do_mkdir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_pwd(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_pwd(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
     	printf("Usage: pwd\n");
     	return;
@@ -204,7 +405,7 @@ void do_pwd(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
 }
 
-void do_list(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_list(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 1) {
     	printf("usage: ls\n");
     	return;
@@ -214,7 +415,7 @@ void do_list(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
 }
 
-void do_cd(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_cd(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("usage: cd directory_name\n");
     	return;
@@ -226,7 +427,7 @@ void do_cd(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
 }
 
-void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_remove(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: remove <inode>\n");
     	return;
@@ -240,7 +441,7 @@ void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_stat(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: stat <inode>\n");
     	return;
@@ -255,7 +456,33 @@ void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_advise(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    static const struct {
+    	const char	    *name;
+    	FileSystem::Advice  advice;
+    } advices[] = {
+    	{"normal",	FileSystem::Advice::NORMAL},
+    	{"sequential",	FileSystem::Advice::SEQUENTIAL},
+    	{"random",	FileSystem::Advice::RANDOM},
+    	{"willneed",	FileSystem::Advice::WILLNEED},
+    	{"dontneed",	FileSystem::Advice::DONTNEED},
+    	{"noreuse",	FileSystem::Advice::NOREUSE},
+    };
+
+    if (args == 3) {
+    	for (auto &entry : advices) {
+    	    if (streq(arg2, entry.name)) {
+    	    	if (!fs.advise(atoi(arg1), entry.advice)) {
+    	    	    printf("advise failed!\n");
+    	    	}
+    	    	return;
+    	    }
+    	}
+    }
+    printf("Usage: advise <inode> normal|sequential|random|willneed|dontneed|noreuse\n");
+}
+
+void do_copyout(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
     	printf("Usage: copyout <inode> <file>\n");
     	return;
@@ -267,18 +494,98 @@ void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 }
 
 
-void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_copyin(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
-        printf("    copyin  <src_file> <dst_simplefs_file>\n");
+        printf("Usage: copyin <file> <inode>\n");
     	return;
     }
 
-    /* if (!copyin(fs, arg1, arg2)) { */
-    /* 	printf("copyin failed!\n"); */
-    /* } */
+    if (!copyin(fs, arg1, atoi(arg2))) {
+    	printf("copyin failed!\n");
+    }
+}
+
+void do_migrate(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: migrate\n");
+    	return;
+    }
+
+    if (tiered_disk == nullptr) {
+    	printf("migrate needs a tiered disk (run with -t)\n");
+    	return;
+    }
+
+    try {
+    	size_t moved = tiered_disk->migrate();
+    	printf("%lu blocks moved, %lu of %lu fast slots in use\n",
+    	       moved, tiered_disk->resident(), tiered_disk->slots());
+    	printf("%lu blocks promoted, %lu demoted so far\n",
+    	       tiered_disk->promotions(), tiered_disk->demotions());
+    } catch (std::runtime_error &e) {
+    	printf("migrate failed: %s\n", e.what());
+    }
+}
+
+void do_flush(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: flush\n");
+    	return;
+    }
+
+    try {
+    	fs.sync();
+    	disk.flush();
+    } catch (std::runtime_error &e) {
+    	printf("flush failed: %s\n", e.what());
+    }
+}
+
+void do_profile(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "reset"))) {
+    	printf("Usage: profile [reset]\n");
+    	return;
+    }
+
+    IOProfile *profile = disk.profile();
+    if (args == 2) {
+    	if (profile != nullptr) {
+    	    profile->reset();
+    	}
+    	return;
+    }
+
+    printf("%lu disk block reads\n", disk.reads());
+    printf("%lu disk block writes\n", disk.writes());
+    if (profile == nullptr) {
+    	printf("run with -p for latency, seek and block class statistics\n");
+    	return;
+    }
+    profile->dump(stdout);
 }
 
-void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+void do_cache(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: cache\n");
+    	return;
+    }
+
+    BufferCache *cache = fs.cache();
+    if (cache == nullptr) {
+    	printf("must be mounted\n");
+    	return;
+    }
+
+    size_t hits   = cache->hits();
+    size_t misses = cache->misses();
+    printf("%lu cache hits, %lu misses (%.1f%% hit rate)\n", hits, misses,
+           hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    printf("%lu blocks cached, %lu dirty\n", cache->cached(), cache->dirty());
+    printf("%lu evictions, %lu blocks written back\n", cache->evictions(), cache->writebacks());
+    printf("%lu blocks prefetched\n", cache->prefetches());
+}
+
+void do_help(BlockDevice &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
     printf("    format\n");
     printf("    mount\n");
@@ -291,8 +598,13 @@ void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("    cd      <dir_name>\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
-    printf("    copyin  <src_file> <dst_simplefs_file>\n");
+    printf("    advise  <inode> <advice>\n");
+    printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    migrate\n");
+    printf("    flush\n");
+    printf("    profile [reset]\n");
+    printf("    cache\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -307,9 +619,20 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
 
     char buffer[4*BUFSIZ] = {0};
 
-    ssize_t result = fs.read(inumber, buffer);
+    ssize_t result = 0;
+    while (true) {
+        ssize_t bytes = fs.read(inumber, buffer, sizeof(buffer), result);
+        if (bytes < 0) {
+            result = bytes;
+        }
+        if (bytes <= 0) {
+            break;
+        }
+        fwrite(buffer, 1, bytes, stream);
+        result += bytes;
+    }
 
-    printf("%lu bytes copied\n", offset);
+    printf("%ld bytes copied\n", result);
     fclose(stream);
     return true;
 }
@@ -321,15 +644,17 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     	return false;
     }
 
-    char buffer[1024*1024*10] = {0};
+    // too large for the stack
+    std::vector<char> buffer(1024*1024*10);
 
-    ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
+    ssize_t result = fread(buffer.data(), 1, buffer.size(), stream);
 
     if (result <= 0) {
+        fclose(stream);
         return false;
     }
 
-    ssize_t actual = fs.write(inumber, buffer, result);
+    ssize_t actual = fs.write(inumber, buffer.data(), result);
 
     printf("%lu bytes copied\n", actual);
     fclose(stream);
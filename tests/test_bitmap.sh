@@ -0,0 +1,133 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+change-input() {
+    cat <<EOF
+mount
+remove 1
+mkdir games
+EOF
+}
+
+allocate-input() {
+    cat <<EOF
+mount
+mkdir music
+mkfile readme
+mkdir books
+debug
+EOF
+}
+
+# enough files that the inodes in use span several scan ranges
+setup() {
+    mkdir -p $SCRATCH/folder
+    for i in $(seq 1 2100); do
+    	echo "file $i" > $SCRATCH/folder/file$i
+    done
+    seq 1 30000 > $SCRATCH/folder/large
+    rm -f $SCRATCH/image.clean
+    ./bin/sfssh $SCRATCH/image.clean 4000 $SCRATCH/folder > /dev/null 2>&1
+    change-input | ./bin/sfssh $SCRATCH/image.clean 4000 > /dev/null 2>&1
+}
+
+test-rescan() {
+    NAME=$1
+    shift
+
+    echo -n "Testing bitmap against $NAME rescan ... "
+    cp $SCRATCH/image.base $SCRATCH/image.unclean
+    # kill the shell while mounted, so the next mount scans every inode
+    { timeout -s KILL 1 ./bin/sfssh $SCRATCH/image.unclean 4000 < <(echo mount; sleep 3) > /dev/null; } 2> /dev/null
+    allocate-input | ./bin/sfssh "$@" $SCRATCH/image.unclean 4000 2> /dev/null |
+    	grep -v "not unmounted cleanly" > $SCRATCH/unclean.log
+    if diff -u $SCRATCH/clean.log $SCRATCH/unclean.log > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+echo -n "Testing bitmap clean mount ... "
+setup
+# only the root inode's block is read; the bitmaps stand in for the scan,
+# and of the checksum table only the block covering the root inode's block
+# is read, the table checksum being trusted rather than recomputed
+BITMAPS=$(echo debug | ./bin/sfssh $SCRATCH/image.clean 4000 2> /dev/null |
+    sed -n 's/^ *\([0-9]*\) bitmap blocks$/\1/p')
+printf "mount\nprofile\n" | ./bin/sfssh -p $SCRATCH/image.clean 4000 > $SCRATCH/profile.log 2> /dev/null
+if grep -q "^ *superblock  *1 " $SCRATCH/profile.log &&
+   grep -q "^ *inode  *1  *0 " $SCRATCH/profile.log &&
+   grep -q "^ *table  *$((BITMAPS + 1))  *0 " $SCRATCH/profile.log &&
+   grep -q "^ *indirect  *0  *0 " $SCRATCH/profile.log &&
+   grep -q "^ *data  *0  *0 " $SCRATCH/profile.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/profile.log
+fi
+
+cp $SCRATCH/image.clean $SCRATCH/image.base
+allocate-input | ./bin/sfssh $SCRATCH/image.clean 4000 > $SCRATCH/clean.log 2> /dev/null
+
+test-rescan serial   -j 1
+test-rescan parallel -j 4
+test-rescan lazy     -j 4 -l
+
+echo -n "Testing inode allocation in the dirty inode block ... "
+cp $SCRATCH/image.base $SCRATCH/image.inodes
+# the block freed into last has room, so it is filled before the lowest
+printf "mount\nremove 100\nremove 1500\nmkfile first\nstat 100\nstat 1500\nmkfile second\nstat 100\n" |
+    ./bin/sfssh $SCRATCH/image.inodes 4000 2> /dev/null | grep "stat\|size" > $SCRATCH/inodes.log
+printf "stat failed!\ninode 1500 has size 0 bytes.\ninode 100 has size 0 bytes.\n" > $SCRATCH/expected.log
+if diff -u $SCRATCH/expected.log $SCRATCH/inodes.log > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing lazy mount of an image left not clean ... "
+mkdir -p $SCRATCH/small
+echo "readme" > $SCRATCH/small/readme
+./bin/sfssh $SCRATCH/image.large 20000 $SCRATCH/small > /dev/null 2>&1
+{ timeout -s KILL 1 ./bin/sfssh $SCRATCH/image.large 20000 < <(echo mount; sleep 3) > /dev/null; } 2> /dev/null
+# mount returns having read the superblock and little else; the scan,
+# which reads the inode blocks but no free block, goes on behind it
+printf "mount\nprofile\n" | ./bin/sfssh -p -l -j 1 $SCRATCH/image.large 20000 > $SCRATCH/lazy.log 2> /dev/null
+READS=$(sed -n 's/^\([0-9]*\) disk block reads$/\1/p' $SCRATCH/lazy.log)
+if grep -q "not unmounted cleanly" $SCRATCH/lazy.log && [ -n "$READS" ] && [ "$READS" -lt 2500 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/lazy.log
+fi
+
+echo -n "Testing bitmap allocation in a nearly full image ... "
+./bin/sfssh $SCRATCH/image.full 400 $SCRATCH/small > /dev/null 2>&1
+head -c 4096 /dev/urandom > $SCRATCH/one
+head -c $((3 * 4096)) /dev/urandom > $SCRATCH/three
+head -c $((352 * 4096)) /dev/urandom > $SCRATCH/fill
+# readme holds block 44 and these 45 to 398, leaving only the last block
+printf "mount\nmkfile first\ncopyin $SCRATCH/one 2\nmkfile fill\ncopyin $SCRATCH/fill 3\n" |
+    ./bin/sfssh -f 0 $SCRATCH/image.full 400 > /dev/null 2>&1
+# the last block is found, the next allocation wraps around to the block
+# freed at the front, and then there is no room left
+printf "mount\nmkfile last\ncopyin $SCRATCH/one 4\nflush\nremove 2\nmkfile front\ncopyin $SCRATCH/one 2\nflush\nmkfile none\ncopyin $SCRATCH/one 5\ndebug\n" |
+    ./bin/sfssh -f 0 $SCRATCH/image.full 400 2> /dev/null > $SCRATCH/full.log
+# after a remount the bitmaps count the one block freed and no more
+printf "mount\nremove 4\nmkfile again\ncopyin $SCRATCH/three 4\ndebug\n" |
+    ./bin/sfssh -f 0 $SCRATCH/image.full 400 2> /dev/null > $SCRATCH/remount.log
+if grep -A2 "^Inode 4:" $SCRATCH/full.log | grep -q "direct blocks: 399$" &&
+   grep -A2 "^Inode 2:" $SCRATCH/full.log | grep -q "direct blocks: 45$" &&
+   grep -q "^0 bytes copied" $SCRATCH/full.log &&
+   grep -q "^4096 bytes copied" $SCRATCH/remount.log &&
+   grep -A2 "^Inode 4:" $SCRATCH/remount.log | grep -q "direct blocks: 399$"; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/full.log $SCRATCH/remount.log
+fi
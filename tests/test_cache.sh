@@ -0,0 +1,236 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+mkdir levels
+cd ..
+ls
+debug
+EOF
+}
+
+# A cache too small for the working set evicts and writes back all the time,
+# and must leave the same image behind as one that never evicts
+test-cache-capacity() {
+    DISK=$1
+    BLOCKS=$2
+    CAPACITY=$3
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.small
+    echo -n "Testing cache of $CAPACITY blocks on $DISK ... "
+    test-input | ./bin/sfssh              $SCRATCH/image.file  $BLOCKS > $SCRATCH/file.log  2> /dev/null
+    test-input | ./bin/sfssh -c $CAPACITY $SCRATCH/image.small $BLOCKS > $SCRATCH/small.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/small.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.small >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+# A cache on huge pages, or on whatever backs it where there are none, behaves
+# as one on the heap
+test-cache-huge() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.huge
+    echo -n "Testing cache on huge pages on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file $BLOCKS > $SCRATCH/file.log 2> /dev/null
+    test-input | ./bin/sfssh -H $SCRATCH/image.huge $BLOCKS > $SCRATCH/huge.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/huge.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.huge >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+# Listing a directory again is served from the cache
+test-cache-hits() {
+    echo -n "Testing cache hits ... "
+    cp data/image.200 $SCRATCH/image.hits
+    printf "format\nmount\nmkdir games\nmkfile readme\n" | ./bin/sfssh $SCRATCH/image.hits 200 > /dev/null 2>&1
+    printf "mount\nls\ncache\nls\ncache\n" | ./bin/sfssh $SCRATCH/image.hits 200 2> /dev/null |
+    	grep "cache hits" > $SCRATCH/hits.log
+    FIRST=$(sed -n 1p $SCRATCH/hits.log | awk '{print $1, $4}')
+    SECOND=$(sed -n 2p $SCRATCH/hits.log | awk '{print $1, $4}')
+    if [ "${FIRST#* }" = "${SECOND#* }" ] && [ "${SECOND% *}" -gt "${FIRST% *}" ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/hits.log
+    fi
+}
+
+# Inodes already decoded are served without touching the block cache
+test-inode-cache() {
+    echo -n "Testing inode cache ... "
+    cp data/image.200 $SCRATCH/image.inodes
+    printf "format\nmount\nmkdir games\nmkfile readme\n" | ./bin/sfssh $SCRATCH/image.inodes 200 > /dev/null 2>&1
+    printf "mount\nstat 1\ncache\nstat 1\nstat 1\ncache\n" | ./bin/sfssh $SCRATCH/image.inodes 200 2> /dev/null |
+    	grep "cache hits" > $SCRATCH/inodes.log
+    if [ $(wc -l < $SCRATCH/inodes.log) -eq 2 ] && [ $(uniq $SCRATCH/inodes.log | wc -l) -eq 1 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/inodes.log
+    fi
+}
+
+# Inodes created one after another share an inode block, which is written
+# once when they are synced
+test-inode-writeback() {
+    echo -n "Testing inode writeback ... "
+    cp data/image.200 $SCRATCH/image.writeback
+    printf "format\nmount\nprofile reset\nmkfile a\nmkfile b\nmkfile c\nmkfile d\nflush\nprofile\n" |
+    	./bin/sfssh -p $SCRATCH/image.writeback 200 > $SCRATCH/writeback.log 2> /dev/null
+    if grep -q "^ *inode  *0  *1 " $SCRATCH/writeback.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/writeback.log
+    fi
+}
+
+# Walking the same directories again is answered from the dentry cache, and
+# a name looked up before it existed is found once it is created
+test-dentry-cache() {
+    echo -n "Testing dentry cache ... "
+    cp data/image.200 $SCRATCH/image.dentries
+    printf "format\nmount\nmkdir games\ncd games\nmkdir levels\n" | ./bin/sfssh $SCRATCH/image.dentries 200 > /dev/null 2>&1
+    printf "mount\ncd games\ncd levels\ncd ..\ncd ..\ncd missing\ncache\ncd games\ncd levels\ncd ..\ncd ..\ncd missing\ncache\nmkdir missing\ncd missing\npwd\n" |
+    	./bin/sfssh $SCRATCH/image.dentries 200 2> /dev/null > $SCRATCH/dentries.log
+    grep "cache hits" $SCRATCH/dentries.log > $SCRATCH/hits.log
+    if [ $(uniq $SCRATCH/hits.log | wc -l) -eq 1 ] && [ "$(tail -n 1 $SCRATCH/dentries.log)" = "missing" ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/dentries.log
+    fi
+}
+
+# The flusher keeps the dirty share of a small cache under the dirty ratio
+# without being asked to, and leaves everything to unmount when turned off
+test-writeback() {
+    echo -n "Testing background write back ... "
+    cp data/image.200 $SCRATCH/image.writeback
+    (printf "format\nmount\nmkdir a\nmkdir b\nmkdir c\nmkdir d\nmkfile e\n"; sleep 0.5; printf "cache\n") |
+    	./bin/sfssh -c 16 -f 10 $SCRATCH/image.writeback 200 2> /dev/null > $SCRATCH/flusher.log
+    (printf "format\nmount\nmkdir a\nmkdir b\nmkdir c\nmkdir d\nmkfile e\n"; sleep 0.5; printf "cache\n") |
+    	./bin/sfssh -c 16 -f 0  $SCRATCH/image.writeback 200 2> /dev/null > $SCRATCH/none.log
+    DIRTY=$(awk '/blocks cached/ {print $4}' $SCRATCH/flusher.log)
+    FLUSHED=$(awk '/written back/ {print $3}' $SCRATCH/flusher.log)
+    if [ "$DIRTY" -le 3 ] && [ "$FLUSHED" -gt 0 ] && grep -q " 0 blocks written back" $SCRATCH/none.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/flusher.log $SCRATCH/none.log
+    fi
+}
+
+# How hard the disk is synced changes nothing about what ends up in the image
+test-durability() {
+    MODE=$1
+
+    cp data/image.200 $SCRATCH/image.file
+    cp data/image.200 $SCRATCH/image.durable
+    echo -n "Testing durability $MODE ... "
+    test-input | ./bin/sfssh          $SCRATCH/image.file    200 > $SCRATCH/file.log    2> /dev/null
+    test-input | ./bin/sfssh -D $MODE $SCRATCH/image.durable 200 > $SCRATCH/durable.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/durable.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.durable >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+# A file of 42 blocks, so reading it takes the indirect block too
+advise-image() {
+    mkdir -p $SCRATCH/folder
+    seq 1 30000 > $SCRATCH/folder/numbers
+    cp data/image.200 $SCRATCH/image.advise
+    ./bin/sfssh $SCRATCH/image.advise 200 $SCRATCH/folder > /dev/null 2>&1
+}
+
+# Whatever the advice, a file reads back the same, even through a cache too
+# small to hold it
+test-advise-read() {
+    ADVICE=$1
+
+    echo -n "Testing read with $ADVICE advice ... "
+    printf "mount\nadvise 1 $ADVICE\ncat 1\ncat 1\n" | ./bin/sfssh -c 16 $SCRATCH/image.advise 200 2> /dev/null |
+    	grep -v "^\[+\]\|^disk mounted\|bytes copied" > $SCRATCH/advise.log
+    if cat $SCRATCH/folder/numbers $SCRATCH/folder/numbers | cmp - $SCRATCH/advise.log > /dev/null; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	head $SCRATCH/advise.log
+    fi
+}
+
+# WILLNEED reads the whole file in ahead of use and DONTNEED drops it again
+test-advise-cache() {
+    echo -n "Testing willneed and dontneed advice ... "
+    printf "mount\nadvise 1 willneed\ncache\ncat 1\ncache\nadvise 1 dontneed\ncache\n" |
+    	./bin/sfssh $SCRATCH/image.advise 200 2> /dev/null > $SCRATCH/advise.log
+    CACHED=$(awk '/blocks cached/ {print $1}' $SCRATCH/advise.log | tr '\n' ' ')
+    PREFETCHED=$(awk '/blocks prefetched/ {print $1}' $SCRATCH/advise.log | tr '\n' ' ')
+    MISSES=$(awk '/cache hits/ {print $4}' $SCRATCH/advise.log | tr '\n' ' ')
+    set -- $CACHED $PREFETCHED $MISSES
+    if [ $1 -ge 42 ] && [ $3 -lt 3 ] && [ $4 -ge 42 ] && [ $4 = $6 ] && [ $7 = $8 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/advise.log
+    fi
+}
+
+# A file read with NOREUSE goes through a small cache without pushing out the
+# directory listed before
+test-advise-noreuse() {
+    echo -n "Testing noreuse advice ... "
+    printf "mount\nls\nls\nadvise 1 noreuse\ncat 1\ncache\nls\ncache\n" |
+    	./bin/sfssh -c 16 $SCRATCH/image.advise 200 2> /dev/null | grep -a "cache hits" > $SCRATCH/advise.log
+    if [ $(awk '{print $4}' $SCRATCH/advise.log | uniq | wc -l) -eq 1 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/advise.log
+    fi
+}
+
+test-cache-capacity data/image.20  20  1
+test-cache-capacity data/image.200 200 1
+test-cache-capacity data/image.200 200 4
+test-cache-huge data/image.200 200
+test-cache-hits
+test-inode-cache
+test-inode-writeback
+test-dentry-cache
+test-writeback
+test-durability none
+test-durability periodic
+advise-image
+test-advise-read normal
+test-advise-read sequential
+test-advise-read random
+test-advise-read noreuse
+test-advise-cache
+test-advise-noreuse
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+setup-input() {
+    cat <<EOF
+format
+mount
+mkdir games
+mkfile readme
+EOF
+}
+
+list-input() {
+    cat <<EOF
+mount
+ls
+EOF
+}
+
+list-output() {
+    printf "[+] root dir mounted\ndisk mounted.\n\x1b[94mgames\x1b[39m\nreadme\n"
+}
+
+setup() {
+    cp data/image.200 $SCRATCH/image.200
+    setup-input | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+}
+
+# Overwrite one byte of the image
+corrupt() {
+    printf '\x55' | dd of=$SCRATCH/image.200 bs=1 seek=$1 conv=notrunc 2> /dev/null
+}
+
+check() {
+    if diff -u $SCRATCH/expected.log $SCRATCH/actual.log > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+echo -n "Testing checksum clean remount ... "
+setup
+list-input | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/actual.log 2> /dev/null
+list-output > $SCRATCH/expected.log
+check
+
+echo -n "Testing checksum unclean remount ... "
+setup
+# kill the shell while mounted, so it never writes the table back
+{ timeout -s KILL 1 ./bin/sfssh $SCRATCH/image.200 200 < <(echo mount; sleep 3) > /dev/null; } 2> /dev/null
+list-input | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/actual.log 2> /dev/null
+(echo "[!] not unmounted cleanly, checking checksums and rebuilding bitmaps"; list-output) > $SCRATCH/expected.log
+check
+
+echo -n "Testing checksum of corrupt inode block after unclean unmount ... "
+setup
+{ timeout -s KILL 1 ./bin/sfssh $SCRATCH/image.200 200 < <(echo mount; sleep 3) > /dev/null; } 2> /dev/null
+# a byte of a free inode, so the file system still makes sense of it
+corrupt $((4096 + 10*64 + 4))
+# the torn block is reported, not given a new checksum, so the next mount
+# still finds it
+list-input | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/actual.log 2> /dev/null
+echo mount | ./bin/sfssh $SCRATCH/image.200 200 >> $SCRATCH/actual.log 2> /dev/null
+(echo "[!] not unmounted cleanly, checking checksums and rebuilding bitmaps"
+ echo "[!] checksum mismatch on block 1, left as it is"
+ list-output
+ echo "[!] not unmounted cleanly, checking checksums and rebuilding bitmaps"
+ echo "[!] checksum mismatch on block 1, left as it is"
+ printf "[+] root dir mounted\ndisk mounted.\n") > $SCRATCH/expected.log
+check
+
+echo -n "Testing checksum of corrupt inode block ... "
+setup
+corrupt $((4096 + 36))
+echo mount | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/actual.log 2> /dev/null
+printf "[-] Checksum mismatch on block 1\nmount failed!\n" > $SCRATCH/expected.log
+check
+
+echo -n "Testing checksum of corrupt superblock ... "
+setup
+corrupt 32
+echo mount | ./bin/sfssh $SCRATCH/image.200 200 > $SCRATCH/actual.log 2> /dev/null
+printf "[-] superblock checksum mismatch\nmount failed!\n" > $SCRATCH/expected.log
+check
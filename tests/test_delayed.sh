@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# every directory made takes a block, and the root a second one once its
+# first is full of their dirents
+mkdir-input() {
+    echo mount
+    for i in $(seq 1 $1); do
+    	echo mkdir dir$i
+    done
+    echo debug
+}
+
+echo -n "Testing delayed allocation of a growing directory ... "
+mkdir -p $SCRATCH/folder
+echo "readme" > $SCRATCH/folder/readme
+./bin/sfssh $SCRATCH/image 400 $SCRATCH/folder > /dev/null 2>&1
+# the root's blocks are placed first, together, rather than between those
+# of the directories made before its first block filled up
+mkdir-input 150 | ./bin/sfssh -f 0 $SCRATCH/image 400 2> /dev/null > $SCRATCH/debug.log
+if grep -A2 "^Inode 0:" $SCRATCH/debug.log | grep -q "direct blocks: 43 45$" &&
+   grep -A2 "^Inode 2:" $SCRATCH/debug.log | grep -q "direct blocks: 46$" &&
+   grep -A2 "^Inode 151:" $SCRATCH/debug.log | grep -q "direct blocks: 195$"; then
+    echo "Success"
+else
+    echo "Failure"
+    grep -A2 "^Inode \(0\|2\|151\):" $SCRATCH/debug.log
+fi
+
+echo -n "Testing delayed allocation of a file removed before write back ... "
+rm -f $SCRATCH/image
+./bin/sfssh $SCRATCH/image 200 $SCRATCH/folder > /dev/null 2>&1
+head -c 30000 /dev/urandom > $SCRATCH/data
+# its blocks never got a place, so not one data block is written
+printf "mount\nmkfile data\nflush\nprofile reset\ncopyin $SCRATCH/data 2\nremove 2\nflush\nprofile\n" |
+    ./bin/sfssh -p -f 0 $SCRATCH/image 200 2> /dev/null > $SCRATCH/profile.log
+if grep -q "^ *data  *0  *0 " $SCRATCH/profile.log; then
+    echo "Success"
+else
+    echo "Failure"
+    grep -A6 "^Block classes:" $SCRATCH/profile.log
+fi
+
+echo -n "Testing delayed allocation of a file read before write back ... "
+rm -f $SCRATCH/image
+./bin/sfssh $SCRATCH/image 200 $SCRATCH/folder > /dev/null 2>&1
+base64 -w 100 /dev/urandom | head -n 300 > $SCRATCH/text
+# cat reopens stdout, so it goes through a pipe rather than to the file
+printf "mount\nmkfile text\ncopyin $SCRATCH/text 2\ncat 2\n" |
+    ./bin/sfssh -f 0 $SCRATCH/image 200 2> /dev/null | cat > $SCRATCH/cat.log
+if grep -v "mounted\|created\|bytes copied" $SCRATCH/cat.log | cmp -s - $SCRATCH/text; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+test-direct() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.direct
+    echo -n "Testing O_DIRECT on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file  $BLOCKS > $SCRATCH/file.log  2> /dev/null
+    test-input | ./bin/sfssh -d $SCRATCH/image.direct $BLOCKS > $SCRATCH/direct.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/direct.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.direct >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-direct data/image.5   5
+test-direct data/image.20  20
+test-direct data/image.200 200
+
+cp data/image.200 $SCRATCH/image.file
+cp data/image.200 $SCRATCH/image.direct
+echo -n "Testing O_DIRECT io_uring on data/image.200 ... "
+test-input | ./bin/sfssh       $SCRATCH/image.file   200 > $SCRATCH/file.log   2> /dev/null
+test-input | ./bin/sfssh -d -u $SCRATCH/image.direct 200 > $SCRATCH/direct.log 2> /dev/null
+if diff -u $SCRATCH/file.log $SCRATCH/direct.log > $SCRATCH/test.log &&
+   cmp $SCRATCH/image.file $SCRATCH/image.direct >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,109 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# A 400 block image has its first data block at 43, taken by the root, and
+# 44 by readme, so a fresh mount places the next file from 45 on.  Every
+# mount starts allocating from the front, and writes are only placed at
+# flush, with -f 0 turning the background flusher off.
+
+# make files of the given sizes in blocks, inode 2 on, placed in order;
+# a file made later takes the lowest inode removed
+write-files() {
+    INUMBER=2
+    for size in "$@"; do
+    	head -c $((size * 4096)) /dev/urandom > $SCRATCH/data.$INUMBER
+    	echo mkfile file$INUMBER
+    	echo copyin $SCRATCH/data.$INUMBER $INUMBER
+    	echo flush
+    	INUMBER=$((INUMBER + 1))
+    done
+}
+
+# rewrite an inode with a file of the given size in blocks
+rewrite-file() {
+    head -c $(($2 * 4096)) /dev/urandom > $SCRATCH/data.$1
+    echo copyin $SCRATCH/data.$1 $1
+    echo flush
+}
+
+# remove the given inodes
+remove-files() {
+    for inumber in "$@"; do
+    	echo remove $inumber
+    done
+}
+
+# print the blocks of an inode in file order, indirect block included
+blocks-of() {
+    grep -A4 "^Inode $1:" $SCRATCH/debug.log |
+    	sed -n 's/^ *\(direct blocks\|indirect block\|indirect data blocks\)://p' |
+    	tr '\n' ' ' | tr -s ' ' | sed 's/^ //; s/ $//'
+}
+
+# format a fresh image and run the commands from stdin on it
+setup() {
+    rm -f $SCRATCH/image
+    ./bin/sfssh $SCRATCH/image 400 $SCRATCH/folder > /dev/null 2>&1
+    { echo mount; cat; } | ./bin/sfssh -f 0 $SCRATCH/image 400 > /dev/null 2>&1
+}
+
+# run the commands from stdin on the image, then debug
+run() {
+    { echo mount; cat; echo debug; } |
+    	./bin/sfssh -f 0 $SCRATCH/image 400 2> /dev/null > $SCRATCH/debug.log
+}
+
+check() {
+    NAME=$1
+    INUMBER=$2
+    EXPECTED=$3
+
+    echo -n "Testing extent allocation $NAME ... "
+    if [ "$(blocks-of $INUMBER)" = "$EXPECTED" ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	echo "expected: $EXPECTED"
+    	echo "got:      $(blocks-of $INUMBER)"
+    fi
+}
+
+mkdir -p $SCRATCH/folder
+echo "readme" > $SCRATCH/folder/readme
+
+# 40 data blocks and their indirect block, in one run
+echo -n | setup
+write-files 40 | run
+check "of a large write" 2 "$(seq -s ' ' 45 85)"
+
+# growing a file continues from its last block, now that its neighbour is
+# gone, rather than from where the previous allocation ended
+echo -n | setup
+{ write-files 3 3; remove-files 3; rewrite-file 2 5; } | run
+check "from the goal block" 2 "45 46 47 48 49"
+
+# holes at 45, 47-50 and 52-54: the first that fits is taken over the one
+# that fits best
+write-files 1 1 4 1 3 1 | setup
+{ remove-files 2 4 6; echo mkfile near; rewrite-file 2 3; } | run
+check "from the near extents" 2 "47 48 49"
+
+# sixteen one block holes from 45 to 75, then one of 3 at 77-79: past the
+# near extents the best fit is taken over the rest of the image
+write-files $(seq 2 33 | sed 's/.*/1/') 3 1 | setup
+{ remove-files $(seq 2 2 32) 34; echo mkfile fit; rewrite-file 2 3; } | run
+check "from the best fit" 2 "77 78 79"
+
+# the image is full but for holes at 46-47 and 49-52: the longest gives 4
+# of the 5 blocks asked for, and the last comes from the other
+write-files 1 2 1 4 346 | setup
+{ remove-files 3 5; echo mkfile longest; rewrite-file 3 5; } | run
+check "from the longest extent" 3 "49 50 51 52 46"
+
+# the image is full but for 45-47 and 48-50, freed one after the other,
+# and 52-55: the first two merge into one extent that holds 5 blocks
+write-files 3 3 1 4 1 342 | setup
+{ remove-files 2 3 5; echo mkfile merged; rewrite-file 2 5; } | run
+check "from merged neighbours" 2 "45 46 47 48 49"
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+test-mmap() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.mmap
+    echo -n "Testing mmap on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file $BLOCKS > $SCRATCH/file.log 2> /dev/null
+    test-input | ./bin/sfssh -m $SCRATCH/image.mmap $BLOCKS > $SCRATCH/mmap.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/mmap.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.mmap >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-mmap data/image.5   5
+test-mmap data/image.20  20
+test-mmap data/image.200 200
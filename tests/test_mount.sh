@@ -133,3 +133,15 @@ else
     echo "Failure"
     cat $SCRATCH/test.log
 fi
+
+# an image from a newer format version is refused rather than misread
+echo -n -e $(printf '\\x%x\\x%x\\x%x\\x%x' 0x10 0x64 0xf0 0xf0) >  $SCRATCH/image.5
+echo -n -e $(printf '\\x%x\\x%x\\x%x\\x%x' 0x03 0x00 0x00 0x00) >> $SCRATCH/image.5
+echo -n -e $(printf '\\x%x\\x%x\\x%x\\x%x' 0x05 0x00 0x00 0x00) >> $SCRATCH/image.5
+echo -n "Testing bad-mount version on $SCRATCH/image.5 ... "
+if diff -u <(bad-mount-input| ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null) <(echo "[-] unsupported format version 3"; bad-mount-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+test-profile() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.profile
+    echo -n "Testing profile on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file    $BLOCKS > $SCRATCH/file.log    2> /dev/null
+    test-input | ./bin/sfssh -p $SCRATCH/image.profile $BLOCKS > $SCRATCH/profile.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/profile.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.profile >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-profile-classes() {
+    echo -n "Testing profile block classes ... "
+    mkdir $SCRATCH/folder
+    head -c 200000 /dev/urandom > $SCRATCH/folder/large
+    rm -f $SCRATCH/image.classes
+    ./bin/sfssh $SCRATCH/image.classes 200 $SCRATCH/folder > /dev/null 2>&1
+    # the buffer cache reads every block once, mostly at mount, and
+    # writes the inode block back at flush; the checksum table and bitmaps
+    # are tables, and removing the file reads no data
+    printf "mount\nremove 1\nflush\nprofile\n" |
+    	./bin/sfssh -p $SCRATCH/image.classes 200 > $SCRATCH/classes.log 2> /dev/null
+    if grep -q "^ *superblock  *1  *1  *1$" $SCRATCH/classes.log &&
+       grep -q "^ *inode  *[0-9]*  *1 " $SCRATCH/classes.log &&
+       grep -q "^ *table  *[1-9][0-9]*  *[1-9][0-9]* " $SCRATCH/classes.log &&
+       grep -q "^ *indirect  *1  *0 " $SCRATCH/classes.log &&
+       grep -q "^ *data  *0  *0 " $SCRATCH/classes.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/classes.log
+    fi
+}
+
+test-profile data/image.5   5
+test-profile data/image.20  20
+test-profile data/image.200 200
+test-profile-classes
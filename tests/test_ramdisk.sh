@@ -0,0 +1,41 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+test-ramdisk() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.ram
+    echo -n "Testing ramdisk on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file $BLOCKS > $SCRATCH/file.log 2> /dev/null
+    test-input | ./bin/sfssh -r $SCRATCH/image.ram  $BLOCKS > $SCRATCH/ram.log  2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/ram.log > $SCRATCH/test.log &&
+       cmp $DISK $SCRATCH/image.ram >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-ramdisk data/image.5   5
+test-ramdisk data/image.20  20
+test-ramdisk data/image.200 200
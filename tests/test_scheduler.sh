@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+test-scheduler() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.scheduler
+    echo -n "Testing scheduler on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file    $BLOCKS > $SCRATCH/file.log    2> /dev/null
+    test-input | ./bin/sfssh -w $SCRATCH/image.scheduler $BLOCKS > $SCRATCH/scheduler.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/scheduler.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.scheduler >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-scheduler-sorted() {
+    echo -n "Testing scheduler write order ... "
+    cp data/image.200 $SCRATCH/image.sorted
+    # format and mount flush the superblock out on their own, so count from after them
+    printf "format\nmount\nprofile reset\nmkdir games\nmkfile readme\ncd games\nmkfile star1\nflush\nprofile\n" |
+    	./bin/sfssh -p -w $SCRATCH/image.sorted 200 > $SCRATCH/sorted.log 2> /dev/null
+    if grep -q "^ *writev: 1 calls" $SCRATCH/sorted.log &&
+       ! grep -q "^ *write: " $SCRATCH/sorted.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/sorted.log
+    fi
+}
+
+test-scheduler data/image.5   5
+test-scheduler data/image.20  20
+test-scheduler data/image.200 200
+test-scheduler-sorted
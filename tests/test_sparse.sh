@@ -0,0 +1,94 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Number of 4K blocks the host has allocated for a file
+allocated() {
+    echo $(( $(stat -c %b $1) * 512 / 4096 ))
+}
+
+test-sparse-format() {
+    BLOCKS=$1
+
+    echo -n "Testing sparse format on $BLOCKS blocks ... "
+    head -c $(($BLOCKS * 4096)) /dev/urandom > $SCRATCH/image.random
+    head -c $(($BLOCKS * 4096)) /dev/zero    > $SCRATCH/image.zero
+    printf "format\nmount\ndebug\n" | ./bin/sfssh $SCRATCH/image.random $BLOCKS > $SCRATCH/random.log 2> /dev/null
+    printf "format\nmount\ndebug\n" | ./bin/sfssh $SCRATCH/image.zero   $BLOCKS > $SCRATCH/zero.log   2> /dev/null
+    if diff -u $SCRATCH/zero.log $SCRATCH/random.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.zero $SCRATCH/image.random >> $SCRATCH/test.log &&
+       [ $(allocated $SCRATCH/image.random) -le 4 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    	echo "$(allocated $SCRATCH/image.random) blocks allocated"
+    fi
+}
+
+test-sparse-remove() {
+    echo -n "Testing sparse remove ... "
+    mkdir $SCRATCH/folder
+    head -c 200000 /dev/urandom > $SCRATCH/folder/large
+    rm -f $SCRATCH/image.remove
+    ./bin/sfssh $SCRATCH/image.remove 200 $SCRATCH/folder > /dev/null 2>&1
+    BEFORE=$(allocated $SCRATCH/image.remove)
+    printf "mount\nremove 1\n" | ./bin/sfssh $SCRATCH/image.remove 200 > /dev/null 2>&1
+    AFTER=$(allocated $SCRATCH/image.remove)
+    # the file took 49 data blocks and an indirect block
+    if [ $(($BEFORE - $AFTER)) -ge 50 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	echo "$BEFORE blocks allocated before remove, $AFTER after"
+    fi
+}
+
+test-sparse-large() {
+    BLOCKS=$1
+
+    # block offsets past 4 GiB overflow 32-bit byte arithmetic
+    echo -n "Testing sparse image of $BLOCKS blocks ... "
+    rm -f $SCRATCH/image.large
+    truncate -s $(($BLOCKS * 4096)) $SCRATCH/image.large
+    printf "format\nmount\nmkdir games\n" | ./bin/sfssh $SCRATCH/image.large $BLOCKS > /dev/null 2>&1
+    printf "mount\nls\n" | ./bin/sfssh $SCRATCH/image.large $BLOCKS > $SCRATCH/large.log 2> /dev/null
+    printf "[+] root dir mounted\ndisk mounted.\n\x1b[94mgames\x1b[39m\n" > $SCRATCH/expected.log
+    if diff -u $SCRATCH/expected.log $SCRATCH/large.log > $SCRATCH/test.log &&
+       [ $(allocated $SCRATCH/image.large) -le 16 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    	echo "$(allocated $SCRATCH/image.large) blocks allocated"
+    fi
+}
+
+test-sparse-zeros() {
+    echo -n "Testing sparse zero writes${1:+ with $1} ... "
+    mkdir -p $SCRATCH/small
+    echo "readme" > $SCRATCH/small/readme
+    head -c $((50 * 4096)) /dev/zero > $SCRATCH/zeros
+    rm -f $SCRATCH/image.zeros
+    ./bin/sfssh $SCRATCH/image.zeros 200 $SCRATCH/small > /dev/null 2>&1
+    BEFORE=$(allocated $SCRATCH/image.zeros)
+    # the 50 zero blocks are punched out rather than written; the indirect
+    # block is the one the file adds
+    printf "mount\nmkfile zeros\ncopyin $SCRATCH/zeros 2\n" |
+    	./bin/sfssh "$@" $SCRATCH/image.zeros 200 > /dev/null 2>&1
+    AFTER=$(allocated $SCRATCH/image.zeros)
+    if [ $(($AFTER - $BEFORE)) -le 4 ]; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	echo "$BEFORE blocks allocated before the write, $AFTER after"
+    fi
+}
+
+test-sparse-format 200
+test-sparse-format 5000
+test-sparse-remove
+test-sparse-zeros
+test-sparse-zeros -u
+test-sparse-large 1100000
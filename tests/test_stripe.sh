@@ -0,0 +1,54 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+mount-input() {
+    cat <<EOF
+mount
+EOF
+}
+
+bad-mount-output() {
+    cat <<EOF
+mount failed!
+EOF
+}
+
+test-stripe() {
+    BLOCKS=$1
+    UNIT=$2
+    MEMBERS=$3
+
+    rm -f $SCRATCH/image.*
+    LIST=$(seq -s, -f "$SCRATCH/image.%g" 1 $MEMBERS)
+    echo -n "Testing stripe on $MEMBERS images of $BLOCKS blocks with unit $UNIT ... "
+    test-input | ./bin/sfssh             $SCRATCH/image.file $BLOCKS > $SCRATCH/file.log 2> /dev/null
+    test-input | ./bin/sfssh -s $UNIT    $LIST $BLOCKS 2> /dev/null | grep -v "striped across" > $SCRATCH/stripe.log
+    if diff -u $SCRATCH/file.log $SCRATCH/stripe.log > $SCRATCH/test.log &&
+       diff -u <(mount-input | ./bin/sfssh -s $((UNIT*2)) $LIST $BLOCKS 2> /dev/null) <(bad-mount-output) >> $SCRATCH/test.log &&
+       diff -u <(mount-input | ./bin/sfssh -s $UNIT ${LIST%,*} $BLOCKS 2> /dev/null) <(bad-mount-output) >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-stripe 20  1 2
+test-stripe 200 4 3
+test-stripe 200 16 4
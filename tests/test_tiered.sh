@@ -0,0 +1,61 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+remount-input() {
+    cat <<EOF
+mount
+cd games
+ls
+cd ..
+ls
+debug
+EOF
+}
+
+test-tiered() {
+    DISK=$1
+    BLOCKS=$2
+    FAST=$3
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.slow
+    rm -f $SCRATCH/image.fast
+    echo -n "Testing tiered on $DISK with $FAST fast blocks ... "
+    test-input | ./bin/sfssh $SCRATCH/image.file $BLOCKS > $SCRATCH/file.log 2> /dev/null
+    test-input | ./bin/sfssh -t $SCRATCH/image.fast:$FAST $SCRATCH/image.slow $BLOCKS > $SCRATCH/tiered.log 2> /dev/null
+
+    # migrate, then check that a later mount finds every block where it went
+    for session in 1 2; do
+    	remount-input | ./bin/sfssh $SCRATCH/image.file $BLOCKS >> $SCRATCH/file.log 2> /dev/null
+    	(remount-input; echo migrate) | ./bin/sfssh -t $SCRATCH/image.fast:$FAST $SCRATCH/image.slow $BLOCKS 2> /dev/null |
+    	    grep -v "blocks moved\|blocks promoted" >> $SCRATCH/tiered.log
+    done
+
+    if diff -u $SCRATCH/file.log $SCRATCH/tiered.log > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-tiered data/image.5   5   4
+test-tiered data/image.20  20  8
+test-tiered data/image.200 200 16
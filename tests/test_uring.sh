@@ -0,0 +1,41 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+test-input() {
+    cat <<EOF
+debug
+format
+mount
+mkdir games
+mkfile readme
+cd games
+mkfile star1
+cd ..
+ls
+debug
+EOF
+}
+
+test-uring() {
+    DISK=$1
+    BLOCKS=$2
+
+    cp $DISK $SCRATCH/image.file
+    cp $DISK $SCRATCH/image.uring
+    echo -n "Testing io_uring on $DISK ... "
+    test-input | ./bin/sfssh    $SCRATCH/image.file  $BLOCKS > $SCRATCH/file.log  2> /dev/null
+    test-input | ./bin/sfssh -u $SCRATCH/image.uring $BLOCKS > $SCRATCH/uring.log 2> /dev/null
+    if diff -u $SCRATCH/file.log $SCRATCH/uring.log > $SCRATCH/test.log &&
+       cmp $SCRATCH/image.file $SCRATCH/image.uring >> $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-uring data/image.5   5
+test-uring data/image.20  20
+test-uring data/image.200 200